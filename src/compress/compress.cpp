@@ -27,6 +27,7 @@
 #include "../conf.h"
 #include "compress.h"
 #include "../util/membuffer.h"
+#include "../util/stats.h"
 
 /*************************************************************************
 //
@@ -37,6 +38,8 @@ unsigned upx_adler32(const void *buf, unsigned len, unsigned adler) {
         return adler;
     assert(buf != nullptr);
 #if 1
+    return upx_fast_adler32(buf, len, adler);
+#elif 1
     return upx_ucl_adler32(buf, len, adler);
 #else
     return upx_zlib_adler32(buf, len, adler);
@@ -57,6 +60,58 @@ unsigned upx_crc32(const void *buf, unsigned len, unsigned crc)
 }
 #endif // UNUSED
 
+/*************************************************************************
+// CompressContextCache
+**************************************************************************/
+
+static constexpr size_t CONTEXT_CACHE_DEFAULT_LIMIT = 64 * 1024 * 1024;
+
+CompressContextCacheBase *CompressContextCacheBase::head = nullptr;
+size_t CompressContextCacheBase::retained_bytes = 0;
+size_t CompressContextCacheBase::limit_bytes = CONTEXT_CACHE_DEFAULT_LIMIT;
+
+#if (WITH_THREADS)
+static std::mutex context_cache_mutex;
+CompressContextCacheBase::Lock::Lock() noexcept { context_cache_mutex.lock(); }
+CompressContextCacheBase::Lock::~Lock() noexcept { context_cache_mutex.unlock(); }
+#else
+CompressContextCacheBase::Lock::Lock() noexcept {}
+CompressContextCacheBase::Lock::~Lock() noexcept {}
+#endif
+
+CompressContextCacheBase::CompressContextCacheBase() noexcept {
+    Lock lock;
+    next = head;
+    head = this;
+}
+
+void CompressContextCacheBase::unregisterLocked() noexcept {
+    for (CompressContextCacheBase **p = &head; *p != nullptr; p = &(*p)->next) {
+        if (*p == this) {
+            *p = next;
+            break;
+        }
+    }
+}
+
+/*static*/ void CompressContextCacheBase::releaseAll() noexcept {
+    Lock lock;
+    for (CompressContextCacheBase *c = head; c != nullptr; c = c->next)
+        c->clearLocked();
+}
+
+/*static*/ void CompressContextCacheBase::setLimit(size_t bytes) noexcept {
+    Lock lock;
+    for (CompressContextCacheBase *c = head; c != nullptr; c = c->next)
+        c->clearLocked();
+    limit_bytes = bytes ? bytes : CONTEXT_CACHE_DEFAULT_LIMIT;
+}
+
+/*static*/ size_t CompressContextCacheBase::getRetainedBytes() noexcept {
+    Lock lock;
+    return retained_bytes;
+}
+
 /*************************************************************************
 //
 **************************************************************************/
@@ -64,6 +119,7 @@ unsigned upx_crc32(const void *buf, unsigned len, unsigned crc)
 int upx_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsigned *dst_len,
                  upx_callback_p cb, int method, int level, const upx_compress_config_t *cconf,
                  upx_compress_result_t *cresult) {
+    PhaseTimer timer(STATS_COMPRESS, src_len);
     int r = UPX_E_ERROR;
     upx_compress_result_t cresult_buffer;
 
@@ -170,6 +226,13 @@ int upx_decompress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsigne
 
 int upx_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off, unsigned src_len,
                      unsigned *dst_len, int method, const upx_compress_result_t *cresult) {
+    MemBuffer scratch;
+    return upx_test_overlap(buf, tbuf, src_off, src_len, dst_len, method, cresult, scratch);
+}
+
+int upx_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off, unsigned src_len,
+                     unsigned *dst_len, int method, const upx_compress_result_t *cresult,
+                     MemBuffer &scratch) {
     int r = UPX_E_ERROR;
 
     if (cresult && cresult->debug.method == 0)
@@ -184,7 +247,7 @@ int upx_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off
     }
 #if (WITH_LZMA)
     else if (M_IS_LZMA(method))
-        r = upx_lzma_test_overlap(buf, tbuf, src_off, src_len, dst_len, method, cresult);
+        r = upx_lzma_test_overlap(buf, tbuf, src_off, src_len, dst_len, method, cresult, scratch);
 #endif
 #if (WITH_NRV)
     else if ((M_IS_NRV2B(method) || M_IS_NRV2D(method) || M_IS_NRV2E(method)) && !opt->prefer_ucl)
@@ -196,7 +259,7 @@ int upx_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off
 #endif
 #if (WITH_ZSTD)
     else if (M_IS_ZSTD(method))
-        r = upx_zstd_test_overlap(buf, tbuf, src_off, src_len, dst_len, method, cresult);
+        r = upx_zstd_test_overlap(buf, tbuf, src_off, src_len, dst_len, method, cresult, scratch);
 #endif
     else {
         throwInternalError("unknown decompression method");
@@ -205,4 +268,82 @@ int upx_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off
     return r;
 }
 
+/*************************************************************************
+// Compute the smallest src_off for which upx_test_overlap() succeeds
+// in a single pass over the compressed data, without decompressing.
+// Returns UPX_E_ERROR if this is not supported for the method; the
+// caller then must fall back to probing with upx_test_overlap().
+**************************************************************************/
+
+int upx_find_overlap(const upx_bytep src, unsigned src_len, unsigned *dst_len, int method,
+                     unsigned *src_off) {
+    int r = UPX_E_ERROR;
+
+    assert(*dst_len > 0);
+    assert(src_len < *dst_len); // must be compressed
+    *src_off = 0;
+
+    if (__acc_cte(false)) {
+    }
+    // NRV and UCL share the same data format and test_overlap semantics
+    else if (M_IS_NRV2B(method) || M_IS_NRV2D(method) || M_IS_NRV2E(method))
+        r = upx_ucl_find_overlap(src, src_len, dst_len, method, src_off);
+#if (WITH_ZSTD)
+    else if (M_IS_ZSTD(method))
+        r = upx_zstd_find_overlap(src, src_len, dst_len, method, src_off);
+#endif
+    // LZMA: not implemented, the decoder state is too complex to mirror here
+
+    return r;
+}
+
+/*************************************************************************
+//
+**************************************************************************/
+
+TEST_CASE("CompressContextCache") {
+    struct Ctx {
+        int *live;
+        explicit Ctx(int *l) : live(l) { ++*live; }
+        ~Ctx() noexcept { --*live; }
+    };
+    int live = 0;
+    const size_t retained = CompressContextCacheBase::getRetainedBytes();
+    {
+        CompressContextCache<Ctx, 2> cache;
+        const CompressContextKey k1 = {M_LZMA, 1, 1024, 0};
+        const CompressContextKey k2 = {M_LZMA, 2, 1024, 0};
+        const CompressContextKey k3 = {M_LZMA, 2, 2048, 0};
+        CHECK(cache.take(k1) == nullptr);
+        Ctx *c1 = new Ctx(&live);
+        cache.put(k1, c1, 100);
+        CHECK(CompressContextCacheBase::getRetainedBytes() == retained + 100);
+        CHECK(cache.take(k2) == nullptr);
+        CHECK(cache.take(k1) == c1);
+        CHECK(cache.take(k1) == nullptr);
+        CHECK(CompressContextCacheBase::getRetainedBytes() == retained);
+        cache.put(k1, c1, 100);
+        cache.put(k2, new Ctx(&live), 100);
+        CHECK(live == 2);
+        // k1 is the least recently used entry and gets evicted
+        cache.put(k3, new Ctx(&live), 100);
+        CHECK(live == 2);
+        CHECK(cache.take(k1) == nullptr);
+        Ctx *c3 = cache.take(k3);
+        CHECK(c3 != nullptr);
+        cache.put(k3, c3, 100);
+        CHECK(CompressContextCacheBase::getRetainedBytes() == retained + 200);
+        // a context that does not fit into the budget is deleted
+        cache.put(k1, new Ctx(&live), size_t(0) - 1);
+        CHECK(live == 2);
+        CompressContextCacheBase::releaseAll();
+        CHECK(live == 0);
+        CHECK(CompressContextCacheBase::getRetainedBytes() == 0);
+        cache.put(k1, new Ctx(&live), 100);
+        CHECK(live == 1);
+    }
+    CHECK(live == 0);
+    CHECK(CompressContextCacheBase::getRetainedBytes() == 0);
+}
+
 /* vim:set ts=4 sw=4 et: */
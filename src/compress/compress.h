@@ -28,6 +28,133 @@
 #ifndef UPX_COMPRESS_H__
 #define UPX_COMPRESS_H__ 1
 
+/*************************************************************************
+// Process-wide cache of compression contexts (encoder state, match finder
+// hash tables and windows), keyed by (method, level, dict size).
+// A context is taken out of the cache for the duration of one compress
+// call and put back afterwards; a context that saw an error is deleted.
+// The contexts are not bound to a thread, so all threads share one cache.
+// The estimated size of all cached contexts of all caches is limited,
+// and everything is freed by releaseAll() after each file.
+**************************************************************************/
+
+struct CompressContextKey final {
+    int method;
+    int level;
+    unsigned dict_size;
+    unsigned extra; // other parameters that cannot be changed on reuse
+    bool operator==(const CompressContextKey &other) const noexcept {
+        return method == other.method && level == other.level &&
+               dict_size == other.dict_size && extra == other.extra;
+    }
+};
+
+class CompressContextCacheBase {
+public:
+    // free all cached contexts of all caches
+    static void releaseAll() noexcept;
+    // limit the estimated size of all cached contexts; 0 means the default
+    static void setLimit(size_t bytes) noexcept;
+    static size_t getRetainedBytes() noexcept;
+
+protected:
+    CompressContextCacheBase() noexcept; // register
+    ~CompressContextCacheBase() noexcept {}
+    void unregisterLocked() noexcept;
+    virtual void clearLocked() noexcept = 0;
+
+    // all caches share one lock and one budget
+    struct Lock final {
+        Lock() noexcept;
+        ~Lock() noexcept;
+    };
+    static size_t retained_bytes;
+    static size_t limit_bytes;
+
+private:
+    CompressContextCacheBase *next = nullptr;
+    static CompressContextCacheBase *head;
+
+    // disable copy and move
+    CompressContextCacheBase(const CompressContextCacheBase &) = delete;
+    CompressContextCacheBase &operator=(const CompressContextCacheBase &) = delete;
+};
+
+template <class T, unsigned N = 8>
+class CompressContextCache final : public CompressContextCacheBase {
+public:
+    CompressContextCache() noexcept {}
+    ~CompressContextCache() noexcept {
+        Lock lock;
+        unregisterLocked();
+        clearLocked();
+    }
+
+    // return a cached context or nullptr; the caller owns it until put()
+    T *take(const CompressContextKey &key) noexcept {
+        Lock lock;
+        for (unsigned i = 0; i < count; i++) {
+            if (entries[i].key == key) {
+                T *const ctx = entries[i].ctx;
+                retained_bytes -= entries[i].bytes;
+                for (; i + 1 < count; i++)
+                    entries[i] = entries[i + 1];
+                count--;
+                return ctx;
+            }
+        }
+        return nullptr;
+    }
+    // entries are kept in LRU order, so evict the first ones if full or
+    // over budget; "bytes" is the estimated size of the context
+    void put(const CompressContextKey &key, T *ctx, size_t bytes) noexcept {
+        {
+            Lock lock;
+            if (bytes <= limit_bytes) {
+                while (count > 0 && (count == N || retained_bytes + bytes > limit_bytes))
+                    evictFirstLocked();
+                if (retained_bytes + bytes <= limit_bytes) {
+                    entries[count].key = key;
+                    entries[count].ctx = ctx;
+                    entries[count].bytes = bytes;
+                    count++;
+                    retained_bytes += bytes;
+                    return;
+                }
+            }
+        }
+        delete ctx; // too big for the budget that is left
+    }
+    void clear() noexcept {
+        Lock lock;
+        clearLocked();
+    }
+
+private:
+    struct Entry {
+        CompressContextKey key;
+        T *ctx;
+        size_t bytes;
+    };
+    Entry entries[N];
+    unsigned count = 0;
+
+    void evictFirstLocked() noexcept {
+        delete entries[0].ctx;
+        retained_bytes -= entries[0].bytes;
+        for (unsigned i = 0; i + 1 < count; i++)
+            entries[i] = entries[i + 1];
+        count--;
+    }
+    void clearLocked() noexcept override {
+        while (count > 0) {
+            count--;
+            delete entries[count].ctx;
+            retained_bytes -= entries[count].bytes;
+        }
+    }
+};
+
 /*************************************************************************
 //
 **************************************************************************/
@@ -72,7 +199,8 @@ int upx_lzma_test_overlap  ( const upx_bytep buf,
                                    unsigned  src_off, unsigned src_len,
                                    unsigned* dst_len,
                                    int method,
-                             const upx_compress_result_t *cresult );
+                             const upx_compress_result_t *cresult,
+                                   MemBuffer &scratch );
 #endif
 
 
@@ -98,6 +226,11 @@ int upx_nrv_test_overlap   ( const upx_bytep buf,
 #endif
 
 
+/* compress_adler32.cpp: SSE2/AVX2/NEON, selected at runtime */
+unsigned upx_fast_adler32(const void *buf, unsigned len, unsigned adler);
+const char *upx_fast_adler32_name(void);
+
+
 #if (WITH_UCL)
 int upx_ucl_init(void);
 const char *upx_ucl_version_string(void);
@@ -117,6 +250,10 @@ int upx_ucl_test_overlap   ( const upx_bytep buf,
                                    unsigned* dst_len,
                                    int method,
                              const upx_compress_result_t *cresult );
+int upx_ucl_find_overlap    ( const upx_bytep src, unsigned src_len,
+                                   unsigned* dst_len,
+                                   int method,
+                                   unsigned* src_off );
 unsigned upx_ucl_adler32(const void *buf, unsigned len, unsigned adler);
 unsigned upx_ucl_crc32  (const void *buf, unsigned len, unsigned crc);
 #endif
@@ -164,7 +301,12 @@ int upx_zstd_test_overlap  ( const upx_bytep buf,
                                    unsigned  src_off, unsigned src_len,
                                    unsigned* dst_len,
                                    int method,
-                             const upx_compress_result_t *cresult );
+                             const upx_compress_result_t *cresult,
+                                   MemBuffer &scratch );
+int upx_zstd_find_overlap   ( const upx_bytep src, unsigned src_len,
+                                   unsigned* dst_len,
+                                   int method,
+                                   unsigned* src_off );
 #endif
 
 
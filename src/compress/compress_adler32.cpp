@@ -0,0 +1,276 @@
+/* compress_adler32.cpp -- vectorized adler32
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer
+   <markus@oberhumer.com>
+ */
+
+#include "../conf.h"
+#include "compress.h"
+#include "../util/membuffer.h"
+#include <chrono>
+
+// x86: compile the kernels with target attributes and select them at runtime
+#if (ACC_ARCH_AMD64 || ACC_ARCH_I386) && (ACC_CC_CLANG || ACC_CC_GNUC)
+#include <immintrin.h>
+#define USE_ADLER32_X86 1
+#define ADLER32_TARGET(x) __attribute__((__target__(x)))
+#endif
+// arm64: NEON is always available
+#if (ACC_ARCH_ARM64) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define USE_ADLER32_NEON 1
+#endif
+
+/*************************************************************************
+// The vector kernels process the input in chunks of at most NMAX bytes
+// and reduce modulo BASE after each chunk. For a block of BLOCK bytes
+// b[0..BLOCK-1] starting with sums (s1, s2):
+//   s1' = s1 + sum(b[j])
+//   s2' = s2 + BLOCK * s1 + sum((BLOCK - j) * b[j])
+// so per chunk only the byte sums, the weighted byte sums and the sum of
+// s1 at the start of each block are needed. The final combination is
+// done in 64-bit arithmetic, and the tail is handled by the scalar code.
+**************************************************************************/
+
+namespace {
+
+enum { BASE = 65521, NMAX = 5552 };
+
+typedef unsigned (*adler32_func_t)(const byte *, size_t, unsigned);
+
+unsigned adler32_scalar(const byte *buf, size_t len, unsigned adler) {
+    return upx_ucl_adler32(buf, (unsigned) len, adler);
+}
+
+// fold the chunk results into the running sums
+forceinline unsigned adler32_combine(unsigned s1, unsigned s2, size_t nblocks, unsigned block,
+                                     upx_uint64_t sum_b, upx_uint64_t sum_ps,
+                                     upx_uint64_t sum_wb) {
+    upx_uint64_t a = s1 + sum_b;
+    upx_uint64_t b = s2 + (upx_uint64_t) nblocks * block * s1 + block * sum_ps + sum_wb;
+    return (unsigned) ((b % BASE) << 16) | (unsigned) (a % BASE);
+}
+
+#if (USE_ADLER32_X86)
+
+ADLER32_TARGET("sse2")
+unsigned adler32_sse2(const byte *buf, size_t len, unsigned adler) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    while (len >= 16) {
+        size_t const nblocks = UPX_MIN(len, (size_t) NMAX) / 16;
+        len -= nblocks * 16;
+        __m128i v_b = zero;  // byte sums
+        __m128i v_ps = zero; // sum of v_b at the start of each block
+        __m128i v_wb = zero; // weighted byte sums
+        for (size_t i = 0; i < nblocks; i++, buf += 16) {
+            const __m128i d = _mm_loadu_si128((const __m128i *) (const void *) buf);
+            v_ps = _mm_add_epi32(v_ps, v_b);
+            v_b = _mm_add_epi32(v_b, _mm_sad_epu8(d, zero));
+            const __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(d, zero), w_lo);
+            const __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), w_hi);
+            v_wb = _mm_add_epi32(v_wb, _mm_add_epi32(lo, hi));
+        }
+        alignas(16) unsigned b[4], ps[4], wb[4];
+        _mm_store_si128((__m128i *) (void *) b, v_b);
+        _mm_store_si128((__m128i *) (void *) ps, v_ps);
+        _mm_store_si128((__m128i *) (void *) wb, v_wb);
+        adler = adler32_combine(adler & 0xffff, adler >> 16, nblocks, 16,
+                                (upx_uint64_t) b[0] + b[2],
+                                (upx_uint64_t) ps[0] + ps[2],
+                                (upx_uint64_t) wb[0] + wb[1] + wb[2] + wb[3]);
+    }
+    return len ? adler32_scalar(buf, len, adler) : adler;
+}
+
+ADLER32_TARGET("avx2")
+unsigned adler32_avx2(const byte *buf, size_t len, unsigned adler) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19,
+                                       18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3,
+                                       2, 1);
+    while (len >= 32) {
+        size_t const nblocks = UPX_MIN(len, (size_t) NMAX) / 32;
+        len -= nblocks * 32;
+        __m256i v_b = zero, v_ps = zero, v_wb = zero;
+        for (size_t i = 0; i < nblocks; i++, buf += 32) {
+            const __m256i d = _mm256_loadu_si256((const __m256i *) (const void *) buf);
+            v_ps = _mm256_add_epi32(v_ps, v_b);
+            v_b = _mm256_add_epi32(v_b, _mm256_sad_epu8(d, zero));
+            // max. 2 * 255 * 32 per 16-bit lane, so maddubs cannot saturate
+            const __m256i p = _mm256_maddubs_epi16(d, w);
+            v_wb = _mm256_add_epi32(v_wb, _mm256_madd_epi16(p, ones));
+        }
+        alignas(32) unsigned b[8], ps[8], wb[8];
+        _mm256_store_si256((__m256i *) (void *) b, v_b);
+        _mm256_store_si256((__m256i *) (void *) ps, v_ps);
+        _mm256_store_si256((__m256i *) (void *) wb, v_wb);
+        upx_uint64_t sum_b = 0, sum_ps = 0, sum_wb = 0;
+        for (int i = 0; i < 8; i++) {
+            sum_b += b[i];
+            sum_ps += ps[i];
+            sum_wb += wb[i];
+        }
+        adler = adler32_combine(adler & 0xffff, adler >> 16, nblocks, 32, sum_b, sum_ps, sum_wb);
+    }
+    return len ? adler32_sse2(buf, len, adler) : adler;
+}
+
+#endif // USE_ADLER32_X86
+
+#if (USE_ADLER32_NEON)
+
+unsigned adler32_neon(const byte *buf, size_t len, unsigned adler) {
+    static const byte weights[16] = {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+    const uint8x16_t w = vld1q_u8(weights);
+    while (len >= 16) {
+        size_t const nblocks = UPX_MIN(len, (size_t) NMAX) / 16;
+        len -= nblocks * 16;
+        uint32x4_t v_b = vdupq_n_u32(0), v_ps = vdupq_n_u32(0), v_wb = vdupq_n_u32(0);
+        for (size_t i = 0; i < nblocks; i++, buf += 16) {
+            const uint8x16_t d = vld1q_u8(buf);
+            v_ps = vaddq_u32(v_ps, v_b);
+            v_b = vpadalq_u16(v_b, vpaddlq_u8(d));
+            v_wb = vpadalq_u16(v_wb, vmull_u8(vget_low_u8(d), vget_low_u8(w)));
+            v_wb = vpadalq_u16(v_wb, vmull_high_u8(d, w));
+        }
+        adler = adler32_combine(adler & 0xffff, adler >> 16, nblocks, 16, vaddlvq_u32(v_b),
+                                vaddlvq_u32(v_ps), vaddlvq_u32(v_wb));
+    }
+    return len ? adler32_scalar(buf, len, adler) : adler;
+}
+
+#endif // USE_ADLER32_NEON
+
+struct Adler32Impl {
+    const char *name;
+    adler32_func_t func;
+    bool (*supported)();
+};
+
+bool always_supported() { return true; }
+#if (USE_ADLER32_X86)
+bool sse2_supported() { return __builtin_cpu_supports("sse2"); }
+bool avx2_supported() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+// in order of preference
+const Adler32Impl adler32_impls[] = {
+#if (USE_ADLER32_X86)
+    {"avx2", adler32_avx2, avx2_supported},
+    {"sse2", adler32_sse2, sse2_supported},
+#endif
+#if (USE_ADLER32_NEON)
+    {"neon", adler32_neon, always_supported},
+#endif
+    {"scalar", adler32_scalar, always_supported},
+};
+
+const Adler32Impl *adler32_select() {
+#if (USE_ADLER32_X86)
+    __builtin_cpu_init();
+#endif
+    for (const auto &impl : adler32_impls)
+        if (impl.supported())
+            return &impl;
+    return &adler32_impls[TABLESIZE(adler32_impls) - 1];
+}
+
+const Adler32Impl *adler32_get() {
+    static const Adler32Impl *const impl = adler32_select(); // thread-safe init
+    return impl;
+}
+
+} // namespace
+
+/*************************************************************************
+// returns exactly the same values as upx_ucl_adler32()
+**************************************************************************/
+
+unsigned upx_fast_adler32(const void *buf, unsigned len, unsigned adler) {
+    return adler32_get()->func((const byte *) buf, len, adler);
+}
+
+const char *upx_fast_adler32_name() { return adler32_get()->name; }
+
+/*************************************************************************
+//
+**************************************************************************/
+
+TEST_CASE("upx_fast_adler32") {
+    // all supported kernels must match the scalar reference, for all
+    // alignments, short tails and lengths crossing the NMAX chunk size
+    constexpr unsigned N = 2 * NMAX + 100;
+    MemBuffer mb(N + 64);
+    upx_uint32_t seed = 0x12345678;
+    for (unsigned i = 0; i < N + 64; i++) {
+        seed = seed * 1103515245 + 12345;
+        mb[i] = (byte) (seed >> 24);
+    }
+    static const unsigned lens[] = {0,    1,    15,       16,       17,       31,    32,   33,
+                                    63,   64,   100,      1000,     NMAX - 1, NMAX,  NMAX + 1,
+                                    5536, 5568, NMAX + 5, 2 * NMAX, N};
+    static const unsigned init[] = {1, 0xfff0fff0u, 0x0001fff0u};
+    for (const auto &impl : adler32_impls) {
+        if (!impl.supported())
+            continue;
+        for (unsigned off = 0; off < 4; off++) {
+            for (unsigned len : lens) {
+                const byte *p = mb + off * 13;
+                for (unsigned adler : init) {
+                    CHECK(impl.func(p, len, adler) == adler32_scalar(p, len, adler));
+                }
+            }
+        }
+    }
+    // all 0xff bytes maximize the intermediate sums
+    memset(mb, 0xff, N);
+    for (const auto &impl : adler32_impls)
+        if (impl.supported())
+            CHECK(impl.func(mb, N, 0xfff0fff0u) == adler32_scalar(mb, N, 0xfff0fff0u));
+    CHECK(upx_adler32(nullptr, 0) == 1);
+    CHECK(upx_fast_adler32("abc", 3, 1) == 0x024d0127);
+}
+
+// not run by default; use "upx --dt-no-skip --dt-test-case='*adler32 benchmark'"
+TEST_CASE("upx_fast_adler32 benchmark" * doctest::skip()) {
+    constexpr unsigned N = 64 * 1024 * 1024;
+    MemBuffer mb(N);
+    for (unsigned i = 0; i < N; i++)
+        mb[i] = (byte) (i * 7 + (i >> 9));
+    for (const auto &impl : adler32_impls) {
+        if (!impl.supported())
+            continue;
+        unsigned adler = 1;
+        const auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < 4; i++)
+            adler = impl.func(mb, N, adler);
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+        printf("adler32 %-8s %8.1f MiB/s  0x%08x\n", impl.name,
+               secs.count() > 0 ? 4.0 * N / (1024.0 * 1024.0) / secs.count() : 0.0, adler);
+    }
+}
+
+/* vim:set ts=4 sw=4 et: */
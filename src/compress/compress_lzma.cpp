@@ -285,11 +285,15 @@ struct ProgressInfo final : public ICompressProgressInfo, public CMyUnknownImp {
     MY_UNKNOWN_IMP
     STDMETHOD(SetRatioInfo)(const UInt64 *inSize, const UInt64 *outSize) override;
     upx_callback_p cb = nullptr;
+    UInt64 max_out = 0; // see upx_compress_config_t::max_c_len
 };
 
 STDMETHODIMP ProgressInfo::SetRatioInfo(const UInt64 *inSize, const UInt64 *outSize) {
     if (cb && cb->nprogress)
         cb->nprogress(cb, (unsigned) *inSize, (unsigned) *outSize);
+    // outSize includes the bytes that are still buffered by the range encoder
+    if (max_out != 0 && *outSize > max_out)
+        return E_ABORT;
     return S_OK;
 }
 
@@ -307,6 +311,22 @@ STDMETHODIMP ProgressInfo::SetRatioInfo(const UInt64 *inSize, const UInt64 *outS
 #include <lzma-sdk/C/7zip/Compress/RangeCoder/RangeCoderBit.cpp>
 #undef RC_NORMALIZE
 
+// CEncoder keeps its match finder and literal coder allocations across
+// Code() calls and only re-creates them when the parameters change
+namespace {
+struct LzmaEncoderContext final {
+    NCompress::NLZMA::CEncoder *const enc;
+    LzmaEncoderContext() : enc(new NCompress::NLZMA::CEncoder) { enc->AddRef(); }
+    ~LzmaEncoderContext() noexcept { enc->Release(); }
+};
+static CompressContextCache<LzmaEncoderContext> lzma_encoder_cache;
+
+// rough size of the bt4 match finder and the literal coder of an encoder
+static size_t lzma_encoder_bytes(unsigned dict_size) noexcept {
+    return size_t(dict_size) / 2 * 23 + (4u << 20);
+}
+} // namespace
+
 int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsigned *dst_len,
                       upx_callback_p cb, int method, int level,
                       const upx_compress_config_t *cconf_parm, upx_compress_result_t *cresult) {
@@ -315,7 +335,7 @@ int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
     assert(cresult != nullptr);
 
     int r = UPX_E_ERROR;
-    HRESULT rh;
+    HRESULT rh = S_OK;
     const lzma_compress_config_t *const lcconf = cconf_parm ? &cconf_parm->conf_lzma : nullptr;
     lzma_compress_result_t *const res = &cresult->result_lzma;
 
@@ -328,8 +348,19 @@ int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
     MyLzma::ProgressInfo progress;
     progress.AddRef();
     progress.cb = cb; // progress.Init()
+    if (cconf_parm != nullptr)
+        progress.max_out = cconf_parm->max_c_len;
 
-    NCompress::NLZMA::CEncoder enc;
+    if (!prepare_result(res, src_len, method, level, lcconf)) {
+        *dst_len = 0;
+        return r;
+    }
+    // pb/lp/lc are set on each call, so they are not part of the key
+    const CompressContextKey key = {M_LZMA, level, res->dict_size, res->num_fast_bytes};
+    LzmaEncoderContext *ctx = lzma_encoder_cache.take(key);
+    if (ctx == nullptr)
+        ctx = new LzmaEncoderContext;
+    NCompress::NLZMA::CEncoder &enc = *ctx->enc;
     const PROPID propIDs[8] = {
         NCoderPropID::kPosStateBits,      // 0  pb    _posStateBits(2)
         NCoderPropID::kLitPosBits,        // 1  lp    _numLiteralPosStateBits(0)
@@ -342,8 +373,6 @@ int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
     };
     PROPVARIANT pr[8];
     const unsigned nprops = 8;
-    if (!prepare_result(res, src_len, method, level, lcconf))
-        goto error;
     pr[0].vt = pr[1].vt = pr[2].vt = pr[3].vt = pr[4].vt = pr[5].vt = pr[6].vt = VT_UI4;
     pr[7].vt = VT_BSTR;
     pr[0].uintVal = res->pos_bits;
@@ -392,6 +421,9 @@ int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
         assert(os.b_pos == *dst_len);
         // r = UPX_E_OUTPUT_OVERRUN;
         r = UPX_E_NOT_COMPRESSIBLE;
+    } else if (rh == E_ABORT) {
+        // over budget
+        r = UPX_E_NOT_COMPRESSIBLE;
     } else if (rh == S_OK) {
         assert(is.b_pos == src_len);
         r = UPX_E_OK;
@@ -399,6 +431,12 @@ int upx_lzma_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
 
 error:
     *dst_len = (unsigned) os.b_pos;
+    // after an exception the encoder state is unknown, so do not reuse it;
+    // and do not keep the huge match finders of big dictionaries around
+    if (rh != E_OUTOFMEMORY && res->dict_size <= 4 * 1024 * 1024)
+        lzma_encoder_cache.put(key, ctx, lzma_encoder_bytes(res->dict_size));
+    else
+        delete ctx;
     // printf("\nlzma_compress: %d: %u %u %u %u %u, %u - > %u\n", r, res->pos_bits,
     // res->lit_pos_bits,
     //        res->lit_context_bits, res->dict_size, res->num_probs, src_len, *dst_len);
@@ -491,10 +529,14 @@ error:
 
 int upx_lzma_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off,
                           unsigned src_len, unsigned *dst_len, int method,
-                          const upx_compress_result_t *cresult) {
+                          const upx_compress_result_t *cresult, MemBuffer &scratch) {
     assert(M_IS_LZMA(method));
 
-    MemBuffer b(src_off + src_len);
+    MemBuffer &b = scratch;
+    if (b.getSize() < src_off + src_len) {
+        b.dealloc();
+        b.alloc(src_off + src_len);
+    }
     memcpy(b + src_off, buf + src_off, src_len);
     unsigned saved_dst_len = *dst_len;
     int r = upx_lzma_decompress(raw_index_bytes(b, src_off, src_len), src_len,
@@ -83,6 +83,7 @@ int upx_ucl_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsig
 
     COMPILE_TIME_ASSERT(sizeof(ucl_compress_config_t) == sizeof(REAL_ucl_compress_config_t))
 
+    // note: UCL has no way to stop early, so cconf_parm->max_c_len is ignored
     ucl_progress_callback_t cb;
     cb.callback = nullptr;
     cb.user = nullptr;
@@ -236,6 +237,157 @@ int upx_ucl_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src
     return convert_errno_from_ucl(r);
 }
 
+/*************************************************************************
+// find_overlap - single pass version of test_overlap
+//
+// Parse the compressed data without writing any output and track how far
+// the output position runs ahead of the input position at the points
+// where ucl_nrv2X_test_overlap() checks it. The result is the smallest
+// src_off for which upx_ucl_test_overlap() succeeds.
+**************************************************************************/
+
+namespace {
+struct NrvBitReader {
+    const byte *const src;
+    const unsigned src_len;
+    const int bits; // 8, 16 or 32
+    unsigned ilen = 0;
+    unsigned bb = 0;
+    unsigned bc = 0;
+    bool overrun = false;
+
+    NrvBitReader(const byte *s, unsigned l, int b) : src(s), src_len(l), bits(b) {}
+
+    bool avail(unsigned n) {
+        if (src_len - ilen >= n)
+            return true;
+        overrun = true;
+        return false;
+    }
+    unsigned getbyte() { return avail(1) ? src[ilen++] : 0; }
+    // same bit order as getbit_8, getbit_le16 and getbit_le32 in UCL
+    unsigned getbit() {
+        if (bits == 8) {
+            bb = (bb & 0x7f) ? bb * 2 : getbyte() * 2 + 1;
+            return (bb >> 8) & 1;
+        } else if (bits == 16) {
+            bb *= 2;
+            if (bb & 0xffff)
+                return (bb >> 16) & 1;
+            bb = (avail(2) ? get_le16(src + ilen) : 0) * 2 + 1;
+            ilen += 2;
+            return (bb >> 16) & 1;
+        } else {
+            if (bc > 0)
+                return (bb >> --bc) & 1;
+            bc = 31;
+            bb = avail(4) ? get_le32(src + ilen) : 0;
+            ilen += 4;
+            return (bb >> 31) & 1;
+        }
+    }
+};
+} // namespace
+
+int upx_ucl_find_overlap(const upx_bytep src, unsigned src_len, unsigned *dst_len, int method,
+                         unsigned *src_off) {
+    int bits;
+    if (method == M_NRV2B_8 || method == M_NRV2D_8 || method == M_NRV2E_8)
+        bits = 8;
+    else if (method == M_NRV2B_LE16 || method == M_NRV2D_LE16 || method == M_NRV2E_LE16)
+        bits = 16;
+    else if (method == M_NRV2B_LE32 || method == M_NRV2D_LE32 || method == M_NRV2E_LE32)
+        bits = 32;
+    else
+        return UPX_E_ERROR;
+    const bool nrv2b = M_IS_NRV2B(method);
+    const bool nrv2e = M_IS_NRV2E(method);
+    const unsigned oend = *dst_len;
+
+    NrvBitReader br(src, src_len, bits);
+    unsigned olen = 0, last_m_off = 1;
+    upx_int64_t gap = 0; // max(olen - ilen) at the checkpoints
+    for (;;) {
+        unsigned m_off, m_len = 0;
+        while (br.getbit()) {
+            if (!br.avail(1) || olen >= oend)
+                return UPX_E_ERROR;
+            gap = UPX_MAX(gap, (upx_int64_t) olen - br.ilen);
+            olen++;
+            br.ilen++;
+        }
+        m_off = 1;
+        if (nrv2b) {
+            do {
+                m_off = m_off * 2 + br.getbit();
+                if (br.overrun || m_off > 0xffffff + 3)
+                    return UPX_E_ERROR;
+            } while (!br.getbit());
+        } else {
+            for (;;) {
+                m_off = m_off * 2 + br.getbit();
+                if (br.overrun || m_off > 0xffffff + 3)
+                    return UPX_E_ERROR;
+                if (br.getbit())
+                    break;
+                m_off = (m_off - 1) * 2 + br.getbit();
+            }
+        }
+        if (m_off == 2) {
+            m_off = last_m_off;
+            if (!nrv2b)
+                m_len = br.getbit();
+        } else {
+            m_off = (m_off - 3) * 256 + br.getbyte();
+            if (br.overrun)
+                return UPX_E_ERROR;
+            if (m_off == 0xffffffff)
+                break;
+            if (!nrv2b) {
+                m_len = (m_off ^ 0xffffffff) & 1;
+                m_off >>= 1;
+            }
+            last_m_off = ++m_off;
+        }
+        bool long_len;
+        if (nrv2e) {
+            long_len = false;
+            if (m_len)
+                m_len = 1 + br.getbit();
+            else if (br.getbit())
+                m_len = 3 + br.getbit();
+            else
+                long_len = true;
+        } else {
+            if (nrv2b)
+                m_len = br.getbit();
+            m_len = m_len * 2 + br.getbit();
+            long_len = (m_len == 0);
+        }
+        if (long_len) {
+            m_len = 1;
+            do {
+                m_len = m_len * 2 + br.getbit();
+                if (br.overrun || m_len >= oend)
+                    return UPX_E_ERROR;
+            } while (!br.getbit());
+            m_len += nrv2e ? 3 : 2;
+        }
+        m_len += (m_off > (nrv2b ? 0xd00u : 0x500u));
+        if (br.overrun || olen + m_len >= oend || m_off > olen)
+            return UPX_E_ERROR;
+        olen += m_len + 1;
+        gap = UPX_MAX(gap, (upx_int64_t) olen - br.ilen);
+    }
+    if (br.overrun || br.ilen != src_len)
+        return UPX_E_ERROR;
+    *dst_len = olen;
+    // test_overlap also requires that the output buffer ends before the input
+    gap = UPX_MAX(gap, (upx_int64_t) oend - src_len + 1);
+    *src_off = (unsigned) gap;
+    return UPX_E_OK;
+}
+
 /*************************************************************************
 // misc
 **************************************************************************/
@@ -306,9 +458,23 @@ static bool check_ucl(const int method, const unsigned expected_c_len) {
     if (r == 0)
         return false;
 
-    // TODO: rewrite Packer::findOverlapOverhead() so that we can test it here
-    // unsigned x_len = d_len;
-    // r = upx_ucl_test_overlap(c_buf, u_buf, c_extra, c_len, &x_len, method, nullptr);
+    // upx_ucl_find_overlap() must find the smallest src_off that works
+    unsigned x_len = u_len;
+    unsigned src_off = 0;
+    r = upx_ucl_find_overlap(raw_index_bytes(c_buf, c_extra, c_len), c_len, &x_len, method,
+                             &src_off);
+    if (r != 0 || x_len != u_len || src_off + c_len > c_buf.getSize())
+        return false;
+    memmove(c_buf + src_off, c_buf + c_extra, c_len);
+    x_len = u_len;
+    r = upx_ucl_test_overlap(c_buf, u_buf, src_off, c_len, &x_len, method, nullptr);
+    if (r != 0 || x_len != u_len)
+        return false;
+    memmove(c_buf + (src_off - 1), c_buf + src_off, c_len);
+    x_len = u_len;
+    r = upx_ucl_test_overlap(c_buf, u_buf, src_off - 1, c_len, &x_len, method, nullptr);
+    if (r == 0)
+        return false;
     return true;
 }
 
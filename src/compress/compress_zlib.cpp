@@ -67,9 +67,21 @@ static int convert_errno_from_zlib(int zr) {
 }
 
 /*************************************************************************
-//
+// deflate streams are reused with deflateReset()
 **************************************************************************/
 
+namespace {
+struct ZlibDeflateContext final {
+    z_stream s;
+    bool initialized = false;
+    ~ZlibDeflateContext() noexcept {
+        if (initialized)
+            (void) deflateEnd(&s);
+    }
+};
+static CompressContextCache<ZlibDeflateContext> zlib_deflate_cache;
+} // namespace
+
 int upx_zlib_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsigned *dst_len,
                       upx_callback_p cb_parm, int method, int level,
                       const upx_compress_config_t *cconf_parm, upx_compress_result_t *cresult) {
@@ -97,29 +109,36 @@ int upx_zlib_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
 
     res->dummy = 0;
 
-    z_stream s;
-    s.zalloc = (alloc_func) nullptr;
-    s.zfree = (free_func) nullptr;
+    const CompressContextKey key = {method, level, window_bits, mem_level * 16 + strategy};
+    ZlibDeflateContext *ctx = zlib_deflate_cache.take(key);
+    if (ctx == nullptr)
+        ctx = new ZlibDeflateContext;
+    z_stream &s = ctx->s;
+
+    if (ctx->initialized) {
+        zr = deflateReset(&s);
+    } else {
+        s.zalloc = (alloc_func) nullptr;
+        s.zfree = (free_func) nullptr;
+        s.opaque = nullptr;
+        s.next_in = nullptr;
+        s.avail_in = 0;
+        zr = (int) deflateInit2(&s, level, Z_DEFLATED, 0 - (int) window_bits, mem_level, strategy);
+        ctx->initialized = (zr == Z_OK);
+    }
+    if (zr != Z_OK)
+        goto error;
+    assert(s.state->level == level);
     s.next_in = ACC_UNCONST_CAST(upx_bytep, src);
     s.avail_in = src_len;
     s.next_out = dst;
     s.avail_out = *dst_len;
-    s.total_in = s.total_out = 0;
-
-    zr = (int) deflateInit2(&s, level, Z_DEFLATED, 0 - (int) window_bits, mem_level, strategy);
-    if (zr != Z_OK)
-        goto error;
-    assert(s.state->level == level);
     zr = deflate(&s, Z_FINISH);
     if (zr != Z_STREAM_END)
         goto error;
-    zr = deflateEnd(&s);
-    if (zr != Z_OK)
-        goto error;
     r = UPX_E_OK;
     goto done;
 error:
-    (void) deflateEnd(&s);
     r = convert_errno_from_zlib(zr);
     if (r == UPX_E_OK)
         r = UPX_E_ERROR;
@@ -130,7 +149,14 @@ done:
     }
     assert(s.total_in <= src_len);
     assert(s.total_out <= *dst_len);
-    *dst_len = s.total_out;
+    *dst_len = (unsigned) s.total_out;
+    // the stream gets reset on next use, so it can be cached even after errors
+    if (ctx->initialized) // see "memory footprint" in zlib's zconf.h
+        zlib_deflate_cache.put(key, ctx,
+                               (size_t(1) << ((unsigned) window_bits + 2)) +
+                                   (size_t(1) << ((unsigned) mem_level + 9)));
+    else
+        delete ctx;
     return r;
 }
 
@@ -26,15 +26,28 @@
 
 #include "../conf.h"
 
-void zstd_compress_config_t::reset() { mem_clear(this, sizeof(*this)); }
+void zstd_compress_config_t::reset() {
+    mem_clear(this, sizeof(*this));
+
+    window_log.reset();
+    strategy.reset();
+    long_distance.reset();
+    num_workers.reset();
+}
 
 #if WITH_ZSTD
 #include "compress.h"
 #include "../util/membuffer.h"
+#define ZSTD_STATIC_LINKING_ONLY 1 // for ZSTD_decompressionMargin() and ZSTD_getFrameHeader()
 #include <zstd/lib/zstd.h>
 #include <zstd/lib/zstd_errors.h>
 #include <zstd/lib/compress/hist.h>
 
+// "--crp-zstd-wl" accepts 0 (auto) or these values; see main.cpp
+ACC_COMPILE_TIME_ASSERT_HEADER(ZSTD_WINDOWLOG_MIN == 10)
+ACC_COMPILE_TIME_ASSERT_HEADER(ZSTD_WINDOWLOG_LIMIT_DEFAULT ==
+                               zstd_compress_config_t::window_log_t::max_value)
+
 static int convert_errno_from_zstd(size_t zr) {
     const ZSTD_ErrorCode ze = ZSTD_getErrorCode(zr);
     switch (ze) {
@@ -51,9 +64,50 @@ static int convert_errno_from_zstd(size_t zr) {
 }
 
 /*************************************************************************
-// TODO later: use advanced compression API for compression finetuning
+// compression uses the advanced API with per-thread reusable contexts
 **************************************************************************/
 
+namespace {
+struct ZstdCCtx final {
+    ZSTD_CCtx *const cctx = ZSTD_createCCtx();
+    ~ZstdCCtx() noexcept { ZSTD_freeCCtx(cctx); }
+};
+static CompressContextCache<ZstdCCtx> zstd_cctx_cache;
+} // namespace
+
+// map UPX level 1..10 to zstd level 1..22
+static int zstd_level(int level) {
+    static const upx_uint8_t levels[10] = {1, 3, 5, 7, 9, 12, 15, 17, 19, 22};
+    return levels[UPX_MIN(UPX_MAX(level, 1), 10) - 1];
+}
+
+static size_t zstd_set_params(ZSTD_CCtx *cctx, int level, const zstd_compress_config_t *lcconf) {
+    size_t zr;
+#define setParameter(p, v)                                                                         \
+    do {                                                                                           \
+        zr = ZSTD_CCtx_setParameter(cctx, p, v);                                                   \
+        if (ZSTD_isError(zr))                                                                      \
+            return zr;                                                                             \
+    } while (0)
+    setParameter(ZSTD_c_compressionLevel, zstd_level(level));
+    setParameter(ZSTD_c_contentSizeFlag, 1);
+    setParameter(ZSTD_c_checksumFlag, 0);
+    // cconf overrides
+    if (lcconf) {
+        if (lcconf->window_log != 0)
+            setParameter(ZSTD_c_windowLog, (int) lcconf->window_log);
+        if (lcconf->strategy != 0)
+            setParameter(ZSTD_c_strategy, (int) lcconf->strategy);
+        if (lcconf->long_distance != 0)
+            setParameter(ZSTD_c_enableLongDistanceMatching, 1);
+        // fails if zstd was built without ZSTD_MULTITHREAD; then just stay single-threaded
+        if (lcconf->num_workers != 0)
+            (void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int) lcconf->num_workers);
+    }
+#undef setParameter
+    return 0;
+}
+
 int upx_zstd_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsigned *dst_len,
                       upx_callback_p cb_parm, int method, int level,
                       const upx_compress_config_t *cconf_parm, upx_compress_result_t *cresult) {
@@ -66,21 +120,38 @@ int upx_zstd_compress(const upx_bytep src, unsigned src_len, upx_bytep dst, unsi
     const zstd_compress_config_t *const lcconf = cconf_parm ? &cconf_parm->conf_zstd : nullptr;
     zstd_compress_result_t *const res = &cresult->result_zstd;
 
-    // TODO later: map level 1..10 to zstd-level 1..22
-    if (level == 10)
-        level = 22;
+    res->dummy = 0;
 
-    // cconf overrides
-    if (lcconf) {
-        UNUSED(lcconf);
+    const CompressContextKey key = {method, level, lcconf ? (unsigned) lcconf->window_log : 0u,
+                                    0};
+    ZstdCCtx *ctx = zstd_cctx_cache.take(key);
+    if (ctx == nullptr) {
+        ctx = new ZstdCCtx;
+        if (ctx->cctx == nullptr) {
+            delete ctx;
+            return UPX_E_OUT_OF_MEMORY;
+        }
     }
+    (void) ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_and_parameters);
 
-    res->dummy = 0;
-
-    zr = ZSTD_compress(dst, *dst_len, src, src_len, level);
+    zr = zstd_set_params(ctx->cctx, level, lcconf);
+    if (ZSTD_isError(zr)) {
+        zstd_cctx_cache.put(key, ctx, ZSTD_sizeof_CCtx(ctx->cctx));
+        return UPX_E_INVALID_ARGUMENT;
+    }
+    // zstd writes each block directly to dst[] and stops at the first one
+    // that does not fit, so a budget also saves the time of a losing trial
+    size_t dst_capacity = *dst_len;
+    const unsigned max_c_len = cconf_parm ? cconf_parm->max_c_len : 0;
+    if (max_c_len != 0 && max_c_len < dst_capacity)
+        dst_capacity = max_c_len;
+    zr = ZSTD_compress2(ctx->cctx, dst, dst_capacity, src, src_len);
+    zstd_cctx_cache.put(key, ctx, ZSTD_sizeof_CCtx(ctx->cctx));
     if (ZSTD_isError(zr)) {
-        *dst_len = 0; // TODO ???
         r = convert_errno_from_zstd(zr);
+        if (r == UPX_E_OUTPUT_OVERRUN && dst_capacity < *dst_len)
+            r = UPX_E_NOT_COMPRESSIBLE; // over budget
+        *dst_len = 0; // TODO ???
         assert(r != UPX_E_OK);
     } else {
         assert(zr <= *dst_len);
@@ -123,10 +194,18 @@ int upx_zstd_decompress(const upx_bytep src, unsigned src_len, upx_bytep dst, un
 
 int upx_zstd_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned src_off,
                           unsigned src_len, unsigned *dst_len, int method,
-                          const upx_compress_result_t *cresult) {
+                          const upx_compress_result_t *cresult, MemBuffer &scratch) {
     assert(method == M_ZSTD);
 
-    MemBuffer b(src_off + src_len);
+    // the input must end after the end of the output
+    if (src_off + src_len < *dst_len)
+        return UPX_E_ERROR;
+    // findOverlapOverhead() probes many times and passes the same scratch buffer
+    MemBuffer &b = scratch;
+    if (b.getSize() < src_off + src_len) {
+        b.dealloc();
+        b.alloc(src_off + src_len);
+    }
     memcpy(b + src_off, buf + src_off, src_len);
     unsigned saved_dst_len = *dst_len;
     int r = upx_zstd_decompress(raw_index_bytes(b, src_off, src_len), src_len,
@@ -143,6 +222,79 @@ int upx_zstd_test_overlap(const upx_bytep buf, const upx_bytep tbuf, unsigned sr
     return UPX_E_OK;
 }
 
+/*************************************************************************
+// find_overlap - see upx_find_overlap()
+**************************************************************************/
+
+#if (ZSTD_VERSION_NUMBER < 10505)
+// The margin for in-place decompression as computed by
+// ZSTD_decompressionMargin() in zstd >= 1.5.5, derived from the frame
+// layout: all frame and block headers and checksums, plus the size of
+// the largest block that may be decoded ahead of its input.
+static int zstd_layout_margin(const upx_bytep src, unsigned src_len, size_t *margin) {
+    size_t m = 0;
+    size_t max_block_size = 0;
+    while (src_len > 0) {
+        ZSTD_frameHeader zfh;
+        if (ZSTD_getFrameHeader(&zfh, src, src_len) != 0)
+            return UPX_E_ERROR;
+        const size_t frame_size = ZSTD_findFrameCompressedSize(src, src_len);
+        if (ZSTD_isError(frame_size) || frame_size > src_len)
+            return UPX_E_ERROR;
+        if (zfh.frameType == ZSTD_frame) {
+            // walk the block headers
+            size_t pos = zfh.headerSize;
+            unsigned nblocks = 0;
+            for (;;) {
+                if (pos + 3 > frame_size)
+                    return UPX_E_ERROR;
+                const unsigned bh = get_le24(src + pos);
+                const unsigned block_type = (bh >> 1) & 3;
+                pos += 3 + (block_type == 1 ? 1 : bh >> 3); // RLE blocks store one byte
+                nblocks++;
+                if (bh & 1) // last block
+                    break;
+            }
+            m += zfh.headerSize + (zfh.checksumFlag ? 4 : 0) + 3 * (size_t) nblocks;
+            max_block_size = UPX_MAX(max_block_size, (size_t) zfh.blockSizeMax);
+        } else {
+            // skippable frame
+            m += frame_size;
+        }
+        src += frame_size;
+        src_len -= (unsigned) frame_size;
+    }
+    *margin = m + max_block_size;
+    return UPX_E_OK;
+}
+#endif
+
+int upx_zstd_find_overlap(const upx_bytep src, unsigned src_len, unsigned *dst_len, int method,
+                          unsigned *src_off) {
+    assert(method == M_ZSTD);
+    UNUSED(method);
+    // the margin for in-place decompression follows from the frame and
+    // block headers; the caller still verifies it with a few test probes
+    const unsigned long long u_len = ZSTD_getFrameContentSize(src, src_len);
+    if (u_len == ZSTD_CONTENTSIZE_UNKNOWN || u_len == ZSTD_CONTENTSIZE_ERROR || u_len != *dst_len)
+        return UPX_E_ERROR;
+#if (ZSTD_VERSION_NUMBER >= 10505)
+    const size_t margin = ZSTD_decompressionMargin(src, src_len);
+    if (ZSTD_isError(margin))
+        return convert_errno_from_zstd(margin);
+#else
+    size_t margin = 0;
+    int r = zstd_layout_margin(src, src_len, &margin);
+    if (r != UPX_E_OK)
+        return r;
+#endif
+    // the input must end "margin" bytes after the end of the output
+    if (u_len + margin <= src_len)
+        return UPX_E_ERROR;
+    *src_off = (unsigned) (u_len + margin - src_len);
+    return UPX_E_OK;
+}
+
 /*************************************************************************
 // misc
 **************************************************************************/
@@ -180,6 +332,22 @@ static bool check_zstd(const int method, const int level, const unsigned expecte
     if (r != 0 || c_len != expected_c_len)
         return false;
 
+    // a budget that is too small stops the compression
+    upx_compress_config_t cconf;
+    cconf.reset();
+    cconf.max_c_len = expected_c_len - 1;
+    unsigned x_len = c_buf.getSize() - c_extra;
+    r = upx_zstd_compress(raw_bytes(u_buf, u_len), u_len, raw_index_bytes(c_buf, c_extra, x_len),
+                          &x_len, nullptr, method, level, &cconf, &cresult);
+    if (r != UPX_E_NOT_COMPRESSIBLE)
+        return false;
+    cconf.max_c_len = expected_c_len;
+    x_len = c_buf.getSize() - c_extra;
+    r = upx_zstd_compress(raw_bytes(u_buf, u_len), u_len, raw_index_bytes(c_buf, c_extra, x_len),
+                          &x_len, nullptr, method, level, &cconf, &cresult);
+    if (r != 0 || x_len != expected_c_len)
+        return false;
+
     d_len = d_buf.getSize();
     r = upx_zstd_decompress(raw_index_bytes(c_buf, c_extra, c_len), c_len, raw_bytes(d_buf, d_len),
                             &d_len, method, nullptr);
@@ -72,7 +72,7 @@ ACC_COMPILE_TIME_ASSERT_HEADER((char)(-1) == 255) // -funsigned-char
 #endif
 #endif // !UPX_CONFIG_DISABLE_WSTRICT && !UPX_CONFIG_DISABLE_WERROR
 
-// multithreading (UPX currently does not use multithreading)
+// multithreading; see option --threads and util/thread_pool.h
 #if (WITH_THREADS)
 #define upx_thread_local        thread_local
 #define upx_std_atomic(Type)    std::atomic<Type>
@@ -675,7 +675,15 @@ struct zlib_compress_config_t
 
 struct zstd_compress_config_t
 {
-    unsigned dummy;
+    typedef OptVar<unsigned,  0u, 0u,  27u> window_log_t;           // wl (0: auto, or 10..27)
+    typedef OptVar<unsigned,  0u, 0u,   9u> strategy_t;             // st (0: auto)
+    typedef OptVar<unsigned,  0u, 0u,   1u> long_distance_t;        // ldm
+    typedef OptVar<unsigned,  0u, 0u, 256u> num_workers_t;          // nw
+
+    window_log_t        window_log;         // wl
+    strategy_t          strategy;           // st
+    long_distance_t     long_distance;      // ldm
+    num_workers_t       num_workers;        // nw
 
     void reset();
 };
@@ -686,7 +694,10 @@ struct upx_compress_config_t
     ucl_compress_config_t   conf_ucl;
     zlib_compress_config_t  conf_zlib;
     zstd_compress_config_t  conf_zstd;
-    void reset() { conf_lzma.reset(); conf_ucl.reset(); conf_zlib.reset(); conf_zstd.reset(); }
+    // if not 0, the compressor may give up with UPX_E_NOT_COMPRESSIBLE
+    // as soon as its output exceeds this budget (see compressWithFilters)
+    unsigned                max_c_len;
+    void reset() { conf_lzma.reset(); conf_ucl.reset(); conf_zlib.reset(); conf_zstd.reset(); max_c_len = 0; }
 };
 
 #define NULL_cconf  ((upx_compress_config_t *) nullptr)
@@ -765,6 +776,9 @@ class MemBuffer;
 void *membuffer_get_void_ptr(MemBuffer &mb);
 unsigned membuffer_get_size(MemBuffer &mb);
 
+// util/bench.cpp
+int upx_bench_main(int argc, char *argv[]);
+
 // util/dt_check.cpp
 void upx_compiler_sanity_check();
 int upx_doctest_check();
@@ -823,6 +837,20 @@ int upx_test_overlap       ( const upx_bytep buf,
                                    unsigned* dst_len,
                                    int method,
                              const upx_compress_result_t *cresult );
+// the same, but with a scratch buffer for repeated calls that gets grown
+// as needed; the caller owns it, so it is freed when probing is done
+int upx_test_overlap       ( const upx_bytep buf,
+                             const upx_bytep tbuf,
+                                   unsigned  src_off, unsigned src_len,
+                                   unsigned* dst_len,
+                                   int method,
+                             const upx_compress_result_t *cresult,
+                                   MemBuffer &scratch );
+// single pass estimate of the smallest src_off for upx_test_overlap()
+int upx_find_overlap       ( const upx_bytep src, unsigned src_len,
+                                   unsigned* dst_len,
+                                   int method,
+                                   unsigned* src_off );
 
 
 #include "util/snprintf.h"   // must get included first!
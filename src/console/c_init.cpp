@@ -130,12 +130,134 @@ void con_fprintf(FILE *f, const char *format, ...) {
     upx_safe_vsnprintf(buf, sizeof(buf), format, args);
     va_end(args);
 
+    if (con_capture_fputs(f, buf))
+        return;
     if (con == me)
         init(f, -1, -1);
     assert(con != me);
     con->print0(f, buf);
 }
 
+#else /* USE_CONSOLE */
+
+void con_fprintf(FILE *f, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    if (con_capture_active()) {
+        char *buf = nullptr;
+        upx_safe_vasprintf(&buf, format, args);
+        (void) con_capture_fputs(f, buf);
+        ::free(buf);
+    } else
+        vfprintf(f, format, args);
+    va_end(args);
+}
+
 #endif /* USE_CONSOLE */
 
+/*************************************************************************
+// capture the console output of the current thread
+//
+// The captured text is stored as a sequence of chunks; each chunk starts
+// with a 0 byte and the FILE pointer it was written to.
+**************************************************************************/
+
+struct ConsoleCapture final {
+    char *buf = nullptr;
+    size_t len = 0;
+    size_t capacity = 0;
+    FILE *last_f = nullptr;
+
+    void append(const void *p, size_t n) {
+        if (len + n > capacity) {
+            size_t new_capacity = UPX_MAX(capacity * 2, len + n + 256);
+            char *new_buf = (char *) ::realloc(buf, new_capacity);
+            if (new_buf == nullptr)
+                throwOutOfMemoryException();
+            buf = new_buf;
+            capacity = new_capacity;
+        }
+        memcpy(buf + len, p, n);
+        len += n;
+    }
+};
+
+static upx_thread_local ConsoleCapture *con_capture = nullptr;
+
+ConsoleCapture *con_capture_new() { return new ConsoleCapture; }
+
+void con_capture_delete(ConsoleCapture *cc) noexcept {
+    if (cc == nullptr)
+        return;
+    ::free(cc->buf);
+    delete cc;
+}
+
+ConsoleCapture *con_capture_set(ConsoleCapture *cc) noexcept {
+    ConsoleCapture *const prev = con_capture;
+    con_capture = cc;
+    return prev;
+}
+
+bool con_capture_active() noexcept { return con_capture != nullptr; }
+
+bool con_capture_fputs(FILE *f, const char *s) {
+    ConsoleCapture *const cc = con_capture;
+    if (cc == nullptr)
+        return false;
+    if (s == nullptr || !s[0])
+        return true;
+    if (cc->len == 0 || f != cc->last_f) {
+        const char zero = 0;
+        cc->append(&zero, 1);
+        cc->append(&f, sizeof(f));
+        cc->last_f = f;
+    }
+    cc->append(s, strlen(s));
+    return true;
+}
+
+void con_capture_flush(ConsoleCapture *cc) {
+    if (cc == nullptr || cc->len == 0)
+        return;
+    size_t pos = 0;
+    while (pos < cc->len) {
+        assert(cc->buf[pos] == 0);
+        FILE *f = nullptr;
+        memcpy(&f, cc->buf + pos + 1, sizeof(f));
+        pos += 1 + sizeof(f);
+        size_t end = pos;
+        while (end < cc->len && cc->buf[end] != 0)
+            end++;
+        fwrite(cc->buf + pos, 1, end - pos, f);
+        fflush(f);
+        pos = end;
+    }
+    cc->len = 0;
+    cc->last_f = nullptr;
+}
+
+TEST_CASE("con_capture") {
+    FILE *f = tmpfile();
+    if (f == nullptr)
+        return;
+    ConsoleCapture *cc = con_capture_new();
+    CHECK(!con_capture_active());
+    ConsoleCapture *prev = con_capture_set(cc);
+    CHECK(prev == nullptr);
+    CHECK(con_capture_active());
+    con_fprintf(f, "%d", 1);
+    CHECK(con_capture_fputs(f, "2"));
+    CHECK(con_capture_set(prev) == cc);
+    CHECK(!con_capture_fputs(f, "3"));
+    con_capture_flush(cc);
+    con_capture_delete(cc);
+    char buf[4] = {};
+    rewind(f);
+    CHECK(fread(buf, 1, sizeof(buf), f) == 2);
+    CHECK(strcmp(buf, "12") == 0);
+    fclose(f);
+}
+
 /* vim:set ts=4 sw=4 et: */
@@ -109,8 +109,6 @@ typedef struct {
     bool (*intro)(FILE *f);
 } console_t;
 
-void con_fprintf(FILE *f, const char *format, ...) attribute_format(2, 3);
-
 #define FG_BLACK 0x00
 #define FG_BLUE 0x01
 #define FG_GREEN 0x02
@@ -145,6 +143,19 @@ void con_fprintf(FILE *f, const char *format, ...) attribute_format(2, 3);
 
 extern FILE *con_term;
 
+void con_fprintf(FILE *f, const char *format, ...) attribute_format(2, 3);
+
+// The console output of the current thread can be captured in memory and
+// printed later. This is used by the multithreaded batch mode in work.cpp
+// so that the messages of each file are not interleaved.
+struct ConsoleCapture;
+ConsoleCapture *con_capture_new();
+void con_capture_delete(ConsoleCapture *cc) noexcept;
+ConsoleCapture *con_capture_set(ConsoleCapture *cc) noexcept; // returns previous capture
+bool con_capture_active() noexcept;
+bool con_capture_fputs(FILE *f, const char *s); // returns false if not capturing
+void con_capture_flush(ConsoleCapture *cc);     // print and clear the captured output
+
 #if (USE_CONSOLE)
 
 extern int con_mode;
@@ -157,12 +168,11 @@ extern console_t console_ansi_mono;
 extern console_t console_ansi_color;
 extern console_t console_screen;
 
-#define con_fg(f, x) con->set_fg(f, x)
+#define con_fg(f, x) (con_capture_active() ? 0 : con->set_fg(f, x))
 
 #else
 
 #define con_fg(f, x) 0
-#define con_fprintf fprintf
 
 #endif /* USE_CONSOLE */
 
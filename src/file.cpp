@@ -27,6 +27,11 @@
 
 #include "conf.h"
 #include "file.h"
+#include "util/stats.h"
+#if (ACC_OS_POSIX || ACC_OS_CYGWIN)
+#include <sys/uio.h>
+#define USE_WRITEV 1
+#endif
 
 /*************************************************************************
 // static functions
@@ -185,10 +190,12 @@ int InputFile::read(SPAN_P(void) buf, int len) {
     if (!isOpen() || len < 0)
         throwIOException("bad read");
     mem_size_assert(1, len); // sanity check
+    PhaseTimer timer(STATS_READ);
     errno = 0;
     long l = acc_safe_hread(_fd, raw_bytes(buf, len), len);
     if (errno)
         throwIOException("read error", errno);
+    timer.addBytes(l);
     return (int) l;
 }
 
@@ -199,6 +206,28 @@ int InputFile::readx(SPAN_P(void) buf, int len) {
     return l;
 }
 
+void InputFile::readxMapped(MemBuffer &mb, int len) {
+    if (!isOpen() || len < 0)
+        throwIOException("bad read");
+    // small reads are cheaper than setting up a mapping
+    if (len >= 64 * 1024 && S_ISREG(st.st_mode)) {
+        PhaseTimer timer(STATS_READ, len);
+        const upx_off_t pos = tell();
+        // do not map a file that has been truncated since it was opened: the
+        // missing pages would raise SIGBUS instead of an EOF exception; see
+        // the NOTE in membuffer.h about truncation after this point
+        struct stat cur;
+        if (pos + len <= _length && ::fstat(_fd, &cur) == 0 &&
+            _offset + pos + len <= (upx_off_t) cur.st_size &&
+            mb.allocMapped(_fd, _offset + pos, len)) {
+            seek(len, SEEK_CUR);
+            return;
+        }
+    }
+    mb.alloc(len);
+    readx(mb, len);
+}
+
 upx_off_t InputFile::seek(upx_off_t off, int whence) {
     upx_off_t pos = super::seek(off, whence);
     if (_length < pos)
@@ -214,8 +243,26 @@ upx_off_t InputFile::st_size_orig() const { return _length_orig; }
 
 OutputFile::OutputFile() : bytes_written(0) {}
 
+OutputFile::~OutputFile() noexcept {
+    // closex() is the normal way; this is for error handling
+    if (isOpen() && wbuf_len != 0) {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+}
+
+void OutputFile::resetStaging() {
+    wbuf_len = 0;
+    wbuf_pos = 0;
+    cur_pos = 0;
+    positional = false;
+}
+
 void OutputFile::sopen(const char *name, int flags, int shflags, int mode) {
     close();
+    resetStaging();
     _name = name;
     _flags = flags;
     _shflags = shflags;
@@ -234,10 +281,12 @@ void OutputFile::sopen(const char *name, int flags, int shflags, int mode) {
         else
             throwIOException(_name, errno);
     }
+    positional = S_ISREG(st.st_mode) && !(flags & O_APPEND);
 }
 
 bool OutputFile::openStdout(int flags, bool force) {
     close();
+    resetStaging();
     int fd = STDOUT_FILENO;
     if (!force && acc_isatty(fd))
         return false;
@@ -253,6 +302,111 @@ bool OutputFile::openStdout(int flags, bool force) {
     return true;
 }
 
+void OutputFile::closex() {
+    if (isOpen())
+        flush();
+    resetStaging();
+    super::closex();
+}
+
+// write b1 and then b2; if positional at file offset pos, else sequentially
+void OutputFile::writeAt(upx_off_t pos, const byte *b1, size_t l1, const byte *b2, size_t l2) {
+    if (positional && ::lseek(_fd, pos, SEEK_SET) != pos)
+        throwIOException("seek error", errno);
+#if (USE_WRITEV)
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<byte *>(b1);
+    iov[0].iov_len = l1;
+    iov[1].iov_base = const_cast<byte *>(b2);
+    iov[1].iov_len = l2;
+    struct iovec *v = &iov[0];
+    int n = (l2 == 0) ? 1 : 2;
+    while (n > 0) {
+        if (v->iov_len == 0) {
+            v++;
+            n--;
+            continue;
+        }
+        errno = 0;
+        ssize_t l = ::writev(_fd, v, n);
+        if (l < 0 && errno == EINTR)
+            continue;
+        if (l <= 0)
+            throwIOException("write error", errno);
+        while (l > 0) {
+            size_t const done = UPX_MIN((size_t) l, v->iov_len);
+            v->iov_base = (byte *) v->iov_base + done;
+            v->iov_len -= done;
+            l -= done;
+            if (v->iov_len == 0) {
+                v++;
+                n--;
+            }
+        }
+    }
+#else
+    errno = 0;
+    if (acc_safe_hwrite(_fd, b1, (long) l1) != (long) l1)
+        throwIOException("write error", errno);
+    if (l2 != 0 && acc_safe_hwrite(_fd, b2, (long) l2) != (long) l2)
+        throwIOException("write error", errno);
+#endif
+}
+
+void OutputFile::flush() {
+    if (wbuf_len == 0)
+        return;
+    if (!isOpen())
+        throwIOException("bad write");
+    unsigned const len = wbuf_len;
+    wbuf_len = 0; // do not retry on errors
+    writeAt(wbuf_pos, wbuf, len);
+}
+
+// stage or write len bytes at the current position
+void OutputFile::put(const byte *buf, unsigned len) {
+    if (wbuf.getSize() == 0)
+        wbuf.alloc(STAGING_SIZE);
+    unsigned const capacity = wbuf.getSize();
+    if (!positional) {
+        // sequential output, e.g. a pipe
+        if (wbuf_len + len <= capacity) {
+            memcpy(wbuf + wbuf_len, buf, len);
+            wbuf_len += len;
+        } else {
+            unsigned const l1 = wbuf_len;
+            wbuf_len = 0;
+            writeAt(0, wbuf, l1, buf, len);
+        }
+        return;
+    }
+    if (wbuf_len == 0)
+        wbuf_pos = cur_pos;
+    upx_off_t const wbuf_end = wbuf_pos + wbuf_len;
+    if (cur_pos >= wbuf_pos && cur_pos <= wbuf_end && cur_pos + len <= wbuf_pos + capacity) {
+        // append to or patch the staging buffer
+        unsigned const off = (unsigned) (cur_pos - wbuf_pos);
+        memcpy(wbuf + off, buf, len);
+        if (off + len > wbuf_len)
+            wbuf_len = off + len;
+    } else if (cur_pos == wbuf_end) {
+        // large append: a single vectored write
+        unsigned const l1 = wbuf_len;
+        wbuf_len = 0;
+        writeAt(wbuf_pos, wbuf, l1, buf, len);
+    } else {
+        flush();
+        if (len >= capacity)
+            writeAt(cur_pos, buf, len);
+        else {
+            wbuf_pos = cur_pos;
+            memcpy(wbuf, buf, len);
+            wbuf_len = len;
+        }
+    }
+    cur_pos += len;
+}
+
 void OutputFile::write(SPAN_0(const void) buf, int len) {
     if (!isOpen() || len < 0)
         throwIOException("bad write");
@@ -260,14 +414,12 @@ void OutputFile::write(SPAN_0(const void) buf, int len) {
     if (len == 0)
         return;
     mem_size_assert(1, len); // sanity check
-    errno = 0;
+    PhaseTimer timer(STATS_WRITE, len);
 #if 0
     fprintf(stderr, "write %p %zd (%p) %d\n", buf.raw_ptr(), buf.raw_size_in_bytes(),
             buf.raw_base(), len);
 #endif
-    long l = acc_safe_hwrite(_fd, raw_bytes(buf, len), len);
-    if (l != len)
-        throwIOException("write error", errno);
+    put((const byte *) raw_bytes(buf, len), len);
     bytes_written += len;
 #if TESTING && 0
     static upx_std_atomic(bool) dumping;
@@ -290,7 +442,14 @@ upx_off_t OutputFile::st_size() const {
     my_st.st_size = 0;
     if (::fstat(_fd, &my_st) != 0)
         throwIOException(_name, errno);
-    return my_st.st_size;
+    upx_off_t size = my_st.st_size;
+    // account for staged data
+    if (wbuf_len != 0) {
+        upx_off_t const wbuf_end = positional ? wbuf_pos + wbuf_len : size + wbuf_len;
+        if (size < wbuf_end)
+            size = wbuf_end;
+    }
+    return size;
 }
 
 void OutputFile::rewrite(SPAN_P(const void) buf, int len) {
@@ -313,7 +472,36 @@ upx_off_t OutputFile::seek(upx_off_t off, int whence) {
         _length = bytes_written; // necessary
     } break;
     }
-    return super::seek(off, whence);
+    if (!positional) {
+        flush();
+        return super::seek(off, whence);
+    }
+    // same checks as FileBase::seek(), but only update cur_pos
+    if (!isOpen())
+        throwIOException("bad seek 1");
+    if (whence == SEEK_SET) {
+        if (off < 0)
+            throwIOException("bad seek 2");
+        cur_pos = _offset + off;
+    } else if (whence == SEEK_END) {
+        if (off > 0)
+            throwIOException("bad seek 3");
+        cur_pos = _offset + _length + off;
+    } else {
+        if (cur_pos + off < 0)
+            throwIOException("seek error", EINVAL);
+        cur_pos += off;
+    }
+    return cur_pos - _offset;
+}
+
+upx_off_t OutputFile::tell() const {
+    if (positional) {
+        if (!isOpen())
+            throwIOException("bad tell");
+        return cur_pos - _offset;
+    }
+    return super::tell() + wbuf_len;
 }
 
 // WARNING: fsync() does not exist in some Windows environments.
@@ -331,6 +519,7 @@ void OutputFile::set_extent(upx_off_t offset, upx_off_t length) {
     super::set_extent(offset, length);
     bytes_written = 0;
     if (0 == offset && (upx_off_t) ~0u == length) {
+        flush();
         if (::fstat(_fd, &st) != 0)
             throwIOException(_name, errno);
         _length = st.st_size - offset;
@@ -338,12 +527,14 @@ void OutputFile::set_extent(upx_off_t offset, upx_off_t length) {
 }
 
 upx_off_t OutputFile::unset_extent() {
+    flush();
     upx_off_t l = ::lseek(_fd, 0, SEEK_END);
     if (l < 0)
         throwIOException("lseek error", errno);
     _offset = 0;
     _length = l;
     bytes_written = _length;
+    cur_pos = l;
     return _length;
 }
 
@@ -357,4 +548,98 @@ void OutputFile::dump(const char *name, SPAN_P(const void) buf, int len, int fla
     f.closex();
 }
 
+/*************************************************************************
+//
+**************************************************************************/
+
+#if (ACC_OS_POSIX)
+
+// write and patch a file through OutputFile the way the packers do, and
+// compare the result with a copy that was kept in memory
+static void check_output_file(const char *name, bool append) {
+    const unsigned chunk = 100;
+    const unsigned n1 = 3000; // 300000 bytes: more than STAGING_SIZE
+    const unsigned n2 = 50;
+    const unsigned total = (n1 + n2) * chunk;
+    MemBuffer data(total);
+    for (unsigned i = 0; i < total; i++)
+        data[i] = (byte) (i ^ (i >> 8) ^ (i >> 16));
+    MemBuffer expected(total);
+    memcpy(expected, data, total);
+
+    OutputFile fo;
+    fo.open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | (append ? O_APPEND : 0), 0600);
+    for (unsigned i = 0; i < n1; i++) {
+        fo.write(data + i * chunk, chunk);
+        if (i % 500 == 0 || i + 1 == n1) {
+            // partly still in the staging buffer
+            CHECK(fo.tell() == (i + 1) * chunk);
+            CHECK(fo.st_size() == (i + 1) * chunk);
+            CHECK(fo.getBytesWritten() == (i + 1) * chunk);
+        }
+    }
+    byte hdr[16];
+    for (unsigned i = 0; i < 16; i++)
+        hdr[i] = (byte) (0xf0 + i);
+    if (!append) {
+        // rewrite a header that has already been written out
+        fo.seek(0, SEEK_SET);
+        fo.rewrite(hdr, 16);
+        memcpy(expected, hdr, 16);
+        CHECK(fo.tell() == 16);
+        // patch data that is still staged
+        fo.seek(n1 * chunk - 10, SEEK_SET);
+        fo.rewrite(hdr, 8);
+        memcpy(expected + n1 * chunk - 10, hdr, 8);
+        fo.seek(0, SEEK_END);
+        CHECK(fo.tell() == n1 * chunk);
+        CHECK(fo.st_size() == n1 * chunk);
+    }
+
+    // a second part at an offset, like a member of a fat Mach-O binary
+    const unsigned base = (unsigned) fo.unset_extent();
+    CHECK(base == n1 * chunk);
+    fo.set_extent(base, ~0u);
+    CHECK(fo.tell() == 0);
+    for (unsigned i = n1; i < n1 + n2; i++)
+        fo.write(data + i * chunk, chunk);
+    CHECK(fo.tell() == n2 * chunk);
+    CHECK(fo.st_size() == total);
+    if (!append) {
+        fo.seek(0, SEEK_SET);
+        fo.rewrite(hdr, 4);
+        memcpy(expected + base, hdr, 4);
+        CHECK(fo.tell() == 4);
+    }
+    CHECK(fo.unset_extent() == total);
+    fo.closex();
+
+    MemBuffer buf(total + 1);
+    FILE *f = fopen(name, "rb");
+    CHECK(f != nullptr);
+    if (f == nullptr)
+        return;
+    CHECK(fread(buf, 1, total + 1, f) == total);
+    fclose(f);
+    CHECK(memcmp(buf, expected, total) == 0);
+}
+
+TEST_CASE("OutputFile") {
+    const char *tmpdir = getenv("TMPDIR");
+    char name[ACC_FN_PATH_MAX + 1];
+    if (snprintf(name, sizeof(name), "%s/upx-doctest-XXXXXX",
+                 tmpdir && tmpdir[0] ? tmpdir : "/tmp") >= (int) sizeof(name))
+        return;
+    int fd = mkstemp(name);
+    if (fd < 0)
+        return;
+    (void) ::close(fd);
+    // positional writes to a regular file, and sequential writes like to a pipe
+    check_output_file(name, false);
+    check_output_file(name, true);
+    (void) ::unlink(name);
+}
+
+#endif // ACC_OS_POSIX
+
 /* vim:set ts=4 sw=4 et: */
@@ -29,6 +29,8 @@
 #ifndef UPX_FILE_H__
 #define UPX_FILE_H__ 1
 
+#include "util/membuffer.h"
+
 /*************************************************************************
 //
 **************************************************************************/
@@ -86,6 +88,9 @@ public:
 
     int read(SPAN_P(void) buf, int len);
     int readx(SPAN_P(void) buf, int len);
+    // like mb.alloc(len) followed by readx(mb, len), but maps the file
+    // copy-on-write when possible; see MemBuffer::allocMapped()
+    void readxMapped(MemBuffer &mb, int len);
 
     virtual upx_off_t seek(upx_off_t off, int whence) override;
     upx_off_t st_size_orig() const;
@@ -98,21 +103,29 @@ protected:
 //
 **************************************************************************/
 
+// Writes are collected in a staging buffer and written with as few
+// syscalls as possible. For regular files all writes use explicit file
+// offsets, so seek() is free and patching data that is still in the
+// staging buffer (seek() + rewrite()) does not touch the file at all.
 class OutputFile final : public FileBase {
     typedef FileBase super;
 
 public:
     OutputFile();
-    virtual ~OutputFile() {}
+    virtual ~OutputFile() noexcept;
 
     void sopen(const char *name, int flags, int shflags, int mode);
     void open(const char *name, int flags, int mode) { sopen(name, flags, -1, mode); }
     bool openStdout(int flags = 0, bool force = false);
+    void closex(); // flush and close
 
     // info: allow nullptr if len == 0
     void write(SPAN_0(const void) buf, int len);
+    // write out the staging buffer
+    void flush();
 
     virtual upx_off_t seek(upx_off_t off, int whence) override;
+    upx_off_t tell() const;
     virtual upx_off_t st_size() const override; // { return _length; }
     virtual void set_extent(upx_off_t offset, upx_off_t length) override;
     upx_off_t unset_extent(); // returns actual length
@@ -126,7 +139,20 @@ public:
     static void dump(const char *name, SPAN_P(const void) buf, int len, int flags = -1);
 
 protected:
+    void resetStaging();
+    void put(const byte *buf, unsigned len);
+    void writeAt(upx_off_t pos, const byte *b1, size_t l1, const byte *b2 = nullptr,
+                 size_t l2 = 0);
+
     upx_off_t bytes_written = 0;
+
+    // staging buffer
+    enum { STAGING_SIZE = 256 * 1024 };
+    MemBuffer wbuf;
+    unsigned wbuf_len = 0;
+    upx_off_t wbuf_pos = 0;  // file offset of wbuf[0]
+    upx_off_t cur_pos = 0;   // logical file offset; only if positional
+    bool positional = false; // regular file: do not use the fd file position
 };
 
 #endif
@@ -28,6 +28,7 @@
 #include "conf.h"
 #include "filter.h"
 #include "file.h"
+#include "util/stats.h"
 
 /*************************************************************************
 // util
@@ -104,6 +105,19 @@ void Filter::init(int id_, unsigned addvalue_) {
 
 bool Filter::filter(SPAN_0(byte) xbuf, unsigned buf_len_) {
     byte *const buf_ = raw_bytes(xbuf, buf_len_);
+    return doFilter(buf_, buf_len_, true);
+}
+
+bool Filter::filter(SPAN_0(const byte) xsrc, SPAN_0(byte) xdst, unsigned buf_len_) {
+    const byte *const src = raw_bytes(xsrc, buf_len_);
+    byte *const dst = raw_bytes(xdst, buf_len_);
+    if (src != dst && buf_len_ > 0)
+        memcpy(dst, src, buf_len_);
+    return doFilter(dst, buf_len_, false);
+}
+
+bool Filter::doFilter(byte *buf_, unsigned buf_len_, bool save_checksum) {
+    PhaseTimer timer(STATS_FILTER, buf_len_);
     initFilter(this, buf_, buf_len_);
 
     const FilterImpl::FilterEntry *const fe = FilterImpl::getFilter(id);
@@ -120,7 +134,7 @@ bool Filter::filter(SPAN_0(byte) xbuf, unsigned buf_len_) {
 
     // save checksum
     this->adler = 0;
-    if (clevel != 1)
+    if (clevel != 1 && save_checksum)
         this->adler = upx_adler32(this->buf, this->buf_len);
 
     NO_printf("filter: %02x %p %d\n", this->id, this->buf, this->buf_len);
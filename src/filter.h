@@ -53,6 +53,9 @@ public:
     void init(int id = 0, unsigned addvalue = 0);
 
     bool filter(SPAN_0(byte) buf, unsigned buf_len);
+    // out-of-place: filter a copy of src[] into dst[] and leave src[] untouched;
+    // as there is nothing to restore no checksum is computed
+    bool filter(SPAN_0(const byte) src, SPAN_0(byte) dst, unsigned buf_len);
     void unfilter(SPAN_0(byte) buf, unsigned buf_len, bool verify_checksum = false);
     void verifyUnfilter();
     bool scan(SPAN_0(const byte) buf, unsigned buf_len);
@@ -60,6 +63,21 @@ public:
     static bool isValidFilter(int filter_id);
     static bool isValidFilter(int filter_id, const int *allowed_filters);
 
+    // One pass over an x86 buffer that collects what the 32-bit calltrick
+    // filters (0x11..0x1e, 0x24..0x26, 0x36, 0x46, 0x49, 0x80..0x87) would
+    // see, so that all of them can be scored at once.
+    struct CallStats {
+        unsigned buf_len;
+        unsigned inside[3];     // call/jmp/jcc with a target inside the buffer
+        unsigned max_target[3]; // highest such target
+        byte outside[3][256];   // first displacement byte of all other ones
+    };
+    static void getCallStats(SPAN_0(const byte) buf, unsigned buf_len, CallStats *st);
+    // estimated number of calls that filter_id would convert (0 if it
+    // would fail); returns false if filter_id is not covered by CallStats
+    static bool estimateCalls(int filter_id, unsigned addvalue, const CallStats &st,
+                              unsigned *calls);
+
 public:
     // Will be set by each call to filter()/unfilter().
     // Read-only afterwards.
@@ -89,6 +107,7 @@ public:
     int id;
 
 private:
+    bool doFilter(byte *buf, unsigned buf_len, bool save_checksum);
     int clevel; // compression level
 };
 
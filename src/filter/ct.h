@@ -34,7 +34,11 @@
 #define CT16(f, cond, addvalue, get, set) \
     byte *b = f->buf; \
     byte *b_end = b + f->buf_len - 3; \
+    const unsigned n_end = f->buf_len - 3; \
     do { \
+        b = f->buf + opscan_next(f->buf, (unsigned) (b - f->buf), n_end, OPSCAN_E8E9); \
+        if (b >= b_end) \
+            break; \
         if (cond) \
         { \
             b += 1; \
@@ -213,7 +217,11 @@ static int s_ct16_e8e9_bswap_be(Filter *f)
 #define CT32(f, cond, addvalue, get, set) \
     byte *b = f->buf; \
     byte *b_end = b + f->buf_len - 5; \
+    const unsigned n_end = f->buf_len - 5; \
     do { \
+        b = f->buf + opscan_next(f->buf, (unsigned) (b - f->buf), n_end, OPSCAN_E8E9); \
+        if (b >= b_end) \
+            break; \
         if (cond) \
         { \
             b += 1; \
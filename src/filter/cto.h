@@ -59,6 +59,9 @@ static int F(Filter *f)
         // Note that unsigned comparison checks both edges of buffer.
         for (ic = 0; ic < size - 5; ic++)
         {
+            ic = opscan_next(b, ic, size - 5, COND_OPS);
+            if (ic >= size - 5)
+                break;
             if (!COND(b,ic))
                 continue;
             jc = get_le32(b+ic+1)+ic+1;
@@ -81,6 +84,9 @@ static int F(Filter *f)
 
     for (ic = 0; ic < size - 5; ic++)
     {
+        ic = opscan_next(b, ic, size - 5, COND_OPS);
+        if (ic >= size - 5)
+            break;
         if (!COND(b,ic))
             continue;
         jc = get_le32(b+ic+1)+ic+1;
@@ -149,6 +155,10 @@ static int U(Filter *f)
     unsigned ic, jc;
 
     for (ic = 0; ic < size5; ic++)
+    {
+        ic = opscan_next(b, ic, size5, COND_OPS);
+        if (ic >= size5)
+            break;
         if (COND(b,ic))
         {
             jc = get_be32(b+ic+1);
@@ -162,6 +172,7 @@ static int U(Filter *f)
             else
                 f->noncalls++;
         }
+    }
     return 0;
 }
 #endif
@@ -131,10 +131,15 @@ static int F(Filter *f)
         memset(buf,0,256);
 
         for (ic = 0; ic < size - 5; ic++)
+        {
+            ic = opscan_next(b, ic, size - 5, CONDF_OPS);
+            if (ic >= size - 5)
+                break;
             if (CONDF(which,b,ic,lastcall) && get_le32(b+ic+1)+ic+1 >= size)
             {
                 buf[b[ic+1]] |= 1;
             }
+        }
         UNUSED(which);
 
         if (getcto(f, buf) < 0)
@@ -149,6 +154,9 @@ static int F(Filter *f)
     {
         int which;
         int f_on = 0;
+        ic = opscan_next(b, ic, size - 5, CONDF_OPS);
+        if (ic >= size - 5)
+            break;
         if (!CONDF(which,b,ic,lastcall))
             continue;
         ++wtally[which];
@@ -282,6 +290,9 @@ static int U(Filter *f)
 
     for (ic = 0; ic < size5; ic++) {
         int which;
+        ic = opscan_next(b, ic, size5, CONDU_OPS);
+        if (ic >= size5)
+            break;
         if (CONDU(which,b,ic,lastcall))
         {
             unsigned f_on = 0;
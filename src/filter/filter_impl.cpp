@@ -28,6 +28,8 @@
 
 #include "../conf.h"
 #include "../filter.h"
+#include "../util/membuffer.h"
+#include <chrono>
 
 static unsigned
 umin(const unsigned a, const unsigned b)
@@ -46,6 +48,7 @@ umin(const unsigned a, const unsigned b)
 **************************************************************************/
 
 #include "getcto.h"
+#include "opscan.h"
 
 
 /*************************************************************************
@@ -66,27 +69,33 @@ umin(const unsigned a, const unsigned b)
 **************************************************************************/
 
 #define COND(b,x)               (b[x] == 0xe8)
+#define COND_OPS                OPSCAN_E8E9
 #define F                       f_cto32_e8_bswap_le
 #define U                       u_cto32_e8_bswap_le
 #include "cto.h"
 #define F                       s_cto32_e8_bswap_le
 #include "cto.h"
+#undef COND_OPS
 #undef COND
 
 #define COND(b,x)               (b[x] == 0xe9)
+#define COND_OPS                OPSCAN_E8E9
 #define F                       f_cto32_e9_bswap_le
 #define U                       u_cto32_e9_bswap_le
 #include "cto.h"
 #define F                       s_cto32_e9_bswap_le
 #include "cto.h"
+#undef COND_OPS
 #undef COND
 
 #define COND(b,x)               (b[x] == 0xe8 || b[x] == 0xe9)
+#define COND_OPS                OPSCAN_E8E9
 #define F                       f_cto32_e8e9_bswap_le
 #define U                       u_cto32_e8e9_bswap_le
 #include "cto.h"
 #define F                       s_cto32_e8e9_bswap_le
 #include "cto.h"
+#undef COND_OPS
 #undef COND
 
 
@@ -95,11 +104,13 @@ umin(const unsigned a, const unsigned b)
 **************************************************************************/
 
 #define COND(b,x,lastcall) (b[x] == 0xe8 || b[x] == 0xe9)
+#define COND_OPS                OPSCAN_E8E9
 #define F                       f_ctoj32_e8e9_bswap_le
 #define U                       u_ctoj32_e8e9_bswap_le
 #include "ctoj.h"
 #define F                       s_ctoj32_e8e9_bswap_le
 #include "ctoj.h"
+#undef COND_OPS
 #undef COND
 
 
@@ -110,11 +121,13 @@ umin(const unsigned a, const unsigned b)
 #define COND1(b,x)     (b[x] == 0xe8 || b[x] == 0xe9)
 #define COND2(b,x,lc)  (lc!=(x) && 0xf==b[(x)-1] && 0x80<=b[x] && b[x]<=0x8f)
 #define COND(b,x,lc,id) (COND1(b,x) || ((9<=(0xf&(id))) && COND2(b,x,lc)))
+#define COND_OPS        OPSCAN_RANGES(0xe8, 0xe9, 0x80, 0x8f)
 #define F                       f_ctok32_e8e9_bswap_le
 #define U                       u_ctok32_e8e9_bswap_le
 #include "ctok.h"
 #define F                       s_ctok32_e8e9_bswap_le
 #include "ctok.h"
+#undef COND_OPS
 #undef COND
 #undef COND2
 #undef COND1
@@ -135,6 +148,9 @@ umin(const unsigned a, const unsigned b)
     (COND1(which,b,x) || COND2(which,b,lastcall,x,(x)-1, x   ))
 #define CONDU(which,b,x,lastcall) \
     (COND1(which,b,x) || COND2(which,b,lastcall,x, x   ,(x)-1))
+// opcode byte b[x] of a CONDF/CONDU candidate
+#define CONDF_OPS OPSCAN_RANGES(0xe8, 0xe9, 0x80, 0x8f)
+#define CONDU_OPS OPSCAN_RANGES(0xe8, 0xe9, 0x0f, 0x0f)
 
 #define F                       f_ctojr32_e8e9_bswap_le
 #define U                       u_ctojr32_e8e9_bswap_le
@@ -142,6 +158,8 @@ umin(const unsigned a, const unsigned b)
 #define F                       s_ctojr32_e8e9_bswap_le
 #include "ctojr.h"
 
+#undef CONDU_OPS
+#undef CONDF_OPS
 #undef CONDU
 #undef CONDF
 #undef COND2
@@ -263,4 +281,248 @@ umin(const unsigned a, const unsigned b)
 
 /*static*/ const int FilterImpl::n_filters = TABLESIZE(filters);
 
+
+/*************************************************************************
+// call statistics for the filter pre-selection
+//
+// Instead of running scan() for every candidate, a single opscan pass
+// counts the call/jmp/jcc candidates and checks the cto conditions of
+// all 32-bit calltrick filters. This is only an estimate: unlike the
+// filters it does not skip the 4 displacement bytes after a hit.
+**************************************************************************/
+
+enum { CS_CALL, CS_JMP, CS_JCC };
+
+/*static*/ void Filter::getCallStats(SPAN_0(const byte) xbuf, unsigned buf_len_, CallStats *st)
+{
+    const byte *const b = raw_bytes(xbuf, buf_len_);
+    memset(st, 0, sizeof(*st));
+    st->buf_len = buf_len_;
+    if (buf_len_ < 6)
+        return;
+    const unsigned size5 = buf_len_ - 5;
+    for (unsigned ic = 0; ic < size5; ic++)
+    {
+        ic = opscan_next(b, ic, size5, OPSCAN_RANGES(0xe8, 0xe9, 0x80, 0x8f));
+        if (ic >= size5)
+            break;
+        int which;
+        if (b[ic] == 0xe8)
+            which = CS_CALL;
+        else if (b[ic] == 0xe9)
+            which = CS_JMP;
+        else if (ic > 0 && b[ic-1] == 0x0f)
+            which = CS_JCC;
+        else
+            continue;
+        const unsigned jc = get_le32(b+ic+1)+ic+1;
+        if (jc < buf_len_)
+        {
+            st->inside[which]++;
+            if (jc > st->max_target[which])
+                st->max_target[which] = jc;
+        }
+        else
+            st->outside[which][b[ic+1]] = 1;
+    }
+}
+
+/*static*/ bool Filter::estimateCalls(int filter_id, unsigned addvalue_, const CallStats &st,
+                                      unsigned *calls_)
+{
+    unsigned ops; // bit mask of CS_xxx
+    bool uses_cto = false;
+    switch (filter_id)
+    {
+    case 0x11: case 0x14: case 0x17: case 0x1a:
+        ops = 1u << CS_CALL; break;
+    case 0x12: case 0x15: case 0x18: case 0x1b:
+        ops = 1u << CS_JMP; break;
+    case 0x13: case 0x16: case 0x19: case 0x1c: case 0x1d: case 0x1e:
+        ops = (1u << CS_CALL) | (1u << CS_JMP); break;
+    case 0x24:
+        ops = 1u << CS_CALL; uses_cto = true; break;
+    case 0x25:
+        ops = 1u << CS_JMP; uses_cto = true; break;
+    case 0x26: case 0x36: case 0x46:
+        ops = (1u << CS_CALL) | (1u << CS_JMP); uses_cto = true; break;
+    case 0x49:
+    case 0x80: case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86: case 0x87:
+        ops = (1u << CS_CALL) | (1u << CS_JMP) | (1u << CS_JCC); uses_cto = true; break;
+    default:
+        return false;
+    }
+
+    *calls_ = 0;
+    const FilterImpl::FilterEntry *const fe = FilterImpl::getFilter(filter_id);
+    if (fe == nullptr || st.buf_len < fe->min_buf_len)
+        return true;
+    if (fe->max_buf_len && st.buf_len > fe->max_buf_len)
+        return true;
+    unsigned n = 0;
+    byte used[256];
+    memset(used, 0, sizeof(used));
+    for (int w = CS_CALL; w <= CS_JCC; w++)
+    {
+        if (!(ops & (1u << w)))
+            continue;
+        // see cto.h: the hi 8 bits of a converted target must not be cto8
+        if (uses_cto && st.inside[w] && st.max_target[w] + addvalue_ >= (1u << 24))
+            return true;
+        n += st.inside[w];
+        for (unsigned c = 0; c < 256; c++)
+            used[c] |= st.outside[w][c];
+    }
+    // see getcto.h: there must be a free cto byte
+    if (uses_cto && memchr(used, 0, sizeof(used)) == nullptr)
+        return true;
+    *calls_ = n;
+    return true;
+}
+
+
+/*************************************************************************
+//
+**************************************************************************/
+
+// x86-like test data: random bytes with many call/jmp/jcc opcodes
+static void opscan_test_fill(byte *p, unsigned len, upx_uint32_t seed)
+{
+    static const byte ops[] = {0xe8, 0xe9, 0x0f, 0x85, 0x8f};
+    for (unsigned i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned r = seed >> 16;
+        p[i] = (r & 7) == 0 ? ops[(r >> 3) % TABLESIZE(ops)] : (byte) (r >> 8);
+    }
+}
+
+TEST_CASE("opscan") {
+    // all supported kernels must find exactly the same positions as the
+    // scalar code, for all alignments and short tails
+    constexpr unsigned N = 1000;
+    MemBuffer mb(N);
+    opscan_test_fill(mb, N, 0x12345678);
+    static const unsigned ranges[] = {OPSCAN_E8E9, OPSCAN_RANGES(0xe8, 0xe9, 0x80, 0x8f),
+                                      OPSCAN_RANGES(0xe8, 0xe9, 0x0f, 0x0f),
+                                      OPSCAN_RANGES(0x00, 0xff, 0x00, 0xff)};
+    for (const auto &impl : opscan_impls) {
+        if (!impl.supported())
+            continue;
+        for (unsigned r : ranges) {
+            for (unsigned off = 0; off < 40; off++) {
+                for (unsigned len = 0; len <= 100; len += 7) {
+                    const byte *p = mb + off;
+                    const byte *end = p + len;
+                    for (const byte *q = p; q < end; q++) {
+                        const byte *x = impl.func(q, end, r);
+                        CHECK(x == opscan_scalar(q, end, r));
+                        q = x;
+                    }
+                }
+            }
+        }
+        // no match at all
+        memset(mb, 0, N);
+        CHECK(impl.func(mb, mb + N, OPSCAN_E8E9) == mb + N);
+        opscan_test_fill(mb, N, 0x12345678);
+    }
+    CHECK(opscan_next(mb, N, N, OPSCAN_E8E9) == N);
+}
+
+TEST_CASE("calltrick filters") {
+    // filter + unfilter must restore the buffer for all calltrick filters
+    static const int ids[] = {0x01, 0x03, 0x06, 0x09, 0x11, 0x12, 0x13, 0x16,
+                              0x19, 0x24, 0x25, 0x26, 0x36, 0x46, 0x49, 0x80};
+    constexpr unsigned N = 4096;
+    MemBuffer orig(N);
+    MemBuffer mb(N);
+    MemBuffer mb2(N);
+    opscan_test_fill(orig, N, 0x87654321);
+    // make most calls point into the buffer
+    for (unsigned i = 0; i + 5 <= N; i++)
+        if ((orig[i] == 0xe8 || orig[i] == 0xe9) && i % 61 != 0)
+            set_le32(orig + i + 1, (i * 37) % (N - i) - 1);
+    for (int id : ids) {
+        Filter ft(10);
+        ft.init(id, 0x1000);
+        memcpy(mb, orig, N);
+        const bool ok = ft.filter(mb, N);
+        CHECK(ok);
+        if (!ok)
+            continue;
+        CHECK(ft.calls > 0);
+        // out-of-place filtering gives the same result and keeps the source
+        Filter ft2(10);
+        ft2.init(id, 0x1000);
+        CHECK(ft2.filter(orig, mb2, N));
+        CHECK((ft2.calls == ft.calls && ft2.cto == ft.cto));
+        CHECK(memcmp(mb2, mb, N) == 0);
+        ft.unfilter(mb, N, true);
+        CHECK(memcmp(mb, orig, N) == 0);
+    }
+}
+
+TEST_CASE("Filter::estimateCalls") {
+    constexpr unsigned N = 4096;
+    MemBuffer mb(N);
+    opscan_test_fill(mb, N, 0x87654321);
+    for (unsigned i = 0; i + 5 <= N; i++)
+        if ((mb[i] == 0xe8 || mb[i] == 0xe9) && i % 61 != 0)
+            set_le32(mb + i + 1, (i * 37) % (N - i) - 1);
+    Filter::CallStats st;
+    Filter::getCallStats(mb, N, &st);
+    CHECK((st.inside[CS_CALL] > 0 && st.inside[CS_JMP] > 0));
+    unsigned calls = 0, calls_e8e9 = 0;
+    CHECK(!Filter::estimateCalls(0x01, 0x1000, st, &calls)); // not covered
+    CHECK(Filter::estimateCalls(0x24, 0x1000, st, &calls));
+    CHECK(calls == st.inside[CS_CALL]);
+    CHECK(Filter::estimateCalls(0x26, 0x1000, st, &calls_e8e9));
+    CHECK(calls_e8e9 == st.inside[CS_CALL] + st.inside[CS_JMP]);
+    // the targets would collide with the cto byte
+    CHECK(st.max_target[CS_CALL] >= 0x100);
+    CHECK(Filter::estimateCalls(0x26, 0xffff00, st, &calls));
+    CHECK(calls == 0);
+    // nothing to convert
+    memset(mb, 0, N);
+    Filter::getCallStats(mb, N, &st);
+    CHECK(Filter::estimateCalls(0x49, 0x1000, st, &calls));
+    CHECK(calls == 0);
+}
+
+// not run by default; use "upx --dt-no-skip --dt-test-case='*calltrick benchmark'"
+TEST_CASE("calltrick benchmark" * doctest::skip()) {
+    constexpr unsigned N = 8 * 1024 * 1024; // below max_buf_len of the cto filters
+    MemBuffer orig(N);
+    MemBuffer mb(N);
+    opscan_test_fill(orig, N, 1);
+    for (const auto &impl : opscan_impls) {
+        if (!impl.supported())
+            continue;
+        unsigned hits = 0;
+        const auto t0 = std::chrono::steady_clock::now();
+        for (const byte *p = orig, *end = orig + N; (p = impl.func(p, end, OPSCAN_E8E9)) < end; p++)
+            hits++;
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+        printf("opscan %-8s %8.1f MiB/s  %u hits\n", impl.name,
+               secs.count() > 0 ? N / (1024.0 * 1024.0) / secs.count() : 0.0, hits);
+    }
+    for (int id = 1; id < 256; id++) {
+        if (!Filter::isValidFilter(id))
+            continue;
+        Filter ft(10);
+        ft.init(id, 0);
+        memcpy(mb, orig, N);
+        const auto t0 = std::chrono::steady_clock::now();
+        const bool ok = ft.filter(mb, N);
+        const auto t1 = std::chrono::steady_clock::now();
+        if (ok)
+            ft.unfilter(mb, N);
+        const auto t2 = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> fsecs = t1 - t0, usecs = t2 - t1;
+        printf("filter 0x%02x %-6s filter %8.1f MiB/s  unfilter %8.1f MiB/s\n", id,
+               opscan_get()->name, fsecs.count() > 0 ? N / (1024.0 * 1024.0) / fsecs.count() : 0.0,
+               ok && usecs.count() > 0 ? N / (1024.0 * 1024.0) / usecs.count() : 0.0);
+    }
+}
+
 /* vim:set ts=4 sw=4 et: */
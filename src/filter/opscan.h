@@ -0,0 +1,196 @@
+/* opscan.h -- vectorized opcode scanning for the calltrick filters
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+
+// x86: compile the kernels with target attributes and select them at runtime
+#if (ACC_ARCH_AMD64 || ACC_ARCH_I386) && (ACC_CC_CLANG || ACC_CC_GNUC)
+#include <immintrin.h>
+#define USE_OPSCAN_X86 1
+#define OPSCAN_TARGET(x) __attribute__((__target__(x)))
+#endif
+// arm64: NEON is always available
+#if (ACC_ARCH_ARM64) && defined(__ARM_NEON) && (ACC_CC_CLANG || ACC_CC_GNUC)
+#include <arm_neon.h>
+#define USE_OPSCAN_NEON 1
+#endif
+
+
+/*************************************************************************
+// The calltrick filters only act at positions where the opcode byte
+// lies in one or two small ranges (0xe8..0xe9 for call/jmp, plus
+// 0x0f or 0x80..0x8f for jcc). opscan_next() finds the next such
+// position with vector compares, and the filter loops then evaluate
+// their exact COND only there. A hit is only a candidate, so the
+// filters produce exactly the same output as with a byte-by-byte scan.
+//
+// The two ranges [lo1,hi1] and [lo2,hi2] are packed into one unsigned.
+**************************************************************************/
+
+#define OPSCAN_RANGES(lo1,hi1,lo2,hi2) \
+    ((unsigned)(lo1) | ((unsigned)(hi1) << 8) | ((unsigned)(lo2) << 16) | ((unsigned)(hi2) << 24))
+#define OPSCAN_E8E9         OPSCAN_RANGES(0xe8, 0xe9, 0xe8, 0xe9)
+
+typedef const byte *(*opscan_func_t)(const byte *, const byte *, unsigned);
+
+static const byte *
+opscan_scalar(const byte *p, const byte *end, unsigned ranges)
+{
+    const byte lo1 = (byte) ranges, span1 = (byte) ((ranges >> 8) - ranges);
+    const byte lo2 = (byte) (ranges >> 16), span2 = (byte) ((ranges >> 24) - (ranges >> 16));
+    for (; p < end; p++)
+        if ((byte) (*p - lo1) <= span1 || (byte) (*p - lo2) <= span2)
+            break;
+    return p;
+}
+
+#if (USE_OPSCAN_X86)
+
+OPSCAN_TARGET("sse2")
+static const byte *
+opscan_sse2(const byte *p, const byte *end, unsigned ranges)
+{
+    const __m128i lo1 = _mm_set1_epi8((char) ranges);
+    const __m128i span1 = _mm_set1_epi8((char) ((ranges >> 8) - ranges));
+    const __m128i lo2 = _mm_set1_epi8((char) (ranges >> 16));
+    const __m128i span2 = _mm_set1_epi8((char) ((ranges >> 24) - (ranges >> 16)));
+    while (end - p >= 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *) (const void *) p);
+        // unsigned (x - lo) <= span  <=>  min(x - lo, span) == x - lo
+        const __m128i t1 = _mm_sub_epi8(x, lo1);
+        const __m128i t2 = _mm_sub_epi8(x, lo2);
+        const __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t1, span1), t1),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(t2, span2), t2));
+        const unsigned mask = (unsigned) _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return opscan_scalar(p, end, ranges);
+}
+
+OPSCAN_TARGET("avx2")
+static const byte *
+opscan_avx2(const byte *p, const byte *end, unsigned ranges)
+{
+    const __m256i lo1 = _mm256_set1_epi8((char) ranges);
+    const __m256i span1 = _mm256_set1_epi8((char) ((ranges >> 8) - ranges));
+    const __m256i lo2 = _mm256_set1_epi8((char) (ranges >> 16));
+    const __m256i span2 = _mm256_set1_epi8((char) ((ranges >> 24) - (ranges >> 16)));
+    while (end - p >= 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *) (const void *) p);
+        const __m256i t1 = _mm256_sub_epi8(x, lo1);
+        const __m256i t2 = _mm256_sub_epi8(x, lo2);
+        const __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t1, span1), t1),
+                                          _mm256_cmpeq_epi8(_mm256_min_epu8(t2, span2), t2));
+        const unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return opscan_sse2(p, end, ranges);
+}
+
+#endif // USE_OPSCAN_X86
+
+#if (USE_OPSCAN_NEON)
+
+static const byte *
+opscan_neon(const byte *p, const byte *end, unsigned ranges)
+{
+    const uint8x16_t lo1 = vdupq_n_u8((byte) ranges);
+    const uint8x16_t span1 = vdupq_n_u8((byte) ((ranges >> 8) - ranges));
+    const uint8x16_t lo2 = vdupq_n_u8((byte) (ranges >> 16));
+    const uint8x16_t span2 = vdupq_n_u8((byte) ((ranges >> 24) - (ranges >> 16)));
+    while (end - p >= 16) {
+        const uint8x16_t x = vld1q_u8(p);
+        const uint8x16_t m = vorrq_u8(vcleq_u8(vsubq_u8(x, lo1), span1),
+                                      vcleq_u8(vsubq_u8(x, lo2), span2));
+        // narrow to 4 bits per byte to get a 64-bit "movemask"
+        const uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+        const upx_uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(n), 0);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+    return opscan_scalar(p, end, ranges);
+}
+
+#endif // USE_OPSCAN_NEON
+
+
+struct OpScanImpl {
+    const char *name;
+    opscan_func_t func;
+    bool (*supported)();
+};
+
+static bool opscan_always_supported() { return true; }
+#if (USE_OPSCAN_X86)
+static bool opscan_sse2_supported() { return __builtin_cpu_supports("sse2"); }
+static bool opscan_avx2_supported() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+// in order of preference
+static const OpScanImpl opscan_impls[] = {
+#if (USE_OPSCAN_X86)
+    {"avx2", opscan_avx2, opscan_avx2_supported},
+    {"sse2", opscan_sse2, opscan_sse2_supported},
+#endif
+#if (USE_OPSCAN_NEON)
+    {"neon", opscan_neon, opscan_always_supported},
+#endif
+    {"scalar", opscan_scalar, opscan_always_supported},
+};
+
+static const OpScanImpl *opscan_select()
+{
+#if (USE_OPSCAN_X86)
+    __builtin_cpu_init();
+#endif
+    for (const auto &impl : opscan_impls)
+        if (impl.supported())
+            return &impl;
+    return &opscan_impls[TABLESIZE(opscan_impls) - 1];
+}
+
+static const OpScanImpl *opscan_get()
+{
+    static const OpScanImpl *const impl = opscan_select(); // thread-safe init
+    return impl;
+}
+
+// index of the first opcode candidate in [i, n), or n
+static inline unsigned
+opscan_next(const byte *b, unsigned i, unsigned n, unsigned ranges)
+{
+    if (i >= n)
+        return n;
+    return (unsigned) (opscan_get()->func(b + i, b + n, ranges) - b);
+}
+
+
+/* vim:set ts=4 sw=4 et: */
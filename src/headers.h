@@ -71,7 +71,7 @@
 #include <new>
 #include <type_traits>
 
-// C++ multithreading (UPX currently does not use multithreading)
+// C++ multithreading; see option --threads
 #ifndef WITH_THREADS
 #define WITH_THREADS 0
 #endif
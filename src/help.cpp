@@ -175,7 +175,9 @@ void show_help(int verbose) {
                 "  -d     decompress                        -l    list compressed file\n"
                 "  -t     test compressed file              -V    display version number\n"
                 "  -h     give %s help                    -L    display software license\n%s",
-                verbose == 0 ? "" : "  --best compress best (can be slow for big files)\n",
+                verbose == 0 ? ""
+                             : "  --best compress best (can be slow for big files)\n"
+                               "  --fast-test  like -t, but only verify the checksums\n",
                 verbose == 0 ? "more" : "this", verbose == 0 ? "" : "\n");
 
     fg = con_fg(f, FG_YELLOW);
@@ -205,6 +207,10 @@ void show_help(int verbose) {
                     "  --lzma              try LZMA [slower but tighter than NRV]\n"
                     "  --brute             try all available compression methods & filters [slow]\n"
                     "  --ultra-brute       try even more compression variants [very slow]\n"
+                    "  --threads=N         use N threads [default: 1; 0 means all CPUs]\n"
+                    "  --stats=json        print per-phase timings as JSON to stderr\n"
+                    "  --cache-dir=DIR     reuse compression results of earlier runs\n"
+                    "  --hints-file=FILE   try the methods & filters that won last time first\n"
                     "\n");
         fg = con_fg(f, FG_YELLOW);
         con_fprintf(f, "Backup options:\n");
@@ -281,6 +287,7 @@ void show_help(int verbose) {
         fg = con_fg(f, fg);
         con_fprintf(f,
                     "  --preserve-build-id     copy .gnu.note.build-id to compressed output\n"
+                    "  --memory-budget=MIB     limit buffer memory when packing large files\n"
                     "\n");
     }
     // clang-format on
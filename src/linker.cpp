@@ -42,7 +42,7 @@ static bool update_capacity(unsigned size, unsigned *capacity) {
 
 static void internal_error(const char *format, ...) attribute_format(1, 2);
 static void internal_error(const char *format, ...) {
-    static char buf[1024];
+    static upx_thread_local char buf[1024];
     va_list ap;
 
     va_start(ap, format);
@@ -32,6 +32,7 @@
 #include "packer.h"
 #include "p_elf.h"
 #include "compress/compress.h" // upx_ucl_init()
+#include "util/thread_pool.h"
 
 /*************************************************************************
 // options
@@ -103,7 +104,14 @@ static bool set_eec(int ec, int *eec) {
     return 0;
 }
 
-bool main_set_exit_code(int ec) { return set_eec(ec, &exit_code); }
+bool main_set_exit_code(int ec) {
+#if (WITH_THREADS)
+    // files may get processed concurrently, see do_files()
+    static std::mutex exit_code_mutex;
+    std::lock_guard<std::mutex> lock(exit_code_mutex);
+#endif
+    return set_eec(ec, &exit_code);
+}
 
 __acc_static_noinline void e_exit(int ec) {
     if (opt->debug.getopt_throw_instead_of_exit)
@@ -487,6 +495,7 @@ static int do_option(int optc, const char *arg) {
 
     case 902: // --ultra-brute
         opt->ultra_brute = true;
+        opt->filter_top_k = 0;
         /* fallthrough */
     case 901: // --brute, much like --all-methods --all-filters --best
         opt->all_methods = true;
@@ -521,6 +530,9 @@ static int do_option(int optc, const char *arg) {
     case 545:
         opt->debug.disable_random_id = true;
         break;
+    case 546:
+        getoptvar(&opt->debug.max_blocksize, 65536u, ~0u, arg);
+        break;
 
     // misc
     case 512:
@@ -547,6 +559,31 @@ static int do_option(int optc, const char *arg) {
     case 528:
         opt->preserve_timestamp = false;
         break;
+    case 530: // --threads=
+        getoptvar(&opt->threads, 0, 64, arg);
+        break;
+    case 532: // --stats=json
+        if (mfx_optarg && strcmp(mfx_optarg, "json") != 0)
+            e_optarg(arg);
+        opt->stats = 1;
+        break;
+    case 533: // --fast-test
+        set_cmd(CMD_TEST);
+        opt->fast_test = true;
+        break;
+    case 534: // --cache-dir=
+        if (!mfx_optarg || !mfx_optarg[0])
+            e_optarg(arg);
+        opt->cache_dir = mfx_optarg;
+        break;
+    case 535: // --cache-size=
+        getoptvar(&opt->cache_size, 1u, 1024u * 1024u, arg);
+        break;
+    case 536: // --hints-file=
+        if (!mfx_optarg || !mfx_optarg[0])
+            e_optarg(arg);
+        opt->hints_file = mfx_optarg;
+        break;
     // compression settings
     case 520: // --small
         if (opt->small < 0)
@@ -575,6 +612,9 @@ static int do_option(int optc, const char *arg) {
     case 525: // --exact
         opt->exact = true;
         break;
+    case 531: // --filter-top-k=
+        getoptvar(&opt->filter_top_k, 0, 255, arg);
+        break;
     // CRP - Compression Runtime Parameters (undocumented and subject to change)
     case 801:
         getoptvar(&opt->crp.crp_ucl.c_flags, 0, 3, arg);
@@ -621,6 +661,22 @@ static int do_option(int optc, const char *arg) {
     case 823:
         getoptvar(&opt->crp.crp_zlib.strategy, arg);
         break;
+    case 831:
+        // 0 (auto) or ZSTD_WINDOWLOG_MIN..ZSTD_WINDOWLOG_LIMIT_DEFAULT; bigger
+        // windows would need a raised window limit when decompressing
+        getoptvar(&opt->crp.crp_zstd.window_log, arg);
+        if (opt->crp.crp_zstd.window_log != 0u && opt->crp.crp_zstd.window_log < 10u)
+            e_optval(arg);
+        break;
+    case 832:
+        getoptvar(&opt->crp.crp_zstd.strategy, arg);
+        break;
+    case 833:
+        getoptvar(&opt->crp.crp_zstd.long_distance, arg);
+        break;
+    case 834:
+        getoptvar(&opt->crp.crp_zstd.num_workers, arg);
+        break;
     // backup
     case 'k':
         opt->backup = 1;
@@ -769,6 +825,9 @@ static int do_option(int optc, const char *arg) {
     case 677:
         opt->o_unix.force_pie = true;
         break;
+    case 678:
+        getoptvar(&opt->o_unix.memory_budget, 16u, 1024u * 1024u, arg);
+        break;
 
 #if !defined(DOCTEST_CONFIG_DISABLE)
     case 999: // doctest --dt-XXX option
@@ -804,6 +863,7 @@ int main_get_options(int argc, char **argv) {
         {"license", 0, N, 'L'},        // display software license
         {"list", 0, N, 'l'},           // list compressed exe
         {"test", 0, N, 't'},           // test compressed file integrity
+        {"fast-test", 0, N, 533},      // only verify checksums
         {"uncompress", 0, N, 'd'},     // decompress
         {"version", 0, N, 'V' + 256},  // display version number
 
@@ -818,8 +878,13 @@ int main_get_options(int argc, char **argv) {
         {"no-progress", 0, N, 516},        // no progress bar
         {"no-time", 0x10, N, 528},         // do not preserve timestamp
         {"output", 0x21, N, 'o'},
-        {"quiet", 0, N, 'q'},  // quiet mode
-        {"silent", 0, N, 'q'}, // quiet mode
+        {"quiet", 0, N, 'q'},      // quiet mode
+        {"silent", 0, N, 'q'},     // quiet mode
+        {"threads", 0x31, N, 530}, // --threads=
+        {"stats", 0x31, N, 532},   // --stats=json
+        {"cache-dir", 0x31, N, 534},  // --cache-dir=
+        {"cache-size", 0x31, N, 535}, // --cache-size=
+        {"hints-file", 0x31, N, 536}, // --hints-file=
 #if 0
         // FIXME: to_stdout doesn't work because of console code mess
         {"stdout",           0x10, N, 517},     // write output on standard output
@@ -829,10 +894,11 @@ int main_get_options(int argc, char **argv) {
 
         // debug options
         {"debug", 0x10, N, 'D'},
-        {"dump-stub-loader", 0x31, N, 544},  // for internal debugging
-        {"fake-stub-version", 0x31, N, 542}, // for internal debugging
-        {"fake-stub-year", 0x31, N, 543},    // for internal debugging
-        {"disable-random-id", 0x10, N, 545}, // for internal debugging
+        {"dump-stub-loader", 0x31, N, 544},    // for internal debugging
+        {"fake-stub-version", 0x31, N, 542},   // for internal debugging
+        {"fake-stub-year", 0x31, N, 543},      // for internal debugging
+        {"disable-random-id", 0x10, N, 545},   // for internal debugging
+        {"debug-max-blocksize", 0x31, N, 546}, // for internal debugging
 
         // backup options
         {"backup", 0x10, N, 'k'},
@@ -870,6 +936,7 @@ int main_get_options(int argc, char **argv) {
         {"all-methods", 0x10, N, 524},
         {"exact", 0x10, N, 525},  // user requires byte-identical decompression
         {"filter", 0x31, N, 521}, // --filter=
+        {"filter-top-k", 0x31, N, 531},
         {"no-filter", 0x10, N, 522},
         {"small", 0x10, N, 520},
         // CRP - Compression Runtime Parameters (undocumented and subject to change)
@@ -895,6 +962,10 @@ int main_get_options(int argc, char **argv) {
         {"crp-zlib-ml", 0x31, N, 821},
         {"crp-zlib-wb", 0x31, N, 822},
         {"crp-zlib-st", 0x31, N, 823},
+        {"crp-zstd-wl", 0x31, N, 831},
+        {"crp-zstd-st", 0x31, N, 832},
+        {"crp-zstd-ldm", 0x31, N, 833},
+        {"crp-zstd-nw", 0x31, N, 834},
 
         // atari/tos
         {"split-segments", 0x10, N, 650},
@@ -923,6 +994,7 @@ int main_get_options(int argc, char **argv) {
         {"preserve-build-id", 0, N, 675},
         {"android-shlib", 0, N, 676},
         {"force-pie", 0x90, N, 677},
+        {"memory-budget", 0x31, N, 678}, // --memory-budget=
         // watcom/le
         {"le", 0x10, N, 620}, // produce LE output
                               // win32/pe
@@ -953,6 +1025,9 @@ int main_get_options(int argc, char **argv) {
         {"dt-list-test-suites", 0x10, N, 999},
         {"dt-v", 0x10, N, 999},
         {"dt-version", 0x10, N, 999},
+        // [doctest] Filters - select the test cases to run
+        {"dt-tc", 0x31, N, 999},
+        {"dt-test-case", 0x31, N, 999},
         // [doctest] Bool options - can be used like flags and true is assumed. Available:
         {"dt-d", 0x12, N, 999},
         {"dt-duration", 0x12, N, 999},
@@ -964,6 +1039,8 @@ int main_get_options(int argc, char **argv) {
         {"dt-no-throw", 0x12, N, 999},
         {"dt-nr", 0x12, N, 999},
         {"dt-no-run", 0x12, N, 999},
+        {"dt-ns", 0x12, N, 999},
+        {"dt-no-skip", 0x12, N, 999},
         {"dt-s", 0x12, N, 999},
         {"dt-success", 0x12, N, 999},
 #endif
@@ -1004,6 +1081,7 @@ void main_get_envoptions() {
         {"no-progress", 0, N, 516}, // no progress bar
         {"quiet", 0, N, 'q'},       // quiet mode
         {"silent", 0, N, 'q'},      // quiet mode
+        {"threads", 0x31, N, 530},  // --threads=
         {"verbose", 0, N, 'v'},     // verbose mode
 
         // debug options
@@ -1264,6 +1342,7 @@ int upx_main(int argc, char *argv[]) {
         e_help();
     set_term(stderr);
     check_options(i, argc);
+    ThreadPool::setGlobalNumThreads(opt->threads);
     int num_files = argc - i;
     if (num_files < 1) {
         if (opt->verbose >= 2)
@@ -1277,6 +1356,15 @@ int upx_main(int argc, char *argv[]) {
     if (do_files(i, argc, argv) != 0)
         return exit_code;
 
+    if (opt->debug.debug_level) {
+        const MemBuffer::StatsInfo ms = MemBuffer::getStats();
+        const unsigned pool_total = ms.pool_hit_counter + ms.pool_miss_counter;
+        fprintf(stderr, "MemBuffer: %u allocs, %llu bytes; pool: %u hits, %u misses (%.1f%%)\n",
+                ms.alloc_counter, (unsigned long long) ms.total_bytes, ms.pool_hit_counter,
+                ms.pool_miss_counter,
+                pool_total ? 100.0 * ms.pool_hit_counter / pool_total : 0.0);
+    }
+
     if (gitrev[0]) {
         // also see UPX_CONFIG_DISABLE_GITREV in CMakeLists.txt
         bool warn_gitrev = true;
@@ -1332,7 +1420,11 @@ int __acc_cdecl_main main(int argc, char *argv[]) {
     // srand((int) time(nullptr));
     srand((int) clock());
 
+#if (UPX_CONFIG_BENCH)
+    int r = upx_bench_main(argc, argv);
+#else
     int r = upx_main(argc, argv);
+#endif
 
 #if 0 && defined(__GLIBC__)
     //malloc_stats();
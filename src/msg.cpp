@@ -34,7 +34,7 @@
 // we write all error messages to both stderr and stdout ?
 **************************************************************************/
 
-static int pr_need_nl = 0;
+static upx_thread_local int pr_need_nl = 0;
 
 void printSetNl(int need_nl) { pr_need_nl = need_nl; }
 
@@ -60,7 +60,7 @@ void printClearLine(FILE *f) {
 static void pr_print(bool c, const char *msg) {
     if (c && !opt->to_stdout)
         con_fprintf(stderr, "%s", msg);
-    else
+    else if (!con_capture_fputs(stderr, msg))
         fprintf(stderr, "%s", msg);
 }
 
@@ -157,7 +157,7 @@ void printUnhandledException(const char *iname, const std::exception *e) {
 // FIXME: should use colors and a consistent layout here
 **************************************************************************/
 
-static int info_header = 0;
+static upx_thread_local int info_header = 0;
 
 static void info_print(const char *msg) {
     if (opt->info_mode <= 0)
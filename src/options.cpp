@@ -28,11 +28,7 @@
 #include "conf.h"
 
 static Options global_options;
-Options *opt = &global_options; // also see class PackMaster
-
-#if WITH_THREADS
-std::mutex opt_lock_mutex;
-#endif
+upx_thread_local Options *opt = &global_options; // also see class PackMaster
 
 /*************************************************************************
 // reset
@@ -47,6 +43,7 @@ void Options::reset() {
     o->method = M_NONE;
     o->level = -1;
     o->filter = FT_NONE;
+    o->filter_top_k = 3;
 
     o->backup = -1;
     o->overlay = -1;
@@ -63,6 +60,9 @@ void Options::reset() {
     o->console = CON_INIT;
 #endif
     o->verbose = 2;
+    o->threads = 1;
+    o->concurrent_files = 1;
+    o->cache_size = 256;
 
     o->o_unix.osabi0 = 3; // 3 == ELFOSABI_LINUX
 
@@ -97,9 +97,6 @@ static inline void test_options(const char *(&a)[N]) {
 }
 
 TEST_CASE("getopt") {
-#if WITH_THREADS
-    std::lock_guard<std::mutex> lock(opt_lock_mutex);
-#endif
     Options *const saved_opt = opt;
     Options local_options;
     opt = &local_options;
@@ -159,6 +156,41 @@ TEST_CASE("getopt") {
         CHECK(opt->all_methods_use_lzma == -1);
         CHECK(opt->method == -1);
     }
+    SUBCASE("threads") {
+        const char *a[] = {a0, "--threads=4", nullptr};
+        test_options(a);
+        CHECK(opt->threads == 4);
+    }
+    SUBCASE("fast-test") {
+        const char *a[] = {a0, "--fast-test", nullptr};
+        test_options(a);
+        CHECK(opt->cmd == CMD_TEST);
+        CHECK(opt->fast_test);
+    }
+    SUBCASE("cache-dir") {
+        const char *a[] = {a0, "--cache-dir=/tmp/upx-cache", "--cache-size=64", nullptr};
+        test_options(a);
+        CHECK(strcmp(opt->cache_dir, "/tmp/upx-cache") == 0);
+        CHECK(opt->cache_size == 64);
+    }
+    SUBCASE("hints-file") {
+        const char *a[] = {a0, "--hints-file=upx-hints.txt", nullptr};
+        test_options(a);
+        CHECK(strcmp(opt->hints_file, "upx-hints.txt") == 0);
+    }
+    SUBCASE("crp-zstd-wl") {
+        const char *a[] = {a0, "--crp-zstd-wl=27", nullptr};
+        test_options(a);
+        CHECK(opt->crp.crp_zstd.window_log == 27u);
+        const char *b[] = {a0, "--crp-zstd-wl=10", nullptr};
+        test_options(b);
+        CHECK(opt->crp.crp_zstd.window_log == 10u);
+    }
+    SUBCASE("debug-max-blocksize") {
+        const char *a[] = {a0, "--debug-max-blocksize=65536", nullptr};
+        test_options(a);
+        CHECK(opt->debug.max_blocksize == 65536);
+    }
 
     opt = saved_opt;
 }
@@ -30,13 +30,11 @@
 #define UPX_OPTIONS_H__ 1
 
 struct Options;
-extern Options *opt;
+class PhaseStats;
+// each thread has its own current options; also see class PackMaster
+extern upx_thread_local Options *opt;
 #define options_t Options // old name
 
-#if WITH_THREADS
-extern std::mutex opt_lock_mutex;
-#endif
-
 /*************************************************************************
 // globals
 **************************************************************************/
@@ -69,9 +67,11 @@ struct Options final {
     bool all_methods; // try all available compression methods ?
     int all_methods_use_lzma;
     bool all_filters; // try all available filters ?
+    int filter_top_k; // only trial-compress the K best-scoring filters; 0 means all
     bool no_filter;   // force no filter
     bool prefer_ucl;  // prefer UCL
     bool exact;       // user requires byte-identical decompression
+    bool fast_test;   // "-t" only verifies checksums, no output is rebuilt
 
     // other options
     int backup;
@@ -89,6 +89,13 @@ struct Options final {
     int small;
     int verbose;
     bool to_stdout;
+    int threads; // 0 means use all CPUs
+    unsigned concurrent_files; // files packed at the same time, see do_files_batch()
+    int stats;   // see option "--stats": 0 off, 1 json
+    PhaseStats *phase_stats; // collector of the current file, or nullptr
+    const char *cache_dir;   // see option "--cache-dir", or nullptr
+    unsigned cache_size;     // in MiB
+    const char *hints_file;  // see option "--hints-file", or nullptr
 
     // debug options
     struct {
@@ -98,6 +105,7 @@ struct Options final {
         char fake_stub_version[4 + 1];     // for internal debugging
         char fake_stub_year[4 + 1];        // for internal debugging
         bool getopt_throw_instead_of_exit; // for doctest
+        unsigned max_blocksize;            // for testing multi-block extents
     } debug;
 
     // overlay handling
@@ -110,10 +118,12 @@ struct Options final {
         lzma_compress_config_t crp_lzma;
         ucl_compress_config_t crp_ucl;
         zlib_compress_config_t crp_zlib;
+        zstd_compress_config_t crp_zstd;
         void reset() {
             crp_lzma.reset();
             crp_ucl.reset();
             crp_zlib.reset();
+            crp_zstd.reset();
         }
     };
     crp_t crp;
@@ -141,6 +151,7 @@ struct Options final {
     } dos_exe;
     struct {
         unsigned blocksize;
+        unsigned memory_budget; // in MiB; 0 means unlimited
         bool force_execve;      // force the linux/386 execve format
         bool is_ptinterp;       // is PT_INTERP, so don't adjust auxv_t
         bool use_ptinterp;      // use PT_INTERP /opt/upx/run
@@ -66,9 +66,7 @@ const int *PackDjgpp2::getFilters() const {
     return filters;
 }
 
-unsigned PackDjgpp2::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range,
-                                         unsigned upper_limit) const {
-    unsigned o = super::findOverlapOverhead(buf, tbuf, range, upper_limit);
+unsigned PackDjgpp2::alignOverlapOverhead(unsigned o) const {
     o = (o + 0x3ff) & ~0x1ff;
     return o;
 }
@@ -127,6 +127,19 @@ static void alloc_file_image(MemBuffer &mb, off_t size)
     }
 }
 
+// read the whole file; map it copy-on-write if possible
+static void read_file_image(InputFile *f, MemBuffer &mb, off_t size)
+{
+    assert(mem_size_valid_bytes(size));
+    f->seek(0, SEEK_SET);
+    if (mb.getVoidPtr() == nullptr) {
+        f->readxMapped(mb, size);
+    } else {
+        assert((u32_t)size <= mb.getSize());
+        f->readx(mb, size);
+    }
+}
+
 int
 PackLinuxElf32::checkEhdr(Elf32_Ehdr const *ehdr) const
 {
@@ -300,9 +313,7 @@ PackLinuxElf32::PackLinuxElf32help1(InputFile *f)
     }
     if (f && Elf32_Ehdr::ET_DYN==e_type) {
         // The DT_SYMTAB has no designated length.  Read the whole file.
-        alloc_file_image(file_image, file_size);
-        f->seek(0, SEEK_SET);
-        f->readx(file_image, file_size);
+        read_file_image(f, file_image, file_size);
         phdri= (Elf32_Phdr *)(e_phoff + file_image);  // do not free() !!
         shdri= (Elf32_Shdr *)(e_shoff + file_image);  // do not free() !!
         if (opt->cmd != CMD_COMPRESS) {
@@ -814,9 +825,7 @@ PackLinuxElf64::PackLinuxElf64help1(InputFile *f)
     }
     if (f && Elf64_Ehdr::ET_DYN==e_type) {
         // The DT_SYMTAB has no designated length.  Read the whole file.
-        alloc_file_image(file_image, file_size);
-        f->seek(0, SEEK_SET);
-        f->readx(file_image, file_size);
+        read_file_image(f, file_image, file_size);
         phdri= (file_size <= (unsigned)e_phoff) ? nullptr : (Elf64_Phdr *)(e_phoff + file_image);  // do not free() !!
         shdri= (file_size <= (unsigned)e_shoff) ? nullptr : (Elf64_Shdr *)(e_shoff + file_image);  // do not free() !!
         if (opt->cmd != CMD_COMPRESS) {
@@ -2161,9 +2170,7 @@ bool PackLinuxElf32::canPack()
 
     if (Elf32_Ehdr::ET_DYN==get_te16(&ehdr->e_type)) {
         // The DT_SYMTAB has no designated length.  Read the whole file.
-        alloc_file_image(file_image, file_size);
-        fi->seek(0, SEEK_SET);
-        fi->readx(file_image, file_size);
+        read_file_image(fi, file_image, file_size);
         memcpy(&ehdri, ehdr, sizeof(Elf32_Ehdr));
         phdri= (Elf32_Phdr *)((size_t)e_phoff + file_image);  // do not free() !!
         shdri= (Elf32_Shdr *)((size_t)e_shoff + file_image);  // do not free() !!
@@ -2566,9 +2573,7 @@ PackLinuxElf64::canPack()
 
     if (Elf64_Ehdr::ET_DYN==get_te16(&ehdr->e_type)) {
         // The DT_SYMTAB has no designated length.  Read the whole file.
-        alloc_file_image(file_image, file_size);
-        fi->seek(0, SEEK_SET);
-        fi->readx(file_image, file_size);
+        read_file_image(fi, file_image, file_size);
         memcpy(&ehdri, ehdr, sizeof(Elf64_Ehdr));
         phdri= (Elf64_Phdr *)((size_t)e_phoff + file_image);  // do not free() !!
         shdri= (Elf64_Shdr *)((size_t)e_shoff + file_image);  // do not free() !!
@@ -2865,7 +2870,11 @@ proceed: ;
     // set options
     // this->blocksize: avoid over-allocating.
     // (file_size - max_offset): debug info, non-globl symbols, etc.
-    opt->o_unix.blocksize = blocksize = UPX_MAX(max_LOADsz, file_size - max_offset);
+    blocksize = UPX_MAX(max_LOADsz, file_size - max_offset);
+    if (!xct_off) { // main program: each PT_LOAD may span several b_info
+        blocksize = getBudgetBlocksize(blocksize);
+    }
+    opt->o_unix.blocksize = blocksize;
     return true;
 }
 
@@ -4044,6 +4053,23 @@ void PackLinuxElf64::pack1(OutputFile * /*fo*/, Filter &ft)
         unsigned max_offset = 0;
         unsigned sz_best= ~0u;
         int method_best = 0;
+        // Compress one piece in chunks of at most blocksize, as packExtent() will.
+        auto const trial_size = [&](unsigned offset, unsigned len, int method) {
+            unsigned sz = 0;
+            fi->seek(offset, SEEK_SET);
+            while (len) {
+                unsigned const l = UPX_MIN(len, blocksize);
+                fi->readx(ibuf, l);
+                ft = orig_ft;
+                ph = orig_ph;
+                ph.method = force_method(method);
+                ph.u_len = l;
+                compressWithFilters(&ft, OVERHEAD, NULL_cconf, 10, true);
+                sz += ph.c_len;
+                len -= l;
+            }
+            return sz;
+        };
         for (unsigned k = 0; k < nmethods; ++k) { // FIXME: parallelize; cost: working space
             unsigned sz_this = 0;
             Elf64_Phdr *phdr = phdri;
@@ -4064,27 +4090,13 @@ void PackLinuxElf64::pack1(OutputFile * /*fo*/, Filter &ft)
                             offset  = xct_off;
                             filesz -= xct_off;
                         }
-                        fi->seek(offset, SEEK_SET);
-                        fi->readx(ibuf, filesz);
-                        ft = orig_ft;
-                        ph = orig_ph;
-                        ph.method = force_method(methods[k]);
-                        ph.u_len = filesz;
-                        compressWithFilters(&ft, OVERHEAD, NULL_cconf, 10, true);
-                        sz_this += ph.c_len;
+                        sz_this += trial_size(offset, filesz, methods[k]);
                     }
                 }
             }
             unsigned const sz_tail = file_size - max_offset;  // debuginfo, etc.
             if (sz_tail) {
-                fi->seek(max_offset, SEEK_SET);
-                fi->readx(ibuf, sz_tail);
-                ft = orig_ft;
-                ph = orig_ph;
-                ph.method = force_method(methods[k]);
-                ph.u_len = sz_tail;
-                compressWithFilters(&ft, OVERHEAD, NULL_cconf, 10, true);
-                sz_this += ph.c_len;
+                sz_this += trial_size(max_offset, sz_tail, methods[k]);
             }
             // FIXME: loader size also depends on method
             if (sz_best > sz_this) {
@@ -5570,7 +5582,7 @@ void PackLinuxElf64::unpack(OutputFile *fo)
         throwCompressedDataViolation();
     }
 
-    if (is_shlib) {
+    if (is_shlib && (fo || !opt->fast_test)) { // "--fast-test" skips the rebuild
         un_DT_INIT(old_dtinit, (Elf64_Phdr *)(1+ (Elf64_Ehdr *)(void *)o_elfhdrs), dynhdr, fo);
     }
 
@@ -6676,7 +6688,7 @@ void PackLinuxElf32::unpack(OutputFile *fo)
         throwCompressedDataViolation();
     }
 
-    if (is_shlib) {
+    if (is_shlib && (fo || !opt->fast_test)) { // "--fast-test" skips the rebuild
         // DT_INIT must be restored.
         // If android_shlib, then the asl_delta relocations must be un-done.
         int n_ptload = 0;
@@ -1568,6 +1568,8 @@ void PackMachBase<T>::unpack(OutputFile *fo)
     }
     Mach_segment_command const *sc = (Mach_segment_command const *)(void *)(1+ mhdr);
     if (my_filetype==Mach_header::MH_DYLIB) { // rest of lc_seg are not compressed
+        if (!fo && opt->fast_test)
+            return;  // "--fast-test": nothing left to decompress
         upx_uint64_t cpr_mod_init_func(0);
                 TE32 unc_mod_init_func; *(int *)&unc_mod_init_func = 0;
         Mach_segment_command const *rc = rawmseg;
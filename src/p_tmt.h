@@ -56,8 +56,7 @@ public:
 protected:
     int readFileHeader();
 
-    virtual unsigned findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range = 0,
-                                         unsigned upper_limit = ~0u) const override;
+    virtual unsigned alignOverlapOverhead(unsigned overlap_overhead) const override;
     virtual void buildLoader(const Filter *ft) override;
     virtual Linker *newLinker() const override;
 
@@ -37,6 +37,10 @@
 #include "packer.h"
 #include "p_unix.h"
 #include "p_elf.h"
+#include "ui.h"
+#include "util/stats.h"
+#include "util/thread_pool.h"
+#include <memory>
 
 // do not change
 #define BLOCKSIZE       (512*1024)
@@ -253,6 +257,7 @@ off_t PackUnix::pack3(OutputFile *fo, Filter &ft)
         // If no filter, then linker is not constructed by side effect
         // of packExtent calling compressWithFilters.
         // This is typical after "/usr/bin/patchelf --set-rpath".
+        PhaseTimer timer(STATS_LOADER);
         buildLoader(&ft);
     }
     upx_byte *p = getLoader();
@@ -317,6 +322,20 @@ void PackUnix::pack(OutputFile *fo)
 }
 
 
+namespace {
+// one block of PackUnix::packExtent() that gets compressed by a worker thread
+struct ExtentBlock {
+    explicit ExtentBlock(const PackHeader &ph_) : ph(ph_) {}
+    MemBuffer ibuf;
+    MemBuffer obuf;
+    MemBuffer vbuf;  // scratch buffer for verifyOverlappingDecompression()
+    unsigned u_len = 0;
+    unsigned compress_c_len = 0;  // c_len as returned by compress()
+    bool compressed = false;  // return value of compress()
+    PackHeader ph;
+};
+} // namespace
+
 void PackUnix::packExtent(
     const Extent &x,
     Filter *ft,
@@ -336,58 +355,9 @@ void PackUnix::packExtent(
         (void)l;
     }
     fi->seek(x.offset, SEEK_SET);
-    for (off_t rest = x.size; 0 != rest; ) {
-        int const filter_strategy = ft ? getStrategy(*ft) : 0;
-        int l = fi->readx(ibuf, UPX_MIN(rest, (off_t)blocksize));
-        if (l == 0) {
-            break;
-        }
-        rest -= l;
-
-        // Note: compression for a block can fail if the
-        //       file is e.g. blocksize + 1 bytes long
-
-        // compress
-        ph.c_len = ph.u_len = l;
-        ph.overlap_overhead = 0;
-        unsigned end_u_adler = 0;
-        if (ft) {
-            // compressWithFilters() updates u_adler _inside_ compress();
-            // that is, AFTER filtering.  We want BEFORE filtering,
-            // so that decompression checks the end-to-end checksum.
-            end_u_adler = upx_adler32(ibuf, ph.u_len, ph.u_adler);
-            ft->buf_len = l;
-
-                // compressWithFilters() requirements?
-            ph.filter = 0;
-            ph.filter_cto = 0;
-            ft->id = 0;
-            ft->cto = 0;
-
-            compressWithFilters(ft, OVERHEAD, NULL_cconf, filter_strategy,
-                                0, 0, 0, hdr_ibuf, hdr_u_len, inhibit_compression_check);
-        }
-        else {
-            (void) compress(ibuf, ph.u_len, obuf);    // ignore return value
-        }
-
-        if (ph.c_len < ph.u_len) {
-            const upx_bytep tbuf = nullptr;
-            if (ft == nullptr || ft->id == 0) tbuf = ibuf;
-            ph.overlap_overhead = OVERHEAD;
-            if (!testOverlappingDecompression(obuf, tbuf, ph.overlap_overhead)) {
-                // not in-place compressible
-                ph.c_len = ph.u_len;
-            }
-        }
-        if (ph.c_len >= ph.u_len) {
-            // block is not compressible
-            ph.c_len = ph.u_len;
-            memcpy(obuf, ibuf, ph.c_len);
-            // must update checksum of compressed data
-            ph.c_adler = upx_adler32(ibuf, ph.u_len, ph.c_adler);
-        }
 
+    // write the block in ib/ob; ph describes the compressed block
+    auto write_block = [&](const byte *ib, const byte *ob, unsigned end_u_adler, bool verify) {
         // write block sizes
         b_info tmp;
         if (hdr_u_len) {
@@ -402,8 +372,8 @@ void PackUnix::packExtent(
                 throwInternalError("header compression size increase");
             ph.saved_u_adler = upx_adler32(hdr_ibuf, hdr_u_len, init_u_adler);
             ph.saved_c_adler = upx_adler32(hdr_obuf, hdr_c_len, init_c_adler);
-            ph.u_adler = upx_adler32(ibuf, ph.u_len, ph.saved_u_adler);
-            ph.c_adler = upx_adler32(obuf, ph.c_len, ph.saved_c_adler);
+            ph.u_adler = upx_adler32(ib, ph.u_len, ph.saved_u_adler);
+            ph.c_adler = upx_adler32(ob, ph.c_len, ph.saved_c_adler);
             end_u_adler = ph.u_adler;
             memset(&tmp, 0, sizeof(tmp));
             set_te32(&tmp.sz_unc, hdr_u_len);
@@ -438,20 +408,203 @@ void PackUnix::packExtent(
         }
         // write compressed data
         if (ph.c_len < ph.u_len) {
-            fo->write(obuf, ph.c_len);
+            fo->write(ob, ph.c_len);
             total_out += ph.c_len;
             // Checks ph.u_adler after decompression, after unfiltering
-            verifyOverlappingDecompression(ft);
+            if (verify)
+                verifyOverlappingDecompression(ft);
         }
         else {
-            fo->write(ibuf, ph.u_len);
+            fo->write(ib, ph.u_len);
             total_out += ph.u_len;
         }
 
         total_in += ph.u_len;
+    };
+
+    // Without a filter the blocks are independent of each other, so read
+    // a batch of blocks, compress them concurrently, and then write them
+    // in order. The checksums are chained while writing, so the result
+    // is identical to the serial loop below.
+    ThreadPool *const pool = ThreadPool::getGlobalPool();
+    if (ft == nullptr && x.size > (off_t)blocksize && pool->getNumThreads() > 1
+    &&  obuf.getSize() != 0) {
+        // limit memory usage to --memory-budget, or else to about 1 GiB
+        upx_uint64_t const mem_limit = opt->o_unix.memory_budget
+            ? (upx_uint64_t)opt->o_unix.memory_budget << 20 : 1024 * 1024 * 1024;
+        upx_uint64_t const block_mem = 3 * (upx_uint64_t)obuf.getSize();
+        std::unique_ptr<ExtentBlock> blocks[64];
+        unsigned batch = UPX_MIN(pool->getNumThreads(), (unsigned) TABLESIZE(blocks));
+        batch = (unsigned) UPX_MIN((upx_uint64_t)batch, mem_limit / block_mem);
+        if (batch >= 2) {
+            for (off_t rest = x.size; 0 != rest; ) {
+                // read
+                unsigned n = 0;
+                while (n < batch && 0 != rest) {
+                    if (!blocks[n]) {
+                        blocks[n].reset(new ExtentBlock(ph));
+                        ExtentBlock &b = *blocks[n];
+                        b.ibuf.alloc(blocksize);
+                        b.obuf.alloc(obuf.getSize());
+                        b.vbuf.alloc(obuf.getSize());
+                    }
+                    ExtentBlock &b = *blocks[n];
+                    int l = fi->readx(b.ibuf, UPX_MIN(rest, (off_t)blocksize));
+                    if (l == 0) {
+                        rest = 0;
+                        break;
+                    }
+                    rest -= l;
+                    b.u_len = l;
+                    n++;
+                }
+                // compress
+                pool->parallelFor(n, [&](unsigned j) {
+                    ExtentBlock &b = *blocks[j];
+                    b.ph = ph;
+                    b.ph.c_len = b.ph.u_len = b.u_len;
+                    b.ph.overlap_overhead = 0;
+                    b.compressed = compressCached(b.ph, nullptr, b.ibuf, b.u_len, b.obuf,
+                                                  NULL_cconf);
+                    b.compress_c_len = b.ph.c_len;
+                    if (b.ph.c_len < b.ph.u_len) {
+                        b.ph.overlap_overhead = OVERHEAD;
+                        if (!ph_testOverlappingDecompression(b.ph, b.obuf, b.ibuf, OVERHEAD)) {
+                            // not in-place compressible
+                            b.ph.c_len = b.ph.u_len;
+                        }
+                    }
+                    if (b.ph.c_len < b.ph.u_len) {
+                        // verify on a copy, as b.obuf still needs to be written
+                        memcpy(b.vbuf, b.obuf, b.ph.c_len);
+                        ph_verifyOverlappingDecompression(b.ph, b.vbuf, b.vbuf.getSize(), nullptr);
+                    }
+                });
+                // write
+                for (unsigned j = 0; j < n; j++) {
+                    ExtentBlock &b = *blocks[j];
+                    if (uip->ui_pass >= 0)  // see compress()
+                        uip->ui_pass++;
+                    // replay the checksum updates of compress()
+                    unsigned const u_adler = ph.u_adler;
+                    unsigned const c_adler = ph.c_adler;
+                    ph = b.ph;
+                    ph.saved_u_adler = u_adler;
+                    ph.saved_c_adler = c_adler;
+                    ph.u_adler = upx_adler32(b.ibuf, ph.u_len, u_adler);
+                    ph.c_adler = c_adler;
+                    if (b.compressed)
+                        ph.c_adler = upx_adler32(b.obuf, b.compress_c_len, c_adler);
+                    if (ph.c_len >= ph.u_len) {
+                        // block is not compressible
+                        ph.c_len = ph.u_len;
+                        // must update checksum of compressed data
+                        ph.c_adler = upx_adler32(b.ibuf, ph.u_len, ph.c_adler);
+                        write_block(b.ibuf, b.ibuf, 0, false);
+                    }
+                    else
+                        write_block(b.ibuf, b.obuf, 0, false);
+                }
+            }
+            return;
+        }
+    }
+
+    for (off_t rest = x.size; 0 != rest; ) {
+        int const filter_strategy = ft ? getStrategy(*ft) : 0;
+        int l = fi->readx(ibuf, UPX_MIN(rest, (off_t)blocksize));
+        if (l == 0) {
+            break;
+        }
+        rest -= l;
+
+        // Note: compression for a block can fail if the
+        //       file is e.g. blocksize + 1 bytes long
+
+        // compress
+        ph.c_len = ph.u_len = l;
+        ph.overlap_overhead = 0;
+        unsigned end_u_adler = 0;
+        if (ft) {
+            // compressWithFilters() updates u_adler _inside_ compress();
+            // that is, AFTER filtering.  We want BEFORE filtering,
+            // so that decompression checks the end-to-end checksum.
+            end_u_adler = upx_adler32(ibuf, ph.u_len, ph.u_adler);
+            ft->buf_len = l;
+
+                // compressWithFilters() requirements?
+            ph.filter = 0;
+            ph.filter_cto = 0;
+            ft->id = 0;
+            ft->cto = 0;
+
+            compressWithFilters(ft, OVERHEAD, NULL_cconf, filter_strategy,
+                                0, 0, 0, hdr_ibuf, hdr_u_len, inhibit_compression_check);
+        }
+        else if (opt->cache_dir) {
+            if (uip->ui_pass >= 0)  // see compress()
+                uip->ui_pass++;
+            (void) compressCached(ph, nullptr, ibuf, ph.u_len, obuf, NULL_cconf);
+        }
+        else {
+            (void) compress(ibuf, ph.u_len, obuf);    // ignore return value
+        }
+
+        if (ph.c_len < ph.u_len) {
+            const upx_bytep tbuf = nullptr;
+            if (ft == nullptr || ft->id == 0) tbuf = ibuf;
+            ph.overlap_overhead = OVERHEAD;
+            if (!testOverlappingDecompression(obuf, tbuf, ph.overlap_overhead)) {
+                // not in-place compressible
+                ph.c_len = ph.u_len;
+            }
+        }
+        if (ph.c_len >= ph.u_len) {
+            // block is not compressible
+            ph.c_len = ph.u_len;
+            memcpy(obuf, ibuf, ph.c_len);
+            // must update checksum of compressed data
+            ph.c_adler = upx_adler32(ibuf, ph.u_len, ph.c_adler);
+        }
+
+        write_block(ibuf, obuf, end_u_adler, true);
     }
 }
 
+// With --memory-budget, large extents are packed as a sequence of
+// smaller b_info blocks instead of one block per extent, which the
+// stubs and unpackExtent() handle already. Per block we need ibuf, obuf
+// and the filtered copy in compressWithFilters(), plus an output and a
+// scratch buffer for each worker thread.
+unsigned PackUnix::getBudgetBlocksize(upx_uint64_t wanted) const
+{
+    upx_uint64_t const limit = ~0u;
+    wanted = UPX_MIN(wanted, limit);
+    if (opt->debug.max_blocksize)  // see "--debug-max-blocksize"
+        wanted = UPX_MIN(wanted, (upx_uint64_t)opt->debug.max_blocksize);
+    if (!opt->o_unix.memory_budget)
+        return (unsigned)wanted;
+    unsigned const nthreads = ThreadPool::getGlobalPool()->getNumThreads();
+    upx_uint64_t bs = ((upx_uint64_t)opt->o_unix.memory_budget << 20) / (3 + 2 * nthreads);
+    bs &= ~(upx_uint64_t)(64 * 1024 - 1);  // keep blocks page-aligned
+    bs = UPX_MAX(bs, (upx_uint64_t)64 * 1024);
+    return (unsigned)UPX_MIN(wanted, bs);
+}
+
+namespace {
+// one b_info block of PackUnix::unpackExtent() that gets decompressed by a worker thread
+struct UnpackBlock {
+    explicit UnpackBlock(const PackHeader &ph_) : ph(ph_) {}
+    MemBuffer cbuf;
+    MemBuffer ubuf;
+    int sz_unc = 0;
+    int sz_cpr = 0;
+    unsigned ftid = 0;  // filter to undo after decompression, or 0
+    unsigned cto = 0;
+    PackHeader ph;
+};
+} // namespace
+
 // Consumes b_info header block and sz_cpr data block from input file 'fi'.
 // De-compresses; appends to output file 'fo' unless rewrite or peeking.
 // For "peeking" without writing: set (fo = nullptr), (is_rewrite = -1)
@@ -463,6 +616,92 @@ unsigned PackUnix::unpackExtent(unsigned wanted, OutputFile *fo,
 )
 {
     b_info hdr; memset(&hdr, 0, sizeof(hdr));
+
+    // When an extent consists of several blocks (see --blocksize and
+    // --memory-budget) then read a batch of b_info headers and their data,
+    // decompress and unfilter the blocks concurrently, and then chain the
+    // checksums and write the blocks in order.
+    ThreadPool *const pool = ThreadPool::getGlobalPool();
+    if (is_rewrite == 0 && wanted > blocksize && pool->getNumThreads() > 1) {
+        upx_uint64_t const mem_limit = opt->o_unix.memory_budget
+            ? (upx_uint64_t)opt->o_unix.memory_budget << 20 : 1024 * 1024 * 1024;
+        upx_uint64_t const block_mem = 2 * (upx_uint64_t)blocksize;
+        std::unique_ptr<UnpackBlock> blocks[64];
+        unsigned batch = UPX_MIN(pool->getNumThreads(), (unsigned) TABLESIZE(blocks));
+        batch = (unsigned) UPX_MIN((upx_uint64_t)batch, mem_limit / block_mem);
+        while (batch >= 2 && wanted) {
+            // index and read
+            unsigned n = 0;
+            unsigned batch_unc = 0;
+            while (n < batch && batch_unc < wanted) {
+                fi->readx(&hdr, szb_info);
+                int const sz_unc = get_te32(&hdr.sz_unc);
+                int const sz_cpr = get_te32(&hdr.sz_cpr);
+                if (sz_unc <= 0 || sz_cpr <= 0)
+                    throwCantUnpack("corrupt b_info");
+                if (sz_cpr > sz_unc || sz_unc > (int)blocksize)
+                    throwCantUnpack("corrupt b_info");
+                if (wanted - batch_unc < (unsigned)sz_unc) // mismatched end-of-block
+                    throwCantUnpack("corrupt b_info");
+                if (!blocks[n]) {
+                    blocks[n].reset(new UnpackBlock(ph));
+                    blocks[n]->cbuf.alloc(blocksize);
+                    blocks[n]->ubuf.alloc(blocksize);
+                }
+                UnpackBlock &b = *blocks[n];
+                b.sz_unc = sz_unc;
+                b.sz_cpr = sz_cpr;
+                b.ftid = 0;
+                b.cto = hdr.b_cto8;
+                if (sz_cpr < sz_unc) { // same choice of filter as the serial loop below
+                    if (12==szb_info) // modern per-block filter
+                        b.ftid = hdr.b_ftid;
+                    else if (first_PF_X) // ancient per-file filter
+                        first_PF_X = false;
+                    else
+                        b.ftid = ph.filter;
+                }
+                fi->readx(b.cbuf, sz_cpr);
+                total_in += sz_cpr;
+                batch_unc += sz_unc;
+                n++;
+            }
+            // decompress and unfilter
+            pool->parallelFor(n, [&](unsigned j) {
+                UnpackBlock &b = *blocks[j];
+                if (b.sz_cpr == b.sz_unc)
+                    return; // literal block
+                b.ph = ph;
+                b.ph.u_len = b.sz_unc;
+                b.ph.c_len = b.sz_cpr;
+                ph_decompress(b.ph, b.cbuf, b.ubuf, false, nullptr);
+                if (b.ftid) {
+                    Filter ft(ph.level);
+                    ft.init(b.ftid, 0);
+                    ft.cto = (unsigned char) b.cto;
+                    ft.unfilter(b.ubuf, b.sz_unc);
+                }
+            });
+            // update checksums and write
+            for (unsigned j = 0; j < n; j++) {
+                UnpackBlock &b = *blocks[j];
+                MemBuffer &data = (b.sz_cpr == b.sz_unc) ? b.cbuf : b.ubuf;
+                c_adler = upx_adler32(b.cbuf, b.sz_cpr, c_adler);
+                u_adler = upx_adler32(data, b.sz_unc, u_adler);
+                if (fo) {
+                    fo->write(data, b.sz_unc);
+                    total_out += b.sz_unc;
+                }
+                ph.u_len = b.sz_unc;
+                ph.c_len = b.sz_cpr;
+                ph.filter_cto = b.cto;
+            }
+            wanted -= batch_unc;
+        }
+        if (batch >= 2)
+            return 0;
+    }
+
     unsigned inlen = 0; // output index (if-and-only-if peeking)
     while (wanted) {
         fi->readx(&hdr, szb_info);
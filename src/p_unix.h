@@ -85,6 +85,8 @@ protected:
         bool first_PF_X, unsigned szb_info,
         int is_rewrite = false  // 0(false): write; 1(true): rewrite; -1: no write
         );
+    // largest blocksize <= wanted whose buffers fit into --memory-budget
+    unsigned getBudgetBlocksize(upx_uint64_t wanted) const;
     unsigned total_in, total_out;  // unpack
 
     int exetype;
@@ -155,9 +155,8 @@ static int is_pow2(unsigned const x)
 int PackVmlinuzI386::decompressKernel()
 {
     // read whole kernel image
-    obuf.alloc(file_size);
     fi->seek(0, SEEK_SET);
-    fi->readx(obuf, file_size);
+    fi->readxMapped(obuf, file_size);
 
     {
     const upx_byte *base = nullptr;
@@ -756,9 +755,8 @@ int PackVmlinuzARMEL::readFileHeader()
 int PackVmlinuzARMEL::decompressKernel()
 {
     // read whole kernel image
-    obuf.alloc(file_size);
     fi->seek(0, SEEK_SET);
-    fi->readx(obuf, file_size);
+    fi->readxMapped(obuf, file_size);
 
     //checkAlreadyPacked(obuf + setup_size, UPX_MIN(file_size - setup_size, 1024LL));
 
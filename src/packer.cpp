@@ -26,11 +26,17 @@
  */
 
 #include "conf.h"
+#include <algorithm>
+#include <memory>
 #include "file.h"
 #include "packer.h"
 #include "filter.h"
 #include "linker.h"
 #include "ui.h"
+#include "util/compress_cache.h"
+#include "util/compress_hints.h"
+#include "util/stats.h"
+#include "util/thread_pool.h"
 
 /*************************************************************************
 //
@@ -182,19 +188,39 @@ int forced_method(int method) // extract the forced method
 
 bool Packer::compress(SPAN_P(byte) i_ptr, unsigned i_len, SPAN_P(byte) o_ptr,
                       const upx_compress_config_t *cconf_parm) {
-    ph.u_len = i_len;
-    ph.c_len = 0;
-    assert(ph.level >= 1);
-    assert(ph.level <= 10);
-
     // Avoid too many progress bar updates. 64 is s->bar_len in ui.cpp.
-    unsigned step = (ph.u_len < 64 * 1024) ? 0 : ph.u_len / 64;
+    unsigned step = (i_len < 64 * 1024) ? 0 : i_len / 64;
+#if (WITH_NRV)
+    int method = forced_method(ph.method);
+    if (M_IS_NRV2B(method) || M_IS_NRV2D(method) || M_IS_NRV2E(method)) {
+        if (ph.level >= 7 || (ph.level >= 4 && i_len >= 512 * 1024))
+            step = 0;
+    }
+#endif
+    if (uip->ui_pass >= 0)
+        uip->ui_pass++;
+    uip->startCallback(i_len, step, uip->ui_pass, uip->ui_total_passes);
+    uip->firstCallback();
+
+    bool ok = compress(ph, uip->getCallback(), i_ptr, i_len, o_ptr, cconf_parm);
+
+    // uip->finalCallback(ph.u_len, ph.c_len);
+    uip->endCallback();
+    return ok;
+}
+
+bool Packer::compress(PackHeader &xph, upx_callback_p cb, SPAN_P(byte) i_ptr, unsigned i_len,
+                      SPAN_P(byte) o_ptr, const upx_compress_config_t *cconf_parm) const {
+    xph.u_len = i_len;
+    xph.c_len = 0;
+    assert(xph.level >= 1);
+    assert(xph.level <= 10);
 
     // save current checksums
-    ph.saved_u_adler = ph.u_adler;
-    ph.saved_c_adler = ph.c_adler;
+    xph.saved_u_adler = xph.u_adler;
+    xph.saved_c_adler = xph.c_adler;
     // update checksum of uncompressed data
-    ph.u_adler = upx_adler32(raw_bytes(i_ptr, ph.u_len), ph.u_len, ph.u_adler);
+    xph.u_adler = upx_adler32(raw_bytes(i_ptr, xph.u_len), xph.u_len, xph.u_adler);
 
     // set compression parameters
     upx_compress_config_t cconf;
@@ -202,7 +228,7 @@ bool Packer::compress(SPAN_P(byte) i_ptr, unsigned i_len, SPAN_P(byte) o_ptr,
     if (cconf_parm)
         cconf = *cconf_parm;
     // cconf options
-    int method = forced_method(ph.method);
+    int method = forced_method(xph.method);
     if (M_IS_NRV2B(method) || M_IS_NRV2D(method) || M_IS_NRV2E(method)) {
         if (opt->crp.crp_ucl.c_flags != -1)
             cconf.conf_ucl.c_flags = opt->crp.crp_ucl.c_flags;
@@ -216,10 +242,6 @@ bool Packer::compress(SPAN_P(byte) i_ptr, unsigned i_len, SPAN_P(byte) o_ptr,
         if (opt->crp.crp_ucl.max_match != UINT_MAX &&
             opt->crp.crp_ucl.max_match < cconf.conf_ucl.max_match)
             cconf.conf_ucl.max_match = opt->crp.crp_ucl.max_match;
-#if (WITH_NRV)
-        if (ph.level >= 7 || (ph.level >= 4 && ph.u_len >= 512 * 1024))
-            step = 0;
-#endif
     }
     if (M_IS_LZMA(method)) {
         oassign(cconf.conf_lzma.pos_bits, opt->crp.crp_lzma.pos_bits);
@@ -233,67 +255,71 @@ bool Packer::compress(SPAN_P(byte) i_ptr, unsigned i_len, SPAN_P(byte) o_ptr,
         oassign(cconf.conf_zlib.window_bits, opt->crp.crp_zlib.window_bits);
         oassign(cconf.conf_zlib.strategy, opt->crp.crp_zlib.strategy);
     }
-    if (uip->ui_pass >= 0)
-        uip->ui_pass++;
-    uip->startCallback(ph.u_len, step, uip->ui_pass, uip->ui_total_passes);
-    uip->firstCallback();
+    if (M_IS_ZSTD(method)) {
+        oassign(cconf.conf_zstd.window_log, opt->crp.crp_zstd.window_log);
+        oassign(cconf.conf_zstd.strategy, opt->crp.crp_zstd.strategy);
+        oassign(cconf.conf_zstd.long_distance, opt->crp.crp_zstd.long_distance);
+        oassign(cconf.conf_zstd.num_workers, opt->crp.crp_zstd.num_workers);
+    }
 
-    // OutputFile::dump("data.raw", in, ph.u_len);
+    // OutputFile::dump("data.raw", in, xph.u_len);
 
     // compress
-    int r = upx_compress(raw_bytes(i_ptr, ph.u_len), ph.u_len, raw_bytes(o_ptr, 0), &ph.c_len,
-                         uip->getCallback(), method, ph.level, &cconf, &ph.compress_result);
-
-    // uip->finalCallback(ph.u_len, ph.c_len);
-    uip->endCallback();
+    int r = upx_compress(raw_bytes(i_ptr, xph.u_len), xph.u_len, raw_bytes(o_ptr, 0), &xph.c_len,
+                         cb, method, xph.level, &cconf, &xph.compress_result);
 
     if (r == UPX_E_OUT_OF_MEMORY)
         throwOutOfMemoryException();
+    if (r == UPX_E_NOT_COMPRESSIBLE && cconf.max_c_len != 0)
+        return false; // over budget
     if (r != UPX_E_OK)
         throwInternalError("compression failed");
 
     if (M_IS_NRV2B(method) || M_IS_NRV2D(method) || M_IS_NRV2E(method)) {
-        const ucl_uint *res = ph.compress_result.result_ucl.result;
-        // ph.min_offset_found = res[0];
-        ph.max_offset_found = res[1];
-        // ph.min_match_found = res[2];
-        ph.max_match_found = res[3];
-        // ph.min_run_found = res[4];
-        ph.max_run_found = res[5];
-        ph.first_offset_found = res[6];
-        // ph.same_match_offsets_found = res[7];
+        const ucl_uint *res = xph.compress_result.result_ucl.result;
+        // xph.min_offset_found = res[0];
+        xph.max_offset_found = res[1];
+        // xph.min_match_found = res[2];
+        xph.max_match_found = res[3];
+        // xph.min_run_found = res[4];
+        xph.max_run_found = res[5];
+        xph.first_offset_found = res[6];
+        // xph.same_match_offsets_found = res[7];
         if (cconf_parm) {
             assert(cconf.conf_ucl.max_offset == 0 ||
-                   cconf.conf_ucl.max_offset >= ph.max_offset_found);
-            assert(cconf.conf_ucl.max_match == 0 || cconf.conf_ucl.max_match >= ph.max_match_found);
+                   cconf.conf_ucl.max_offset >= xph.max_offset_found);
+            assert(cconf.conf_ucl.max_match == 0 ||
+                   cconf.conf_ucl.max_match >= xph.max_match_found);
         }
     }
 
-    NO_printf("\nPacker::compress: %d/%d: %7d -> %7d\n", method, ph.level, ph.u_len, ph.c_len);
-    if (!checkCompressionRatio(ph.u_len, ph.c_len))
+    NO_printf("\nPacker::compress: %d/%d: %7d -> %7d\n", method, xph.level, xph.u_len,
+              xph.c_len);
+    if (!checkCompressionRatio(xph.u_len, xph.c_len))
         return false;
     // return in any case if not compressible
-    if (ph.c_len >= ph.u_len)
+    if (xph.c_len >= xph.u_len)
         return false;
 
     // update checksum of compressed data
-    ph.c_adler = upx_adler32(raw_bytes(o_ptr, ph.c_len), ph.c_len, ph.c_adler);
+    xph.c_adler = upx_adler32(raw_bytes(o_ptr, xph.c_len), xph.c_len, xph.c_adler);
     // Decompress and verify. Skip this when using the fastest level.
-    if (!ph_skipVerify(ph)) {
+    if (!ph_skipVerify(xph)) {
         // decompress
-        unsigned new_len = ph.u_len;
-        r = upx_decompress(raw_bytes(o_ptr, ph.c_len), ph.c_len, raw_bytes(i_ptr, ph.u_len),
-                           &new_len, method, &ph.compress_result);
+        unsigned new_len = xph.u_len;
+        r = upx_decompress(raw_bytes(o_ptr, xph.c_len), xph.c_len, raw_bytes(i_ptr, xph.u_len),
+                           &new_len, method, &xph.compress_result);
         if (r == UPX_E_OUT_OF_MEMORY)
             throwOutOfMemoryException();
-        // printf("%d %d: %d %d %d\n", method, r, ph.c_len, ph.u_len, new_len);
+        // printf("%d %d: %d %d %d\n", method, r, xph.c_len, xph.u_len, new_len);
         if (r != UPX_E_OK)
             throwInternalError("decompression failed");
-        if (new_len != ph.u_len)
+        if (new_len != xph.u_len)
             throwInternalError("decompression failed (size error)");
 
         // verify decompression
-        if (ph.u_adler != upx_adler32(raw_bytes(i_ptr, ph.u_len), ph.u_len, ph.saved_u_adler))
+        if (xph.u_adler !=
+            upx_adler32(raw_bytes(i_ptr, xph.u_len), xph.u_len, xph.saved_u_adler))
             throwInternalError("decompression failed (checksum error)");
     }
     return true;
@@ -372,8 +398,14 @@ void Packer::decompress(SPAN_P(const byte) in, SPAN_P(byte) out, bool verify_che
 // overlapping decompression
 **************************************************************************/
 
-static bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *buf, const byte *tbuf,
-                                            unsigned overlap_overhead) {
+bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *buf, const byte *tbuf,
+                                     unsigned overlap_overhead) {
+    MemBuffer scratch;
+    return ph_testOverlappingDecompression(ph, buf, tbuf, overlap_overhead, scratch);
+}
+
+bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *buf, const byte *tbuf,
+                                     unsigned overlap_overhead, MemBuffer &scratch) {
     if (ph.c_len >= ph.u_len)
         return false;
 
@@ -393,7 +425,7 @@ static bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *bu
     unsigned src_off = ph.u_len + overlap_overhead - ph.c_len;
     unsigned new_len = ph.u_len;
     int r = upx_test_overlap(buf - src_off, tbuf, src_off, ph.c_len, &new_len,
-                             forced_method(ph.method), &ph.compress_result);
+                             forced_method(ph.method), &ph.compress_result, scratch);
     if (r == UPX_E_OUT_OF_MEMORY)
         throwOutOfMemoryException();
     return (r == UPX_E_OK && new_len == ph.u_len);
@@ -427,12 +459,13 @@ void Packer::verifyOverlappingDecompression(Filter *ft) {
     unsigned offset = (ph.u_len + ph.overlap_overhead) - ph.c_len;
     if (offset + ph.c_len > obuf.getSize())
         return;
+    PhaseTimer timer(STATS_VERIFY, ph.u_len);
     memmove(obuf + offset, obuf, ph.c_len);
     decompress(obuf + offset, obuf, true, ft);
     obuf.checkState();
 }
 
-void Packer::verifyOverlappingDecompression(byte *o_ptr, unsigned o_size, Filter *ft) {
+void ph_verifyOverlappingDecompression(PackHeader &ph, byte *o_ptr, unsigned o_size, Filter *ft) {
     assert(ph.c_len < ph.u_len);
     assert((int) ph.overlap_overhead > 0);
     if (ph_skipVerify(ph))
@@ -440,8 +473,13 @@ void Packer::verifyOverlappingDecompression(byte *o_ptr, unsigned o_size, Filter
     unsigned offset = (ph.u_len + ph.overlap_overhead) - ph.c_len;
     if (offset + ph.c_len > o_size)
         return;
+    PhaseTimer timer(STATS_VERIFY, ph.u_len);
     memmove(o_ptr + offset, o_ptr, ph.c_len);
-    decompress(o_ptr + offset, o_ptr, true, ft);
+    ph_decompress(ph, o_ptr + offset, o_ptr, true, ft);
+}
+
+void Packer::verifyOverlappingDecompression(byte *o_ptr, unsigned o_size, Filter *ft) {
+    ph_verifyOverlappingDecompression(ph, o_ptr, o_size, ft);
 }
 
 /*************************************************************************
@@ -452,11 +490,34 @@ void Packer::verifyOverlappingDecompression(byte *o_ptr, unsigned o_size, Filter
 //   - you can pass the range of an acceptable interval (so that
 //     we can succeed early)
 //   - you can enforce an upper_limit (so that we can fail early)
+//   - if upx_find_overlap() supports the method we start with its single
+//     pass estimate; the binary search then only has to verify it
 **************************************************************************/
 
-unsigned Packer::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range,
-                                     unsigned upper_limit) const {
+// the overhead that matches upx_find_overlap(), or 0 if unknown
+static unsigned ph_estimateOverlapOverhead(const PackHeader &ph, const byte *buf) {
+    if (ph.c_len >= ph.u_len)
+        return 0;
+    unsigned new_len = ph.u_len;
+    unsigned src_off = 0;
+    int r = upx_find_overlap(buf, ph.c_len, &new_len, forced_method(ph.method), &src_off);
+    if (r != UPX_E_OK || new_len != ph.u_len)
+        return 0;
+    // invert the computation of src_off in ph_testOverlappingDecompression()
+    unsigned extra = 0;
+    if (M_IS_NRV2B(ph.method) || M_IS_NRV2D(ph.method) || M_IS_NRV2E(ph.method))
+        extra = 3;
+    upx_uint64_t overhead = (upx_uint64_t) src_off + ph.c_len + extra;
+    if (overhead <= ph.u_len + 4 + extra)
+        return 5 + extra;
+    overhead -= ph.u_len;
+    return overhead < UINT_MAX ? (unsigned) overhead : 0;
+}
+
+static unsigned ph_findOverlapOverhead(const PackHeader &ph, const byte *buf, const byte *tbuf,
+                                       unsigned range, unsigned upper_limit) {
     assert((int) range >= 0);
+    PhaseTimer timer(STATS_OVERLAP, ph.u_len);
 
     // prepare to deal with very pessimistic values
     unsigned low = 1;
@@ -466,13 +527,26 @@ unsigned Packer::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned
     //
     unsigned overhead = 0;
     unsigned nr = 0; // statistics
+    MemBuffer scratch; // shared by all probes, freed when the search is done
+
+    // even better: start with the estimate
+    bool verify = false; // next success: check just below m
+    unsigned gallop = 0; // next failure: search upwards from m
+    bool seeded = false; // only then the early stop on failure is allowed
+    const unsigned estimate = ph_estimateOverlapOverhead(ph, buf);
+    if (estimate >= low && estimate <= high) {
+        m = estimate;
+        verify = true;
+        gallop = 1;
+        seeded = true;
+    }
 
     while (high >= low) {
         assert(m >= low);
         assert(m <= high);
         assert(m < overhead || overhead == 0);
         nr++;
-        bool success = testOverlappingDecompression(buf, tbuf, m);
+        bool success = ph_testOverlappingDecompression(ph, buf, tbuf, m, scratch);
         // printf("testOverlapOverhead(%d): %d %d: %d -> %d\n", nr, low, high, m, (int)success);
         if (success) {
             overhead = m;
@@ -483,8 +557,27 @@ unsigned Packer::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned
             if (m - low < range) // avoid underflow
                 break;
             high = m - 1;
-        } else
+            gallop = 0;
+            if (verify && high >= low) {
+                // the estimate is correct if m - UPX_MAX(range, 1) fails
+                verify = false;
+                m -= UPX_MIN(UPX_MAX(range, 1u), m - low);
+                continue;
+            }
+        } else {
             low = m + 1;
+            verify = false;
+            // without an estimate keep the plain binary search, so that
+            // the result (and the output) does not change
+            if (seeded && overhead != 0 && overhead - low < range)
+                break;
+            if (gallop && high >= low) {
+                // the estimate was too optimistic
+                m = UPX_MIN(m + gallop, high);
+                gallop *= 2;
+                continue;
+            }
+        }
         ////m = (low + high) / 2;
         m = (low & high) + ((low ^ high) >> 1); // avoid overflow
     }
@@ -497,6 +590,12 @@ unsigned Packer::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned
     return overhead;
 }
 
+unsigned Packer::findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range,
+                                     unsigned upper_limit) const {
+    unsigned overhead = ph_findOverlapOverhead(ph, buf, tbuf, range, upper_limit);
+    return alignOverlapOverhead(overhead);
+}
+
 /*************************************************************************
 // file i/o utils
 **************************************************************************/
@@ -951,6 +1050,7 @@ int Packer::getLoaderSectionStart(const char *name, int *slen) const {
 }
 
 void Packer::relocateLoader() {
+    PhaseTimer timer(STATS_LOADER);
     linker->relocate();
 
 #if 0
@@ -983,7 +1083,7 @@ void Packer::relocateLoader() {
 //
 // - updates this->ph
 // - updates *ft
-// - i_ptr[] is restored to the original unfiltered version
+// - i_ptr[] is left as the original unfiltered version
 // - o_ptr[] contains the best compressed version
 //
 // filter_strategy:
@@ -1091,6 +1191,494 @@ done:
     return nfilters;
 }
 
+/*************************************************************************
+// filter pre-selection
+//
+// When looking for the best filter (filter_strategy == 0) every filter
+// would be trial-compressed with every method. Instead score all
+// candidates up front: the 32-bit x86 calltrick filters are all scored
+// from one Filter::getCallStats() pass by the number of calls they would
+// convert; any other filter costs one Filter::scan() pass. Filters that
+// would fail or find no calls are dropped. Only the opt->filter_top_k
+// best candidates (plus the "no filter" fallback) are then passed on to
+// the trial engine, in their original order so that all tie-breaks stay
+// the same.
+**************************************************************************/
+
+int Packer::preselectFilters(int *filters, int nfilters, const byte *f_ptr, unsigned f_len,
+                             const Filter &orig_ft) const {
+    const int top_k = opt->filter_top_k;
+    if (top_k <= 0 || nfilters - 1 <= top_k) // filters[] always ends with the 0 fallback
+        return nfilters;
+    if (f_ptr == nullptr || f_len == 0)
+        return nfilters;
+    assert(filters[nfilters - 1] == 0);
+
+    struct Candidate {
+        int index;
+        int filter_id;
+        unsigned calls;
+    };
+    Candidate cand[256];
+    int ncand = 0;
+    Filter::CallStats st;
+    Filter::getCallStats(f_ptr, f_len, &st);
+    for (int ff = 0; ff < nfilters - 1; ff++) {
+        unsigned calls = 0;
+        if (!Filter::estimateCalls(filters[ff], orig_ft.addvalue, st, &calls)) {
+            Filter ft = orig_ft;
+            ft.init(filters[ff], orig_ft.addvalue);
+            optimizeFilter(&ft, f_ptr, f_len);
+            if (ft.scan(f_ptr, f_len) && ft.calls > ft.wrongcalls)
+                calls = ft.calls - ft.wrongcalls;
+        }
+        if (calls == 0)
+            continue; // would be rejected by compressWithFilters() anyway
+        cand[ncand++] = {ff, filters[ff], calls};
+        NO_printf("preselect: filter 0x%02x calls %u\n", filters[ff], calls);
+    }
+
+    // rank: most calls first, then original order
+    std::sort(cand, cand + ncand, [](const Candidate &a, const Candidate &b) {
+        if (a.calls != b.calls)
+            return a.calls > b.calls;
+        return a.index < b.index;
+    });
+    if (ncand > top_k)
+        ncand = top_k;
+    std::sort(cand, cand + ncand,
+              [](const Candidate &a, const Candidate &b) { return a.index < b.index; });
+    for (int i = 0; i < ncand; i++)
+        filters[i] = cand[i].filter_id;
+    filters[ncand] = 0;
+    return ncand + 1;
+}
+
+/*************************************************************************
+// compression result cache, see option "--cache-dir"
+**************************************************************************/
+
+namespace {
+// a cache entry is this record followed by the compressed data
+struct CachedCompressResult {
+    unsigned i_adler; // of the unfiltered input; guards against key collisions
+    unsigned ok;      // return value of compress()
+    int method;
+    int filter;
+    int filter_cto;
+    int n_mru;
+    unsigned filter_calls;
+    unsigned c_len;
+    unsigned overlap_overhead;
+    unsigned max_offset_found;
+    unsigned max_match_found;
+    unsigned max_run_found;
+    unsigned first_offset_found;
+    upx_compress_result_t compress_result;
+};
+} // namespace
+
+template <class T>
+static inline void cache_key_add_optvar(CacheKeyBuilder &kb, const T &v) {
+    kb.add(v.v);
+    kb.add(v.is_set);
+}
+
+// everything besides the input data that influences the result of compress()
+static void cache_key_init(CacheKeyBuilder &kb, const char *what, int format, int level,
+                           const upx_compress_config_t *cconf) {
+    const unsigned one = 1; // entries are stored in native byte order
+    kb.add(what);
+    kb.add(UPX_VERSION_STRING " " UPX_VERSION_DATE);
+    kb.add(&one, sizeof(one));
+    kb.add(sizeof(CachedCompressResult));
+    kb.add(format);
+    kb.add(level);
+    if (cconf != nullptr) {
+        // field by field, as the padding of a local config is undefined
+        const lzma_compress_config_t &l = cconf->conf_lzma;
+        cache_key_add_optvar(kb, l.pos_bits);
+        cache_key_add_optvar(kb, l.lit_pos_bits);
+        cache_key_add_optvar(kb, l.lit_context_bits);
+        cache_key_add_optvar(kb, l.dict_size);
+        cache_key_add_optvar(kb, l.num_fast_bytes);
+        kb.add(l.fast_mode);
+        kb.add(l.match_finder_cycles);
+        kb.add(l.max_num_probs);
+        kb.add(&cconf->conf_ucl, sizeof(cconf->conf_ucl)); // plain integers
+        cache_key_add_optvar(kb, cconf->conf_zlib.mem_level);
+        cache_key_add_optvar(kb, cconf->conf_zlib.window_bits);
+        cache_key_add_optvar(kb, cconf->conf_zlib.strategy);
+        cache_key_add_optvar(kb, cconf->conf_zstd.window_log);
+        cache_key_add_optvar(kb, cconf->conf_zstd.strategy);
+        cache_key_add_optvar(kb, cconf->conf_zstd.long_distance);
+        cache_key_add_optvar(kb, cconf->conf_zstd.num_workers);
+        kb.add(cconf->max_c_len);
+    }
+    // Options::reset() has cleared the padding of these
+    kb.add(&opt->crp, sizeof(opt->crp));
+}
+
+// on a hit copy the compressed data to o_ptr[]
+static bool cache_load_result(const CacheKey &key, unsigned i_adler, unsigned o_size,
+                              CachedCompressResult &r, byte *o_ptr) {
+    MemBuffer data;
+    if (!cache_load(key, data) || data.getSize() < sizeof(r))
+        return false;
+    memcpy(&r, data.getVoidPtr(), sizeof(r));
+    if (r.i_adler != i_adler || r.c_len == 0 || r.c_len > o_size ||
+        data.getSize() != sizeof(r) + r.c_len)
+        return false;
+    memcpy(o_ptr, raw_bytes(data, sizeof(r) + r.c_len) + sizeof(r), r.c_len);
+    return true;
+}
+
+static void cache_store_result(const CacheKey &key, const CachedCompressResult &r,
+                               const byte *o_ptr) {
+    MemBuffer data(sizeof(r) + r.c_len);
+    memcpy(data, &r, sizeof(r));
+    memcpy(data + sizeof(r), o_ptr, r.c_len);
+    cache_store(key, data, data.getSize());
+}
+
+static void cache_fill_result(CachedCompressResult &r, const PackHeader &xph, unsigned i_adler,
+                              bool ok) {
+    memset(&r, 0, sizeof(r));
+    r.i_adler = i_adler;
+    r.ok = ok ? 1 : 0;
+    r.method = xph.method;
+    r.filter = xph.filter;
+    r.filter_cto = xph.filter_cto;
+    r.n_mru = xph.n_mru;
+    r.c_len = xph.c_len;
+    r.overlap_overhead = xph.overlap_overhead;
+    r.max_offset_found = xph.max_offset_found;
+    r.max_match_found = xph.max_match_found;
+    r.max_run_found = xph.max_run_found;
+    r.first_offset_found = xph.first_offset_found;
+    r.compress_result = xph.compress_result;
+}
+
+// the fields of xph that compress() sets, except for the checksums
+static void cache_apply_result(PackHeader &xph, const CachedCompressResult &r) {
+    xph.c_len = r.c_len;
+    xph.max_offset_found = r.max_offset_found;
+    xph.max_match_found = r.max_match_found;
+    xph.max_run_found = r.max_run_found;
+    xph.first_offset_found = r.first_offset_found;
+    xph.compress_result = r.compress_result;
+}
+
+// The key is no cryptographic hash and the directory may be shared or
+// damaged, so a hit is only used after decompressing it and comparing
+// against the (filtered) input u_ptr[]. If overlap_overhead is given the
+// in-place decompression is checked as well.
+static bool cache_verify_result(const PackHeader &xph, const byte *c_ptr, const byte *u_ptr,
+                                unsigned overlap_overhead) {
+    if (xph.c_len >= xph.u_len || !Packer::isValidCompressionMethod(forced_method(xph.method)))
+        return false;
+    MemBuffer d_buf;
+    d_buf.allocForDecompression(xph.u_len);
+    unsigned d_len = xph.u_len;
+    int r = upx_decompress(c_ptr, xph.c_len, d_buf, &d_len, forced_method(xph.method),
+                           &xph.compress_result);
+    if (r == UPX_E_OUT_OF_MEMORY)
+        throwOutOfMemoryException();
+    if (r != UPX_E_OK || d_len != xph.u_len || memcmp(d_buf, u_ptr, d_len) != 0)
+        return false;
+    if (overlap_overhead != 0 &&
+        !ph_testOverlappingDecompression(xph, c_ptr, u_ptr, overlap_overhead))
+        return false;
+    return true;
+}
+
+static bool contains_id(const int *ids, int n, int id) {
+    for (int i = 0; i < n; i++)
+        if (ids[i] == id)
+            return true;
+    return false;
+}
+
+bool Packer::compressCached(PackHeader &xph, upx_callback_p cb, SPAN_P(byte) i_ptr,
+                            unsigned i_len, SPAN_P(byte) o_ptr,
+                            const upx_compress_config_t *cconf) const {
+    if (opt->cache_dir == nullptr)
+        return compress(xph, cb, i_ptr, i_len, o_ptr, cconf);
+    const byte *const ip = raw_bytes(i_ptr, i_len);
+    byte *const op = raw_bytes(o_ptr, 0);
+    CacheKeyBuilder kb;
+    cache_key_init(kb, "compress", getFormat(), xph.level, cconf);
+    kb.add(xph.method);
+    kb.add(ip, i_len);
+    const CacheKey key = kb.get();
+    const unsigned i_adler = upx_adler32(ip, i_len);
+
+    CachedCompressResult r;
+    bool hit = cache_load_result(key, i_adler, MemBuffer::getSizeForCompression(i_len), r, op);
+    if (hit && r.ok) {
+        PackHeader tph = xph;
+        cache_apply_result(tph, r);
+        tph.u_len = i_len;
+        hit = cache_verify_result(tph, op, ip, 0);
+        if (!hit)
+            cache_remove(key);
+    }
+    if (hit) {
+        // replay compress()
+        cache_apply_result(xph, r);
+        xph.u_len = i_len;
+        xph.saved_u_adler = xph.u_adler;
+        xph.saved_c_adler = xph.c_adler;
+        xph.u_adler = upx_adler32(ip, i_len, xph.u_adler);
+        if (r.ok)
+            xph.c_adler = upx_adler32(op, xph.c_len, xph.c_adler);
+        return r.ok != 0;
+    }
+    const bool ok = compress(xph, cb, i_ptr, i_len, o_ptr, cconf);
+    cache_fill_result(r, xph, i_adler, ok);
+    cache_store_result(key, r, op);
+    return ok;
+}
+
+/*************************************************************************
+// method/filter hints, see option "--hints-file"
+//
+// Successive versions of a file nearly always end up with the same
+// method and filter, so first try only that combination, and do the
+// full search only if its compression ratio is clearly worse than last
+// time. Note that the LZMA pb/lp/lc parameters are part of the method,
+// and that the filter cto is derived from the data by the filter.
+**************************************************************************/
+
+// more than 0.5% of u_len worse than last time
+static bool hint_has_regressed(const CompressHint &hint, unsigned u_len, unsigned c_len) {
+    return double(c_len) / u_len > double(hint.c_len) / hint.u_len + 0.005;
+}
+
+/*************************************************************************
+// compressWithFilters() trial engine
+//
+// Every method/filter combination is an independent trial: filter the
+// input out-of-place into a private buffer, compress it and
+// speculatively find the overlap_overhead. This expensive part runs on
+// the ThreadPool. Afterwards the results are replayed in the original
+// serial order, so that buildLoader() and the choice of the best trial
+// (including all tie-breaks) are exactly the same as in the serial loop
+// of compressWithFilters() below, and the output is byte-identical.
+**************************************************************************/
+
+struct Packer::CompressTrial final {
+    CompressTrial(const PackHeader &ph_, const Filter &ft_) : ph(ph_), ft(ft_) {}
+    PackHeader ph;
+    Filter ft; // filter state after filtering
+    unsigned hdr_c_len = 0;
+    bool filtered = false;         // filter was successful
+    bool compressed = false;       // compress() was successful
+    unsigned overlap_overhead = 0; // before alignOverlapOverhead(); 0 if not computed
+    MemBuffer ibuf;                // private copy of the input
+    MemBuffer obuf;                // private compressed output
+};
+
+// compare a trial against the best one so far; see compressWithFilters()
+static bool is_better_trial(unsigned c_len, unsigned lsize, unsigned hdr_c_len,
+                            unsigned overlap_overhead, unsigned best_c_len, unsigned best_lsize,
+                            unsigned best_hdr_c_len, unsigned best_overlap_overhead) {
+    if (c_len + lsize + hdr_c_len < best_c_len + best_lsize + best_hdr_c_len)
+        return true;
+    if (c_len + lsize + hdr_c_len == best_c_len + best_lsize + best_hdr_c_len) {
+        // prefer smaller loaders
+        if (lsize + hdr_c_len < best_lsize + best_hdr_c_len)
+            return true;
+        if (lsize + hdr_c_len == best_lsize + best_hdr_c_len) {
+            // prefer less overlap_overhead
+            if (overlap_overhead < best_overlap_overhead)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Output beyond best_total - hdr_c_len can never win in is_better_trial(),
+// so let the compressor give up as soon as it gets there.
+static void set_trial_budget(upx_compress_config_t &trial_cconf, unsigned best_total,
+                             unsigned hdr_c_len) {
+    trial_cconf.max_c_len = (best_total > hdr_c_len) ? best_total - hdr_c_len : 0;
+}
+
+bool Packer::compressWithFiltersParallel(byte *i_ptr, const unsigned i_len, byte *const o_ptr,
+                                         byte *f_ptr, const unsigned f_len, byte *const hdr_ptr,
+                                         const unsigned hdr_len, const Filter &orig_ft,
+                                         const unsigned overlap_range,
+                                         upx_compress_config_t const *const cconf,
+                                         const int filter_strategy, const int *methods,
+                                         const int nmethods, const int *filters,
+                                         const int nfilters, PackHeader &best_ph,
+                                         unsigned &best_ph_lsize, Filter &best_ft,
+                                         int &nfilters_success_total) {
+    ThreadPool *const pool = ThreadPool::getGlobalPool();
+    const int ntrials = (filter_strategy < 0) ? nmethods : nmethods * nfilters;
+    if (pool->getNumThreads() <= 1 || ntrials <= 1)
+        return false;
+    // Each running trial needs about 2 * i_len bytes, so limit the number
+    // of concurrent trials (and thereby memory usage) accordingly: to
+    // --memory-budget, or else to about 1 GiB, shared by all files that
+    // are packed at the same time.
+    const upx_uint64_t trial_mem = 2 * (upx_uint64_t) i_len + 65536;
+    upx_uint64_t trial_mem_budget = opt->o_unix.memory_budget
+                                        ? (upx_uint64_t) opt->o_unix.memory_budget << 20
+                                        : 1024 * 1024 * 1024;
+    trial_mem_budget /= UPX_MAX(opt->concurrent_files, 1u);
+    unsigned batch = pool->getNumThreads();
+    if (batch > trial_mem_budget / trial_mem)
+        batch = (unsigned) (trial_mem_budget / trial_mem);
+    if (batch > (unsigned) ntrials)
+        batch = ntrials;
+    if (batch <= 1)
+        return false;
+
+    const PackHeader orig_ph = this->ph;
+    const unsigned f_off = ptr_udiff_bytes(f_ptr, i_ptr);
+
+    // compressed header size for each method
+    unsigned hdr_c_lens[256];
+    if (hdr_ptr != nullptr && hdr_len) {
+        MemBuffer hdr_tmp;
+        hdr_tmp.allocForCompression(hdr_len);
+        for (int mm = 0; mm < nmethods; mm++) {
+            unsigned hdr_c_len = 0;
+            int r = upx_compress(hdr_ptr, hdr_len, hdr_tmp, &hdr_c_len, nullptr, methods[mm], 10,
+                                 nullptr, nullptr);
+            if (r != UPX_E_OK)
+                throwInternalError("header compression failed");
+            if (hdr_c_len >= hdr_len)
+                throwInternalError("header compression size increase");
+            hdr_c_lens[mm] = hdr_c_len;
+        }
+    } else
+        memset(hdr_c_lens, 0, sizeof(hdr_c_lens));
+
+    // When only the first working filter is used then it is the same one
+    // for all methods, so find it here and only run one trial per method.
+    int first_ff = -1;
+    if (filter_strategy < 0) {
+        MemBuffer f_tmp(f_len);
+        for (int ff = 0; ff < nfilters && first_ff < 0; ff++) {
+            Filter ft = orig_ft;
+            ft.init(filters[ff], orig_ft.addvalue);
+            optimizeFilter(&ft, f_ptr, f_len);
+            bool success = ft.filter(f_ptr, f_tmp, f_len);
+            if (ft.id != 0 && ft.calls == 0) {
+                // filter did not do anything
+                success = false;
+            }
+            if (success)
+                first_ff = ff;
+        }
+        assert(first_ff >= 0);
+    }
+
+    unsigned best_hdr_c_len = 0;
+    std::unique_ptr<CompressTrial> trials[64];
+    batch = UPX_MIN(batch, (unsigned) TABLESIZE(trials));
+
+    for (int k0 = 0; k0 < ntrials; k0 += batch) {
+        const unsigned n = UPX_MIN(batch, (unsigned) (ntrials - k0));
+        // setup trials
+        for (unsigned j = 0; j < n; j++) {
+            const int k = k0 + j;
+            const int mm = (filter_strategy < 0) ? k : k / nfilters;
+            const int ff = (filter_strategy < 0) ? first_ff : k % nfilters;
+            assert(isValidCompressionMethod(methods[mm]));
+            assert(isValidFilter(filters[ff]));
+            trials[j].reset(new CompressTrial(orig_ph, orig_ft));
+            CompressTrial &t = *trials[j];
+            t.ph.method = methods[mm];
+            t.ph.filter = filters[ff];
+            t.ph.overlap_overhead = 0;
+            t.ft.init(t.ph.filter, orig_ft.addvalue);
+            t.hdr_c_len = hdr_c_lens[mm];
+        }
+        // the best result can only get better, so trials that are already
+        // too big at this point do not need findOverlapOverhead()
+        const unsigned best_total = best_ph.c_len + best_ph_lsize + best_hdr_c_len;
+
+        // run trials
+        pool->parallelFor(n, [&](unsigned j) {
+            CompressTrial &t = *trials[j];
+            t.ibuf.alloc(i_len);
+            // copy the unfiltered parts, and filter f_ptr[] out-of-place
+            memcpy(t.ibuf, i_ptr, f_off);
+            memcpy(t.ibuf + f_off + f_len, i_ptr + f_off + f_len, i_len - f_off - f_len);
+            optimizeFilter(&t.ft, f_ptr, f_len);
+            bool success = t.ft.filter(f_ptr, t.ibuf + f_off, f_len);
+            if (t.ft.id != 0 && t.ft.calls == 0)
+                success = false;
+            if (!success) {
+                t.ibuf.dealloc();
+                return;
+            }
+            t.filtered = true;
+            t.ph.filter_cto = t.ft.cto;
+            t.ph.n_mru = t.ft.n_mru;
+            t.obuf.allocForCompression(i_len);
+            upx_compress_config_t trial_cconf;
+            trial_cconf.reset();
+            if (cconf != nullptr)
+                trial_cconf = *cconf;
+            set_trial_budget(trial_cconf, best_total, t.hdr_c_len);
+            t.compressed = compress(t.ph, nullptr, t.ibuf, i_len, t.obuf, &trial_cconf);
+            if (t.compressed && t.ph.c_len + t.hdr_c_len <= best_total)
+                t.overlap_overhead =
+                    ph_findOverlapOverhead(t.ph, t.obuf, t.ibuf, overlap_range, ~0u);
+            t.ibuf.dealloc();
+        });
+
+        // replay results in serial order
+        for (unsigned j = 0; j < n; j++) {
+            CompressTrial &t = *trials[j];
+            if (!t.filtered) {
+                // filter failed or was useless
+                if (filter_strategy >= 0) {
+                    // adjust ui passes
+                    if (uip->ui_pass >= 0)
+                        uip->ui_pass++;
+                }
+                continue;
+            }
+            nfilters_success_total++;
+            if (uip->ui_pass >= 0) // see compress()
+                uip->ui_pass++;
+            if (!t.compressed)
+                continue;
+            ph = t.ph;
+            t.ft.buf = f_ptr;
+            unsigned lsize = 0;
+            if (ph.c_len + lsize + t.hdr_c_len <= best_ph.c_len + best_ph_lsize + best_hdr_c_len) {
+                assert(t.overlap_overhead > 0);
+                ph.overlap_overhead = alignOverlapOverhead(t.overlap_overhead);
+                PhaseTimer timer(STATS_LOADER);
+                buildLoader(&t.ft);
+                lsize = getLoaderSize();
+                assert(lsize > 0);
+            }
+            if (is_better_trial(ph.c_len, lsize, t.hdr_c_len, ph.overlap_overhead, best_ph.c_len,
+                                best_ph_lsize, best_hdr_c_len, best_ph.overlap_overhead)) {
+                assert((int) ph.overlap_overhead > 0);
+                // update o_ptr[] with best version
+                memcpy(o_ptr, t.obuf, ph.c_len);
+                // save compression results
+                best_ph = ph;
+                best_ph_lsize = lsize;
+                best_hdr_c_len = t.hdr_c_len;
+                best_ft = t.ft;
+            }
+        }
+        for (unsigned j = 0; j < n; j++)
+            trials[j].reset();
+    }
+    return true;
+}
+
 void Packer::compressWithFilters(byte *i_ptr,
                                  const unsigned i_len, // written and restored by filters
                                  byte *const o_ptr,    // where to put compressed output
@@ -1117,6 +1705,7 @@ void Packer::compressWithFilters(byte *i_ptr,
     // preconditions
     assert(orig_ph.filter == 0);
     assert(orig_ft.id == 0);
+    const unsigned call_index = compress_with_filters_calls++;
 
     // prepare methods and filters
     int methods[256];
@@ -1127,6 +1716,8 @@ void Packer::compressWithFilters(byte *i_ptr,
     int nfilters = prepareFilters(filters, filter_strategy, getFilters());
     assert(nfilters > 0);
     assert(nfilters < 256);
+    if (filter_strategy == 0)
+        nfilters = preselectFilters(filters, nfilters, f_ptr, f_len, orig_ft);
 #if 0
     printf("compressWithFilters: m(%d):", nmethods);
     for (int i = 0; i < nmethods; i++)
@@ -1137,140 +1728,351 @@ void Packer::compressWithFilters(byte *i_ptr,
     printf("\n");
 #endif
 
-    // update total_passes; previous (ui_total_passes > 0) means incremental
-    if (!is_forced_method(ph.method)) {
-        if (uip->ui_total_passes > 0)
-            uip->ui_total_passes -= 1;
-        if (filter_strategy < 0)
-            uip->ui_total_passes += nmethods;
-        else
-            uip->ui_total_passes += nfilters * nmethods;
+    // --cache-dir: reuse the result of an earlier run with the same input
+    CacheKey cache_key = {};
+    unsigned cache_i_adler = 0;
+    bool cache_hit = false;
+    if (opt->cache_dir != nullptr) {
+        CacheKeyBuilder kb;
+        cache_key_init(kb, "compressWithFilters", getFormat(), ph.level, cconf);
+        kb.add(ph.method);
+        kb.add(methods, sizeof(methods[0]) * nmethods);
+        kb.add(filters, sizeof(filters[0]) * nfilters);
+        kb.add(filter_strategy);
+        kb.add(overlap_range);
+        kb.add(ptr_udiff_bytes(f_ptr, i_ptr));
+        kb.add(f_len);
+        kb.add(orig_ft.addvalue);
+        // the choice of the best trial also depends on the loader size
+        kb.add(opt->small);
+        kb.add(opt->cpu);
+        kb.add(&opt->o_unix, sizeof(opt->o_unix));
+        kb.add(&opt->dos_exe, sizeof(opt->dos_exe));
+        kb.add(&opt->ps1_exe, sizeof(opt->ps1_exe));
+        kb.add(opt->win32_pe.compress_exports);
+        kb.add(opt->win32_pe.strip_relocs);
+        kb.add(hdr_ptr, hdr_ptr ? hdr_len : 0);
+        kb.add(i_ptr, i_len);
+        cache_key = kb.get();
+        cache_i_adler = upx_adler32(i_ptr, i_len);
+        CachedCompressResult r;
+        cache_hit = cache_load_result(cache_key, cache_i_adler, i_len - 1, r, o_ptr);
+        if (cache_hit) {
+            cache_apply_result(best_ph, r);
+            best_ph.method = r.method;
+            best_ph.filter = r.filter;
+            best_ph.filter_cto = r.filter_cto;
+            best_ph.n_mru = r.n_mru;
+            best_ph.overlap_overhead = r.overlap_overhead;
+            // replay compress(); u_adler is set below after filtering
+            best_ph.u_len = i_len;
+            best_ph.saved_u_adler = orig_ph.u_adler;
+            best_ph.saved_c_adler = orig_ph.c_adler;
+            best_ph.c_adler = upx_adler32(o_ptr, best_ph.c_len, orig_ph.c_adler);
+            best_ft.init(r.filter, orig_ft.addvalue);
+            best_ft.cto = (unsigned char) r.filter_cto;
+            best_ft.calls = r.filter_calls;
+            // check the entry against the filtered input, see cache_verify_result()
+            MemBuffer v_buf(i_len);
+            memcpy(v_buf, i_ptr, i_len);
+            bool ok = contains_id(methods, nmethods, r.method) &&
+                      contains_id(filters, nfilters, r.filter) && r.overlap_overhead > 0;
+            if (ok && r.filter != 0) {
+                Filter ft = orig_ft;
+                ft.init(r.filter, orig_ft.addvalue);
+                optimizeFilter(&ft, f_ptr, f_len);
+                ok = ft.filter(f_ptr, v_buf + ptr_udiff_bytes(f_ptr, i_ptr), f_len) &&
+                     ft.cto == r.filter_cto && ft.calls == r.filter_calls;
+            }
+            if (!ok || !cache_verify_result(best_ph, o_ptr, v_buf, r.overlap_overhead)) {
+                // treat as a miss
+                cache_remove(cache_key);
+                cache_hit = false;
+                best_ph = orig_ph;
+                best_ph.c_len = i_len;
+                best_ph.overlap_overhead = 0;
+                best_ft = orig_ft;
+            }
+        }
+    }
+
+    // --hints-file: first try only the combination that won last time, then
+    // its neighbours in methods[] and filters[] (these lists are ordered, so
+    // neighbours are the related filter variants and method variants), and
+    // only then all methods/filters
+    CacheKey hints_key = {};
+    CompressHint hint = {};
+    int hint_methods[1];
+    int hint_filters[2];
+    int hint_nfilters = 0;
+    int near_methods[2];
+    int near_nmethods = 0;
+    int near_filters[2];
+    int near_nfilters = 0;
+    bool use_hint = false;
+    if (opt->hints_file != nullptr && !cache_hit && !is_forced_method(ph.method)) {
+        CacheKeyBuilder kb;
+        kb.add("compressWithFilters");
+        kb.add(fn_basename(fi ? fi->getName() : ""));
+        kb.add(getFormat());
+        kb.add(ph.level);
+        kb.add(call_index);
+        kb.add(methods, sizeof(methods[0]) * nmethods);
+        kb.add(filters, sizeof(filters[0]) * nfilters);
+        kb.add(filter_strategy);
+        hints_key = kb.get();
+        if (hints_lookup(hints_key, hint) && contains_id(methods, nmethods, hint.method) &&
+            contains_id(filters, nfilters, hint.filter)) {
+            hint_methods[0] = hint.method;
+            hint_filters[hint_nfilters++] = hint.filter;
+            if (hint.filter != 0)
+                hint_filters[hint_nfilters++] = 0; // the "no filter" fallback
+            const int ntrials = (filter_strategy < 0) ? nmethods : nmethods * nfilters;
+            use_hint = ((filter_strategy < 0) ? 1 : hint_nfilters) < ntrials;
+            for (int i = 0; i < nmethods; i++) {
+                if (methods[i] != hint.method)
+                    continue;
+                if (i > 0)
+                    near_methods[near_nmethods++] = methods[i - 1];
+                if (i + 1 < nmethods)
+                    near_methods[near_nmethods++] = methods[i + 1];
+            }
+            for (int i = 0; i < nfilters && hint.filter != 0; i++) {
+                if (filters[i] != hint.filter)
+                    continue;
+                if (i > 0 && filters[i - 1] != 0)
+                    near_filters[near_nfilters++] = filters[i - 1];
+                if (i + 1 < nfilters && filters[i + 1] != 0)
+                    near_filters[near_nfilters++] = filters[i + 1];
+            }
+            // with filter_strategy < 0 only the first working filter is used
+            if (filter_strategy < 0)
+                near_nfilters = 0;
+        }
     }
 
     // Working buffer for compressed data. Don't waste memory and allocate as needed.
     byte *o_tmp = o_ptr;
     MemBuffer o_tmp_buf;
+    // Filters are applied out-of-place into f_tmp_buf[], so i_ptr[] is never
+    // modified during the search and only the chosen filter needs to be verified.
+    MemBuffer f_tmp_buf;
+    const unsigned f_off = ptr_udiff_bytes(f_ptr, i_ptr);
+    // trials that are losing anyway are stopped early, see set_trial_budget()
+    upx_compress_config_t trial_cconf;
+    trial_cconf.reset();
+    if (cconf != nullptr)
+        trial_cconf = *cconf;
 
-    // compress using all methods/filters
     int nfilters_success_total = 0;
-    for (int mm = 0; mm < nmethods; mm++) // for all methods
-    {
-        NO_printf("\nmethod %d (%d of %d)\n", methods[mm], 1 + mm, nmethods);
-        assert(isValidCompressionMethod(methods[mm]));
-        unsigned hdr_c_len = 0;
-        if (hdr_ptr != nullptr && hdr_len) {
-            if (nfilters_success_total != 0 && o_tmp == o_ptr) {
-                // do not overwrite o_ptr
-                o_tmp_buf.allocForCompression(UPX_MAX(hdr_len, i_len));
-                o_tmp = o_tmp_buf;
-            }
-            int r = upx_compress(hdr_ptr, hdr_len, o_tmp, &hdr_c_len, nullptr, methods[mm], 10,
-                                 nullptr, nullptr);
-            if (r != UPX_E_OK)
-                throwInternalError("header compression failed");
-            if (hdr_c_len >= hdr_len)
-                throwInternalError("header compression size increase");
+    for (int round = use_hint ? 0 : 3; round < 4; round++) {
+        // round 0: the hinted combination; round 1: the hinted method with the
+        // neighbouring filters; round 2: the neighbouring methods with the
+        // hinted filter; round 3: all methods/filters
+        // Rounds 0..2 are at most 2 + 2 + 4 trials and keep the best result;
+        // round 3 starts from scratch.
+        const int *try_methods = methods;
+        int try_nmethods = nmethods;
+        const int *try_filters = filters;
+        int try_nfilters = nfilters;
+        if (round == 0 || round == 1) {
+            try_methods = hint_methods;
+            try_nmethods = 1;
+        } else if (round == 2) {
+            try_methods = near_methods;
+            try_nmethods = near_nmethods;
+        }
+        if (round == 0 || round == 2) {
+            try_filters = hint_filters;
+            try_nfilters = hint_nfilters;
+        } else if (round == 1) {
+            try_filters = near_filters;
+            try_nfilters = near_nfilters;
+        }
+        if (try_nmethods == 0 || try_nfilters == 0)
+            continue;
+        if (round == 3 && use_hint) {
+            NO_printf("hint %#x/%#x regressed, doing the full search\n", hint.method, hint.filter);
+            best_ph = orig_ph;
+            best_ph.c_len = i_len;
+            best_ph.overlap_overhead = 0;
+            best_ph_lsize = 0;
+            best_hdr_c_len = 0;
+            best_ft = orig_ft;
+            nfilters_success_total = 0;
         }
-        int nfilters_success_mm = 0;
-        for (int ff = 0; ff < nfilters; ff++) // for all filters
+
+        // update total_passes; previous (ui_total_passes > 0) means incremental
+        if (!cache_hit && !is_forced_method(orig_ph.method)) {
+            if (uip->ui_total_passes > 0 && !(use_hint && round > 0))
+                uip->ui_total_passes -= 1;
+            if (filter_strategy < 0)
+                uip->ui_total_passes += try_nmethods;
+            else
+                uip->ui_total_passes += try_nfilters * try_nmethods;
+        }
+
+        const bool parallel_done =
+            cache_hit || compressWithFiltersParallel(i_ptr, i_len, o_ptr, f_ptr, f_len, hdr_ptr,
+                                                     hdr_len, orig_ft, overlap_range, cconf,
+                                                     filter_strategy, try_methods, try_nmethods,
+                                                     try_filters, try_nfilters, best_ph,
+                                                     best_ph_lsize, best_ft,
+                                                     nfilters_success_total);
+        for (int mm = 0; mm < try_nmethods && !parallel_done; mm++) // for all methods
         {
-            assert(isValidFilter(filters[ff]));
-            // get fresh packheader
-            ph = orig_ph;
-            ph.method = methods[mm];
-            ph.filter = filters[ff];
-            ph.overlap_overhead = 0;
-            // get fresh filter
-            Filter ft = orig_ft;
-            ft.init(ph.filter, orig_ft.addvalue);
-            // filter
-            optimizeFilter(&ft, f_ptr, f_len);
-            bool success = ft.filter(f_ptr, f_len);
-            if (ft.id != 0 && ft.calls == 0) {
-                // filter did not do anything - no need to call ft.unfilter()
-                success = false;
-            }
-            if (!success) {
-                // filter failed or was useless
-                if (filter_strategy >= 0) {
-                    // adjust ui passes
-                    if (uip->ui_pass >= 0)
-                        uip->ui_pass++;
+            NO_printf("\nmethod %d (%d of %d)\n", try_methods[mm], 1 + mm, try_nmethods);
+            assert(isValidCompressionMethod(try_methods[mm]));
+            unsigned hdr_c_len = 0;
+            if (hdr_ptr != nullptr && hdr_len) {
+                if (nfilters_success_total != 0 && o_tmp == o_ptr) {
+                    // do not overwrite o_ptr
+                    o_tmp_buf.allocForCompression(UPX_MAX(hdr_len, i_len));
+                    o_tmp = o_tmp_buf;
                 }
-                continue;
-            }
-            // filter success
-            NO_printf("\nfilter: id 0x%02x size %6d, calls %5d/%5d/%3d/%5d/%5d, cto 0x%02x\n",
-                      ft.id, ft.buf_len, ft.calls, ft.noncalls, ft.wrongcalls, ft.firstcall,
-                      ft.lastcall, ft.cto);
-            if (nfilters_success_total != 0 && o_tmp == o_ptr) {
-                o_tmp_buf.allocForCompression(i_len);
-                o_tmp = o_tmp_buf;
+                int r = upx_compress(hdr_ptr, hdr_len, o_tmp, &hdr_c_len, nullptr,
+                                     try_methods[mm], 10, nullptr, nullptr);
+                if (r != UPX_E_OK)
+                    throwInternalError("header compression failed");
+                if (hdr_c_len >= hdr_len)
+                    throwInternalError("header compression size increase");
             }
-            nfilters_success_total++;
-            nfilters_success_mm++;
-            ph.filter_cto = ft.cto;
-            ph.n_mru = ft.n_mru;
-            // compress
-            if (compress(i_ptr, i_len, o_tmp, cconf)) {
-                unsigned lsize = 0;
-                // findOverlapOperhead() might be slow; omit if already too big.
-                if (ph.c_len + lsize + hdr_c_len <=
-                    best_ph.c_len + best_ph_lsize + best_hdr_c_len) {
-                    // get results
-                    ph.overlap_overhead = findOverlapOverhead(o_tmp, i_ptr, overlap_range);
-                    buildLoader(&ft);
-                    lsize = getLoaderSize();
-                    assert(lsize > 0);
+            int nfilters_success_mm = 0;
+            for (int ff = 0; ff < try_nfilters; ff++) // for all filters
+            {
+                assert(isValidFilter(try_filters[ff]));
+                // get fresh packheader
+                ph = orig_ph;
+                ph.method = try_methods[mm];
+                ph.filter = try_filters[ff];
+                ph.overlap_overhead = 0;
+                // get fresh filter
+                Filter ft = orig_ft;
+                ft.init(ph.filter, orig_ft.addvalue);
+                // filter
+                optimizeFilter(&ft, f_ptr, f_len);
+                byte *c_ptr = i_ptr; // input for compress()
+                if (ft.id != 0) {
+                    if (f_tmp_buf.getSize() == 0) {
+                        f_tmp_buf.alloc(i_len);
+                        memcpy(f_tmp_buf, i_ptr, i_len);
+                    }
+                    c_ptr = f_tmp_buf;
+                }
+                bool success = ft.filter(f_ptr, c_ptr + f_off, f_len);
+                ft.buf = f_ptr;
+                if (ft.id != 0 && ft.calls == 0) {
+                    // filter did not do anything
+                    success = false;
                 }
-                NO_printf("\n%2d %02x: %d +%4d +%3d = %d  (best: %d +%4d +%3d = %d)\n", ph.method,
-                          ph.filter, ph.c_len, lsize, hdr_c_len, ph.c_len + lsize + hdr_c_len,
-                          best_ph.c_len, best_ph_lsize, best_hdr_c_len,
-                          best_ph.c_len + best_ph_lsize + best_hdr_c_len);
-                bool update = false;
-                if (ph.c_len + lsize + hdr_c_len < best_ph.c_len + best_ph_lsize + best_hdr_c_len)
-                    update = true;
-                else if (ph.c_len + lsize + hdr_c_len ==
-                         best_ph.c_len + best_ph_lsize + best_hdr_c_len) {
-                    // prefer smaller loaders
-                    if (lsize + hdr_c_len < best_ph_lsize + best_hdr_c_len)
-                        update = true;
-                    else if (lsize + hdr_c_len == best_ph_lsize + best_hdr_c_len) {
-                        // prefer less overlap_overhead
-                        if (ph.overlap_overhead < best_ph.overlap_overhead)
-                            update = true;
+                if (!success) {
+                    // filter failed or was useless
+                    if (filter_strategy >= 0) {
+                        // adjust ui passes
+                        if (uip->ui_pass >= 0)
+                            uip->ui_pass++;
                     }
+                    continue;
                 }
-                if (update) {
-                    assert((int) ph.overlap_overhead > 0);
-                    // update o_ptr[] with best version
-                    if (o_tmp != o_ptr)
-                        memcpy(o_ptr, o_tmp, ph.c_len);
-                    // save compression results
-                    best_ph = ph;
-                    best_ph_lsize = lsize;
-                    best_hdr_c_len = hdr_c_len;
-                    best_ft = ft;
+                // filter success
+                NO_printf("\nfilter: id 0x%02x size %6d, calls %5d/%5d/%3d/%5d/%5d, cto 0x%02x\n",
+                          ft.id, ft.buf_len, ft.calls, ft.noncalls, ft.wrongcalls, ft.firstcall,
+                          ft.lastcall, ft.cto);
+                if (nfilters_success_total != 0 && o_tmp == o_ptr) {
+                    o_tmp_buf.allocForCompression(i_len);
+                    o_tmp = o_tmp_buf;
                 }
+                nfilters_success_total++;
+                nfilters_success_mm++;
+                ph.filter_cto = ft.cto;
+                ph.n_mru = ft.n_mru;
+                // compress
+                set_trial_budget(trial_cconf, best_ph.c_len + best_ph_lsize + best_hdr_c_len,
+                                 hdr_c_len);
+                if (compress(c_ptr, i_len, o_tmp, &trial_cconf)) {
+                    unsigned lsize = 0;
+                    // findOverlapOperhead() might be slow; omit if already too big.
+                    if (ph.c_len + lsize + hdr_c_len <=
+                        best_ph.c_len + best_ph_lsize + best_hdr_c_len) {
+                        // get results
+                        ph.overlap_overhead = findOverlapOverhead(o_tmp, c_ptr, overlap_range);
+                        PhaseTimer timer(STATS_LOADER);
+                        buildLoader(&ft);
+                        lsize = getLoaderSize();
+                        assert(lsize > 0);
+                    }
+                    NO_printf("\n%2d %02x: %d +%4d +%3d = %d  (best: %d +%4d +%3d = %d)\n",
+                              ph.method, ph.filter, ph.c_len, lsize, hdr_c_len,
+                              ph.c_len + lsize + hdr_c_len, best_ph.c_len, best_ph_lsize,
+                              best_hdr_c_len, best_ph.c_len + best_ph_lsize + best_hdr_c_len);
+                    if (is_better_trial(ph.c_len, lsize, hdr_c_len, ph.overlap_overhead,
+                                        best_ph.c_len, best_ph_lsize, best_hdr_c_len,
+                                        best_ph.overlap_overhead)) {
+                        assert((int) ph.overlap_overhead > 0);
+                        // update o_ptr[] with best version
+                        if (o_tmp != o_ptr)
+                            memcpy(o_ptr, o_tmp, ph.c_len);
+                        // save compression results
+                        best_ph = ph;
+                        best_ph_lsize = lsize;
+                        best_hdr_c_len = hdr_c_len;
+                        best_ft = ft;
+                    }
+                }
+                if (filter_strategy < 0)
+                    break;
             }
-            // restore - unfilter with verify
-            ft.unfilter(f_ptr, f_len, true);
-            if (filter_strategy < 0)
-                break;
+            // round 1 has no "no filter" fallback, so all its filters may fail
+            assert(nfilters_success_mm > 0 || round == 1);
         }
-        assert(nfilters_success_mm > 0);
+
+        if (round < 3 && best_ph.overlap_overhead > 0 &&
+            !hint_has_regressed(hint, best_ph.u_len, best_ph.c_len))
+            break;
     }
+    if (opt->hints_file != nullptr && !cache_hit && !is_forced_method(orig_ph.method) &&
+        best_ph.overlap_overhead > 0)
+        hints_update(hints_key, CompressHint{best_ph.method, best_ph.filter, best_ph.u_len,
+                                             best_ph.c_len});
 
     // postconditions 1)
-    assert(nfilters_success_total > 0);
+    assert(cache_hit || nfilters_success_total > 0);
     assert(best_ph.u_len == orig_ph.u_len);
     assert(best_ph.filter == best_ft.id);
     assert(best_ph.filter_cto == best_ft.cto);
     // FIXME  assert(best_ph.n_mru == best_ft.n_mru);
 
+    // verify the chosen filter: filter in-place, then unfilter with checksum
+    if (best_ft.id != 0) {
+        Filter ft = orig_ft;
+        ft.init(best_ft.id, orig_ft.addvalue);
+        optimizeFilter(&ft, f_ptr, f_len);
+        if (!ft.filter(f_ptr, f_len) || ft.cto != best_ft.cto || ft.calls != best_ft.calls)
+            throwInternalError("filter verify");
+        if (cache_hit) {
+            best_ph.u_adler = upx_adler32(i_ptr, i_len, orig_ph.u_adler);
+            best_ft = ft;
+        }
+        ft.unfilter(f_ptr, f_len, true);
+        best_ft.adler = ft.adler;
+    } else if (cache_hit)
+        best_ph.u_adler = upx_adler32(i_ptr, i_len, orig_ph.u_adler);
+
+    if (opt->cache_dir != nullptr && !cache_hit && best_ph.overlap_overhead > 0) {
+        CachedCompressResult r;
+        cache_fill_result(r, best_ph, cache_i_adler, true);
+        r.filter_calls = best_ft.calls;
+        cache_store_result(cache_key, r, o_ptr);
+    }
+
     // copy back results
     this->ph = best_ph;
     *parm_ft = best_ft;
+    if (cache_hit) {
+        PhaseTimer timer(STATS_LOADER);
+        buildLoader(&best_ft);
+        best_ph_lsize = getLoaderSize();
+    }
 
     // Finally, check compression ratio.
     // Might be inhibited when blocksize < file_size, for instance.
@@ -96,8 +96,11 @@ public:
 bool ph_skipVerify(const PackHeader &ph);
 void ph_decompress(PackHeader &ph, SPAN_P(const byte) in, SPAN_P(byte) out, bool verify_checksum,
                    Filter *ft);
-bool ph_testOverlappingDecompression(const PackHeader &ph, SPAN_P(const byte) buf,
+bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *buf, const byte *tbuf,
                                      unsigned overlap_overhead);
+bool ph_testOverlappingDecompression(const PackHeader &ph, const byte *buf, const byte *tbuf,
+                                     unsigned overlap_overhead, MemBuffer &scratch);
+void ph_verifyOverlappingDecompression(PackHeader &ph, byte *o_ptr, unsigned o_size, Filter *ft);
 
 /*************************************************************************
 // abstract base class for packers
@@ -163,6 +166,12 @@ protected:
     // main compression drivers
     bool compress(SPAN_P(byte) i_ptr, unsigned i_len, SPAN_P(byte) o_ptr,
                   const upx_compress_config_t *cconf = nullptr);
+    // same as above, but only updates xph - can be called concurrently
+    bool compress(PackHeader &xph, upx_callback_p cb, SPAN_P(byte) i_ptr, unsigned i_len,
+                  SPAN_P(byte) o_ptr, const upx_compress_config_t *cconf) const;
+    // same as above, but reuses the results of earlier runs with "--cache-dir"
+    bool compressCached(PackHeader &xph, upx_callback_p cb, SPAN_P(byte) i_ptr, unsigned i_len,
+                        SPAN_P(byte) o_ptr, const upx_compress_config_t *cconf) const;
     void decompress(SPAN_P(const byte) in, SPAN_P(byte) out, bool verify_checksum = true,
                     Filter *ft = nullptr);
     virtual bool checkDefaultCompressionRatio(unsigned u_len, unsigned c_len) const;
@@ -187,13 +196,32 @@ protected:
                              unsigned overlap_range, upx_compress_config_t const *cconf,
                              int filter_strategy, bool inhibit_compression_check = false);
 
+private:
+    // rank the candidate filters and keep only the most promising ones
+    int preselectFilters(int *filters, int nfilters, const byte *f_ptr, unsigned f_len,
+                         const Filter &orig_ft) const;
+    // multithreaded trial engine for compressWithFilters()
+    struct CompressTrial;
+    bool compressWithFiltersParallel(byte *i_ptr, unsigned i_len, byte *o_ptr, byte *f_ptr,
+                                     unsigned f_len, byte *hdr_ptr, unsigned hdr_len,
+                                     const Filter &orig_ft, unsigned overlap_range,
+                                     upx_compress_config_t const *cconf, int filter_strategy,
+                                     const int *methods, int nmethods, const int *filters,
+                                     int nfilters, PackHeader &best_ph, unsigned &best_ph_lsize,
+                                     Filter &best_ft, int &nfilters_success_total);
+
+protected:
     // util for verifying overlapping decompression
     //   non-destructive test
-    virtual bool testOverlappingDecompression(const byte *buf, const byte *tbuf,
-                                              unsigned overlap_overhead) const;
+    bool testOverlappingDecompression(const byte *buf, const byte *tbuf,
+                                      unsigned overlap_overhead) const;
     //   non-destructive find
-    virtual unsigned findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range = 0,
-                                         unsigned upper_limit = ~0u) const;
+    unsigned findOverlapOverhead(const byte *buf, const byte *tbuf, unsigned range = 0,
+                                 unsigned upper_limit = ~0u) const;
+    //   final adjustment of the value returned by findOverlapOverhead()
+    virtual unsigned alignOverlapOverhead(unsigned overlap_overhead) const {
+        return overlap_overhead;
+    }
     //   destructive decompress + verify
     void verifyOverlappingDecompression(Filter *ft = nullptr);
     void verifyOverlappingDecompression(byte *o_ptr, unsigned o_size, Filter *ft = nullptr);
@@ -315,6 +343,9 @@ private:
     int last_patch_len;
     int last_patch_off;
 
+    // number of compressWithFilters() calls, part of the "--hints-file" key
+    unsigned compress_with_filters_calls = 0;
+
 private:
     // disable copy and assignment
     Packer(const Packer &) = delete;
@@ -54,17 +54,15 @@
 #include "p_w64pe_arm64.h"
 #include "p_wince_arm.h"
 #include "p_wcle.h"
+#include "util/stats.h"
 
 /*************************************************************************
 //
 **************************************************************************/
 
 PackMaster::PackMaster(InputFile *f, Options *o) noexcept : fi(f) {
-    // replace global options with local options
+    // replace the current options of this thread with local options
     if (o != nullptr) {
-#if WITH_THREADS
-        std::lock_guard<std::mutex> lock(opt_lock_mutex);
-#endif
         saved_opt = o;
         memcpy(&this->local_options, o, sizeof(*o)); // struct copy
         opt = &this->local_options;
@@ -74,11 +72,8 @@ PackMaster::PackMaster(InputFile *f, Options *o) noexcept : fi(f) {
 PackMaster::~PackMaster() noexcept {
     delete packer;
     packer = nullptr;
-    // restore global options
+    // restore options
     if (saved_opt != nullptr) {
-#if WITH_THREADS
-        std::lock_guard<std::mutex> lock(opt_lock_mutex);
-#endif
         opt = saved_opt;
         saved_opt = nullptr;
     }
@@ -136,8 +131,75 @@ static Packer *try_can_unpack(Packer *p, void *user) {
 //
 **************************************************************************/
 
+/*************************************************************************
+// Classify a file from its first bytes with a single read, so that
+// visitAllPackers() can skip whole families of packers. A family is only
+// skipped if the very first check of each of its canPack() and
+// canUnpack() would reject the file by its magic bytes anyway, without
+// throwing; everything else is always visited.
+**************************************************************************/
+
+enum : unsigned {
+    SNIFF_DOS = 1 << 0,          // MZ, and what dos32 extenders and PE put in front
+    SNIFF_VMLINUZ_I386 = 1 << 1, // boot sector signature
+    SNIFF_VMLINUZ_ARM = 1 << 2,  // 8 nops
+    SNIFF_ELF = 1 << 3,          // "\177ELF", including vmlinux
+    SNIFF_MACH = 1 << 4,         // Mach-O and fat (universal) binaries
+    SNIFF_TOS = 1 << 5,          // atari/tos
+    SNIFF_PS1 = 1 << 6,          // ps1/exe
+    SNIFF_ALL = ~0u
+};
+static constexpr unsigned SNIFF_SIZE = 512;
+
+static unsigned sniff_buf(const byte *b, unsigned len) {
+    if (len < SNIFF_SIZE)
+        return SNIFF_ALL; // too short to decide; let the packers look
+    unsigned r = 0;
+    const unsigned le16 = get_le16(b);
+    if (le16 == 0x5a4d || le16 == 0x4d5a || le16 == 0x014c || !memcmp(b, "BW", 2) ||
+        !memcmp(b, "LE", 2) || !memcmp(b, "PMW1", 4) || !memcmp(b, "Adam", 4) ||
+        !memcmp(b, "PE\0\0", 4))
+        r |= SNIFF_DOS;
+    if (get_le16(b + 0x1fe) == 0xaa55)
+        r |= SNIFF_VMLINUZ_I386;
+    bool arm_nops = true;
+    for (unsigned i = 0; i < 32; i += 4)
+        arm_nops &= get_le32(b + i) == 0xe1a00000;
+    if (arm_nops)
+        r |= SNIFF_VMLINUZ_ARM;
+    if (!memcmp(b, "\x7f\x45\x4c\x46", 4))
+        r |= SNIFF_ELF;
+    // byte order varies by target, so accept both
+    for (unsigned magic : {get_be32(b), get_le32(b)})
+        if (magic == 0xfeedface || magic == 0xfeedfacf || magic == 0xcafebabe)
+            r |= SNIFF_MACH;
+    if (get_be16(b) == 0x601a || le16 == 0x601a)
+        r |= SNIFF_TOS;
+    if (!memcmp(b, "PS-X EXE", 8) || !memcmp(b, "EXE X-SP", 8))
+        r |= SNIFF_PS1;
+    return r;
+}
+
+static unsigned sniff_file(InputFile *f) {
+    if (f == nullptr) // see show_all_packers() in help.cpp
+        return SNIFF_ALL;
+    byte buf[SNIFF_SIZE];
+    f->seek(0, SEEK_SET);
+    const int len = f->read(buf, sizeof(buf));
+    f->seek(0, SEEK_SET);
+    return sniff_buf(buf, len > 0 ? (unsigned) len : 0);
+}
+
+/*************************************************************************
+//
+**************************************************************************/
+
 /*static*/
 Packer *PackMaster::visitAllPackers(visit_func_t func, InputFile *f, const Options *o, void *user) {
+    PhaseTimer timer(STATS_DETECT, f ? f->st_size() : 0);
+    const unsigned sniff = sniff_file(f);
+    if (o->debug.debug_level)
+        fprintf(stderr, "visitAllPackers: sniff=%#x\n", sniff);
 
 #define D(Klass)                                                                                   \
     ACC_BLOCK_BEGIN                                                                                \
@@ -157,32 +219,39 @@ Packer *PackMaster::visitAllPackers(visit_func_t func, InputFile *f, const Optio
     //
     // .exe
     //
-    if (!o->dos_exe.force_stub) {
-        // dos32
-        D(PackDjgpp2);
-        D(PackTmt);
-        D(PackWcle);
-        // Windows
-        // D(PackW64PeArm64EC); // NOT YET IMPLEMENTED
-        // D(PackW64PeArm64); // NOT YET IMPLEMENTED
-        D(PackW64PeAmd64);
-        D(PackW32PeI386);
-        D(PackWinCeArm);
+    if (sniff & SNIFF_DOS) {
+        if (!o->dos_exe.force_stub) {
+            // dos32
+            D(PackDjgpp2);
+            D(PackTmt);
+            D(PackWcle);
+            // Windows
+            // D(PackW64PeArm64EC); // NOT YET IMPLEMENTED
+            // D(PackW64PeArm64); // NOT YET IMPLEMENTED
+            D(PackW64PeAmd64);
+            D(PackW32PeI386);
+            D(PackWinCeArm);
+        }
+        D(PackExe); // dos/exe
     }
-    D(PackExe); // dos/exe
 
     //
     // linux kernel
     //
-    D(PackVmlinuxARMEL);
-    D(PackVmlinuxARMEB);
-    D(PackVmlinuxPPC32);
-    D(PackVmlinuxPPC64LE);
-    D(PackVmlinuxAMD64);
-    D(PackVmlinuxI386);
-    D(PackVmlinuzI386);
-    D(PackBvmlinuzI386);
-    D(PackVmlinuzARMEL);
+    if (sniff & SNIFF_ELF) {
+        D(PackVmlinuxARMEL);
+        D(PackVmlinuxARMEB);
+        D(PackVmlinuxPPC32);
+        D(PackVmlinuxPPC64LE);
+        D(PackVmlinuxAMD64);
+        D(PackVmlinuxI386);
+    }
+    if (sniff & SNIFF_VMLINUZ_I386) {
+        D(PackVmlinuzI386);
+        D(PackBvmlinuzI386);
+    }
+    if (sniff & SNIFF_VMLINUZ_ARM)
+        D(PackVmlinuzARMEL);
 
     //
     // linux
@@ -191,32 +260,37 @@ Packer *PackMaster::visitAllPackers(visit_func_t func, InputFile *f, const Optio
         if (o->o_unix.use_ptinterp) {
             D(PackLinuxElf32x86interp);
         }
-        D(PackFreeBSDElf32x86);
-        D(PackNetBSDElf32x86);
-        D(PackOpenBSDElf32x86);
-        D(PackLinuxElf32x86);
-        D(PackLinuxElf64amd);
-        D(PackLinuxElf32armLe);
-        D(PackLinuxElf32armBe);
-        D(PackLinuxElf64arm);
-        D(PackLinuxElf32ppc);
-        D(PackLinuxElf64ppc);
-        D(PackLinuxElf64ppcle);
-        D(PackLinuxElf32mipsel);
-        D(PackLinuxElf32mipseb);
-        D(PackLinuxI386sh);
+        if (sniff & SNIFF_ELF) {
+            D(PackFreeBSDElf32x86);
+            D(PackNetBSDElf32x86);
+            D(PackOpenBSDElf32x86);
+            D(PackLinuxElf32x86);
+            D(PackLinuxElf64amd);
+            D(PackLinuxElf32armLe);
+            D(PackLinuxElf32armBe);
+            D(PackLinuxElf64arm);
+            D(PackLinuxElf32ppc);
+            D(PackLinuxElf64ppc);
+            D(PackLinuxElf64ppcle);
+            D(PackLinuxElf32mipsel);
+            D(PackLinuxElf32mipseb);
+        }
+        D(PackLinuxI386sh); // canUnpack() looks at the end of any file
     }
     D(PackBSDI386);
-    D(PackMachFat);   // cafebabe conflict
-    D(PackLinuxI386); // cafebabe conflict
+    if (sniff & SNIFF_MACH)
+        D(PackMachFat); // cafebabe conflict
+    D(PackLinuxI386);   // cafebabe conflict
 
     // Mach (Darwin / macOS)
-    D(PackDylibAMD64);
-    D(PackMachPPC32); // TODO: this works with upx 3.91..3.94 but got broken in 3.95; FIXME
-    D(PackMachI386);
-    D(PackMachAMD64);
-    D(PackMachARMEL);
-    D(PackMachARM64EL);
+    if (sniff & SNIFF_MACH) {
+        D(PackDylibAMD64);
+        D(PackMachPPC32); // TODO: this works with upx 3.91..3.94 but got broken in 3.95; FIXME
+        D(PackMachI386);
+        D(PackMachAMD64);
+        D(PackMachARMEL);
+        D(PackMachARM64EL);
+    }
 
     // 2010-03-12  omit these because PackMachBase<T>::pack4dylib (p_mach.cpp)
     // does not understand what the Darwin (Apple Mac OS X) dynamic loader
@@ -227,8 +301,10 @@ Packer *PackMaster::visitAllPackers(visit_func_t func, InputFile *f, const Optio
     //
     // misc
     //
-    D(PackTos); // atari/tos
-    D(PackPs1); // ps1/exe
+    if (sniff & SNIFF_TOS)
+        D(PackTos); // atari/tos
+    if (sniff & SNIFF_PS1)
+        D(PackPs1); // ps1/exe
     D(PackSys); // dos/sys
     D(PackCom); // dos/com
 
@@ -288,4 +364,35 @@ void PackMaster::fileInfo() {
     packer->doFileInfo();
 }
 
+const char *PackMaster::getPackerName() const noexcept {
+    return packer ? packer->getName() : nullptr;
+}
+
+/*************************************************************************
+//
+**************************************************************************/
+
+TEST_CASE("sniff_buf") {
+    byte b[SNIFF_SIZE];
+    memset(b, 0, sizeof(b));
+    CHECK(sniff_buf(b, sizeof(b) - 1) == SNIFF_ALL);
+    CHECK(sniff_buf(b, sizeof(b)) == 0);
+    memcpy(b, "\x7f" "ELF\x02\x01\x01", 7);
+    CHECK(sniff_buf(b, sizeof(b)) == SNIFF_ELF);
+    memcpy(b, "MZ", 2);
+    set_le16(b + 0x1fe, 0xaa55);
+    CHECK(sniff_buf(b, sizeof(b)) == (SNIFF_DOS | SNIFF_VMLINUZ_I386));
+    set_be32(b, 0xcafebabe);
+    CHECK(sniff_buf(b, sizeof(b)) == (SNIFF_MACH | SNIFF_VMLINUZ_I386));
+    set_le32(b, 0xfeedfacf);
+    CHECK((sniff_buf(b, sizeof(b)) & SNIFF_MACH) != 0);
+    memcpy(b, "PS-X EXE", 8);
+    CHECK(sniff_buf(b, sizeof(b)) == (SNIFF_PS1 | SNIFF_VMLINUZ_I386));
+    set_be16(b, 0x601a);
+    CHECK((sniff_buf(b, sizeof(b)) & SNIFF_TOS) != 0);
+    for (unsigned i = 0; i < 32; i += 4)
+        set_le32(b + i, 0xe1a00000);
+    CHECK((sniff_buf(b, sizeof(b)) & SNIFF_VMLINUZ_ARM) != 0);
+}
+
 /* vim:set ts=4 sw=4 et: */
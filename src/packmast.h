@@ -46,6 +46,9 @@ public:
     void list();
     void fileInfo();
 
+    // the name of the packer that handled the file, or nullptr
+    const char *getPackerName() const noexcept;
+
     typedef Packer *(*visit_func_t)(Packer *p, void *user);
     static Packer *visitAllPackers(visit_func_t, InputFile *f, const Options *, void *user);
 
@@ -2070,6 +2070,8 @@ unsigned PeFile::readSections(unsigned objs, unsigned usize, unsigned ih_fileali
     const unsigned xtrasize = UPX_MAX(ih_datasize, 65536u) + IDSIZE(PEDIR_IMPORT) +
                               IDSIZE(PEDIR_BOUNDIM) + IDSIZE(PEDIR_IAT) + IDSIZE(PEDIR_DELAYIMP) +
                               IDSIZE(PEDIR_RELOC);
+    // the sections get placed at their RVA, not at their (only FileAlignment
+    // aligned) file offset, so they cannot be mapped; see readxMapped()
     ibuf.alloc(usize + xtrasize);
 
     // BOUND IMPORT support. FIXME: is this ok?
@@ -2811,6 +2813,11 @@ void PeFile::unpack0(OutputFile *fo, const ht &ih, ht &oh, ord_mask_t ord_mask,
 
     // decompress
     decompress(ibuf, obuf);
+    if (!fo && opt->fast_test) {
+        // "--fast-test": decompress() has verified both checksums
+        ibuf.dealloc();
+        return;
+    }
     unsigned skip = get_le32(obuf + (ph.u_len - 4));
     unsigned take = sizeof(oh);
     SPAN_S_VAR(byte, extra_info, obuf);
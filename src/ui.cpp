@@ -79,16 +79,16 @@ struct UiPacker::State {
 #endif
 };
 
-unsigned UiPacker::total_files = 0;
-unsigned UiPacker::total_files_done = 0;
-upx_uint64_t UiPacker::total_c_len = 0;
-upx_uint64_t UiPacker::total_u_len = 0;
-upx_uint64_t UiPacker::total_fc_len = 0;
-upx_uint64_t UiPacker::total_fu_len = 0;
-unsigned UiPacker::update_c_len = 0;
-unsigned UiPacker::update_u_len = 0;
-unsigned UiPacker::update_fc_len = 0;
-unsigned UiPacker::update_fu_len = 0;
+upx_std_atomic(unsigned) UiPacker::total_files{0};
+upx_std_atomic(unsigned) UiPacker::total_files_done{0};
+upx_std_atomic(upx_uint64_t) UiPacker::total_c_len{0};
+upx_std_atomic(upx_uint64_t) UiPacker::total_u_len{0};
+upx_std_atomic(upx_uint64_t) UiPacker::total_fc_len{0};
+upx_std_atomic(upx_uint64_t) UiPacker::total_fu_len{0};
+upx_thread_local unsigned UiPacker::update_c_len = 0;
+upx_thread_local unsigned UiPacker::update_u_len = 0;
+upx_thread_local unsigned UiPacker::update_fc_len = 0;
+upx_thread_local unsigned UiPacker::update_fu_len = 0;
 
 /*************************************************************************
 // constants
@@ -127,7 +127,7 @@ static void init_global_constants(void) noexcept {
 static const char *mkline(upx_uint64_t fu_len, upx_uint64_t fc_len, upx_uint64_t u_len,
                           upx_uint64_t c_len, const char *format_name, const char *filename,
                           bool decompress = false) {
-    static char buf[2048];
+    static upx_thread_local char buf[2048];
     char r[7 + 1];
     char fn[15 + 1];
     const char *f;
@@ -525,9 +525,9 @@ void UiPacker::uiListEnd() { uiUpdate(); }
 
 void UiPacker::uiListTotal(bool decompress) {
     if (opt->verbose >= 1 && total_files >= 2) {
+        const unsigned n = total_files_done;
         char name[32];
-        upx_safe_snprintf(name, sizeof(name), "[ %u file%s ]", total_files_done,
-                          total_files_done == 1 ? "" : "s");
+        upx_safe_snprintf(name, sizeof(name), "[ %u file%s ]", n, n == 1 ? "" : "s");
         con_fprintf(
             stdout, "%s%s\n", header_line2,
             mkline(total_fu_len, total_fc_len, total_u_len, total_c_len, "", name, decompress));
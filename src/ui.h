@@ -93,17 +93,17 @@ protected:
     struct State;
     State *s = nullptr;
 
-    // totals
-    static unsigned total_files;
-    static unsigned total_files_done;
-    static upx_uint64_t total_c_len;
-    static upx_uint64_t total_u_len;
-    static upx_uint64_t total_fc_len;
-    static upx_uint64_t total_fu_len;
-    static unsigned update_c_len;
-    static unsigned update_u_len;
-    static unsigned update_fc_len;
-    static unsigned update_fu_len;
+    // totals; files may get processed concurrently (see option "--threads")
+    static upx_std_atomic(unsigned) total_files;
+    static upx_std_atomic(unsigned) total_files_done;
+    static upx_std_atomic(upx_uint64_t) total_c_len;
+    static upx_std_atomic(upx_uint64_t) total_u_len;
+    static upx_std_atomic(upx_uint64_t) total_fc_len;
+    static upx_std_atomic(upx_uint64_t) total_fu_len;
+    static upx_thread_local unsigned update_c_len;
+    static upx_thread_local unsigned update_u_len;
+    static upx_thread_local unsigned update_fc_len;
+    static upx_thread_local unsigned update_fu_len;
 };
 
 /* vim:set ts=4 sw=4 et: */
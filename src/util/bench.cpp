@@ -0,0 +1,679 @@
+/* bench.cpp -- micro-benchmarks (see CMake target "upx_bench")
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#include "../conf.h"
+#include "../compress/compress.h"
+#include "../file.h"
+#include "../filter.h"
+#include "../linker.h"
+#include "../packmast.h"
+#include "membuffer.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#if !defined(SH_DENYWR)
+#define SH_DENYWR (-1)
+#endif
+#if (HAVE_SYS_RESOURCE_H)
+#include <sys/resource.h>
+#endif
+
+/*************************************************************************
+// upx_bench: time the hot kernels of UPX in isolation
+//
+//   upx_bench [--quick] [--rounds=N] [--time=MS] [--size=KiB]
+//             [--match=SUBSTRING] [FILE...]
+//   upx_bench --e2e [--rounds=N] [--tmpdir=DIR] [FILE...] [-- UPX-OPTION...]
+//
+// The corpus consists of deterministic synthetic buffers plus FILE...
+// (by default the upx_bench executable itself). Every benchmark is
+// calibrated to run for at least --time milliseconds per round, and the
+// median of --rounds rounds is reported. The JSON result on stdout uses
+// a fixed key and record order, so two runs can be compared by name;
+// ratios and sizes are exact, only the timings vary.
+//
+// With --e2e each FILE is packed and unpacked again in-process through
+// PackMaster, the same way as "upx --disable-random-id FILE" and
+// "upx -d" would, and the report covers the whole flow per format.
+**************************************************************************/
+
+namespace {
+
+struct BenchConfig {
+    unsigned rounds = 5;
+    unsigned min_time_ms = 20;
+    unsigned size = 1024 * 1024; // of each synthetic buffer, and limit for files
+    const char *match = nullptr;
+    bool e2e = false;
+    const char *tmpdir = nullptr;
+};
+
+struct BenchInput {
+    std::string name;
+    MemBuffer data;
+    unsigned len = 0;
+    bool code = false; // worth running the filters on
+};
+
+class BenchRunner final {
+public:
+    explicit BenchRunner(const BenchConfig &c) : cfg(c) {}
+
+    bool wanted(const std::string &name) const {
+        return cfg.match == nullptr || name.find(cfg.match) != std::string::npos;
+    }
+
+    // run func() repeatedly and append one JSON record; bytes is per call
+    void run(const std::string &name, upx_uint64_t bytes, const std::function<void()> &func,
+             const char *extra_json = nullptr) {
+        if (!wanted(name))
+            return;
+        func(); // warm up caches, context caches and lazy initialization
+        // calibrate the number of calls per round
+        const upx_uint64_t min_ns = (upx_uint64_t) cfg.min_time_ms * 1000000u;
+        upx_uint64_t iters = 1;
+        for (;;) {
+            const upx_uint64_t t = time(func, iters);
+            if (t >= min_ns || iters >= (1u << 30))
+                break;
+            iters = t == 0 ? iters * 16 : UPX_MAX(iters + 1, iters * min_ns / t + iters / 8);
+        }
+        std::vector<double> ns_per_iter;
+        for (unsigned r = 0; r < cfg.rounds; r++)
+            ns_per_iter.push_back((double) time(func, iters) / (double) iters);
+        std::sort(ns_per_iter.begin(), ns_per_iter.end());
+        const double median = ns_per_iter[ns_per_iter.size() / 2];
+        const double mib_s = median > 0 ? (double) bytes * 1e9 / median / (1024.0 * 1024.0) : 0;
+
+        results += results.empty() ? "\n    {\"name\":" : ",\n    {\"name\":";
+        json_append_string(results, name.c_str());
+        json_append(results,
+                    ",\"bytes\":%llu,\"iters\":%llu,\"ns_per_iter\":%.1f,"
+                    "\"min_ns_per_iter\":%.1f,\"mib_per_s\":%.2f",
+                    (unsigned long long) bytes, (unsigned long long) iters, median,
+                    ns_per_iter[0], mib_s);
+        if (extra_json != nullptr) {
+            results += ',';
+            results += extra_json;
+        }
+        results += '}';
+        fprintf(stderr, "%-40s %10.1f MiB/s\n", name.c_str(), mib_s);
+    }
+
+    const std::string &getResults() const { return results; }
+
+private:
+    static upx_uint64_t time(const std::function<void()> &func, upx_uint64_t iters) {
+        const upx_uint64_t start = PhaseStats::wallClockNs();
+        for (upx_uint64_t i = 0; i < iters; i++)
+            func();
+        return PhaseStats::wallClockNs() - start;
+    }
+
+    const BenchConfig &cfg;
+    std::string results;
+};
+
+// deterministic pseudo-random numbers, independent of the C library
+struct BenchRandom {
+    upx_uint32_t state;
+    explicit BenchRandom(upx_uint32_t seed) : state(seed) {}
+    unsigned next() {
+        state = state * 1103515245u + 12345u;
+        return (state >> 8) & 0xffffff;
+    }
+};
+
+} // namespace
+
+/*************************************************************************
+// corpus
+**************************************************************************/
+
+static void bench_make_zeros(BenchInput &in) { memset(in.data, 0, in.len); }
+
+static void bench_make_random(BenchInput &in) {
+    BenchRandom rnd(1);
+    for (unsigned i = 0; i < in.len; i++)
+        in.data[i] = (byte) rnd.next();
+}
+
+static void bench_make_text(BenchInput &in) {
+    static const char *const words[] = {
+        "the ",    "packer ", "compresses ", "executable ", "files ", "and ",
+        "in ",     "place ",  "decompression ", "of ",   "a ",     "loader ",
+        "section ", "with ",  "filters ",    "for ",       "calls ", "\n",
+    };
+    BenchRandom rnd(2);
+    unsigned i = 0;
+    while (i < in.len) {
+        const char *w = words[rnd.next() % TABLESIZE(words)];
+        for (; *w && i < in.len; w++)
+            in.data[i++] = (byte) *w;
+    }
+}
+
+// x86-like code: a mix of short instructions, call/jmp rel32 into the buffer
+// and jcc rel32, which is what the calltrick filters look for
+static void bench_make_x86code(BenchInput &in) {
+    static const byte ops[] = {0x55, 0x89, 0xe5, 0x8b, 0x45, 0x08, 0x83, 0xc4,
+                               0x10, 0x5d, 0xc3, 0x31, 0xc0, 0x48, 0x8d, 0x74};
+    BenchRandom rnd(3);
+    unsigned i = 0;
+    while (i + 6 <= in.len) {
+        const unsigned r = rnd.next();
+        if (r % 8 == 0) {
+            in.data[i] = (byte) (0xe8 + (r >> 3) % 2); // call or jmp
+            const unsigned target = (r >> 4) % in.len;
+            set_le32(in.data + i + 1, target - (i + 5));
+            i += 5;
+        } else if (r % 16 == 1) {
+            in.data[i] = 0x0f;
+            in.data[i + 1] = (byte) (0x80 + (r >> 4) % 16);
+            set_le32(in.data + i + 2, ((r >> 8) % 4096) - 2048);
+            i += 6;
+        } else
+            in.data[i++] = ops[(r >> 4) % TABLESIZE(ops)];
+    }
+    for (; i < in.len; i++)
+        in.data[i] = 0x90;
+}
+
+static void bench_add_file(std::vector<BenchInput *> &corpus, const char *fn, unsigned limit) {
+    InputFile fi;
+    fi.sopen(fn, O_RDONLY | O_BINARY, SH_DENYWR);
+    const upx_off_t size = fi.st_size();
+    if (size <= 0)
+        return;
+    BenchInput *in = new BenchInput;
+    in->name = fn_basename(fn);
+    in->len = (unsigned) UPX_MIN(size, (upx_off_t) limit);
+    in->data.alloc(in->len);
+    fi.readx(in->data, in->len);
+    in->code = true;
+    corpus.push_back(in);
+}
+
+/*************************************************************************
+// benchmarks
+**************************************************************************/
+
+namespace {
+struct BenchMethod {
+    const char *name;
+    int method;
+};
+} // namespace
+
+static const BenchMethod bench_methods[] = {
+    {"nrv2b", M_NRV2B_LE32}, {"nrv2d", M_NRV2D_LE32}, {"nrv2e", M_NRV2E_LE32},
+    {"lzma", M_LZMA},
+#if (WITH_ZSTD)
+    {"zstd", M_ZSTD},
+#endif
+};
+
+static void bench_compress(BenchRunner &br, const BenchInput &in, const BenchMethod &m,
+                           int level) {
+    const std::string prefix = std::string(m.name) + "/" + std::to_string(level) + "/" + in.name;
+    const std::string cname = std::string("compress/") + prefix;
+    const std::string dname = std::string("decompress/") + prefix;
+    const std::string oname = std::string("test_overlap/") + prefix;
+    if (!br.wanted(cname) && !br.wanted(dname) && !br.wanted(oname))
+        return;
+
+    MemBuffer cbuf;
+    cbuf.allocForCompression(in.len);
+    unsigned c_len = 0;
+    upx_compress_result_t cresult;
+    auto compress = [&]() {
+        c_len = 0;
+        int r = upx_compress(in.data, in.len, cbuf, &c_len, nullptr, m.method, level, nullptr,
+                             &cresult);
+        if (r != UPX_E_OK)
+            throwInternalError("upx_bench: compression failed");
+    };
+    compress();
+    std::string extra;
+    json_append(extra, "\"c_len\":%u,\"ratio\":%.4f", c_len, (double) c_len / (double) in.len);
+    br.run(cname, in.len, compress, extra.c_str());
+    if (c_len >= in.len) // not compressible; nothing to decompress
+        return;
+
+    MemBuffer ubuf(in.len);
+    br.run(dname, in.len, [&]() {
+        unsigned u_len = in.len;
+        int r = upx_decompress(cbuf, c_len, ubuf, &u_len, m.method, &cresult);
+        if (r != UPX_E_OK || u_len != in.len)
+            throwInternalError("upx_bench: decompression failed");
+    });
+
+    // in-place decompression at the estimated (or a generous) overlap offset
+    unsigned u_len = in.len;
+    unsigned src_off = 0;
+    if (upx_find_overlap(cbuf, c_len, &u_len, m.method, &src_off) != UPX_E_OK ||
+        u_len != in.len)
+        src_off = in.len + in.len / 8 + 256 - c_len;
+    MemBuffer obuf(src_off + c_len);
+    extra.clear();
+    json_append(extra, "\"src_off\":%u", src_off);
+    br.run(
+        oname, in.len,
+        [&]() {
+            memcpy(obuf + src_off, cbuf, c_len);
+            unsigned dst_len = in.len;
+            (void) upx_test_overlap(obuf, in.data, src_off, c_len, &dst_len, m.method, &cresult);
+        },
+        extra.c_str());
+}
+
+static void bench_filters(BenchRunner &br, const BenchInput &in) {
+    MemBuffer fbuf(in.len);
+    for (int id = 1; id < 256; id++) {
+        if (!Filter::isValidFilter(id))
+            continue;
+        char id_str[8];
+        snprintf(id_str, sizeof(id_str), "0x%02x", id);
+        const std::string name = std::string("filter/") + id_str + "/" + in.name;
+        Filter ft(9);
+        ft.init(id, 0);
+        br.run(name, in.len, [&]() {
+            ft.init(id, 0);
+            (void) ft.filter(raw_bytes(in.data, in.len), fbuf, in.len);
+        });
+        // unfilter the last filter result again and again
+        ft.init(id, 0);
+        if (!ft.filter(raw_bytes(in.data, in.len), fbuf, in.len))
+            continue;
+        const unsigned cto = ft.cto;
+        br.run("un" + name, in.len, [&]() {
+            ft.init(id, 0);
+            ft.cto = (byte) cto;
+            ft.unfilter(fbuf, in.len);
+            ft.init(id, 0);
+            ft.cto = (byte) cto;
+            (void) ft.filter(fbuf, in.len); // restore; counted twice
+        });
+    }
+}
+
+static void bench_adler32(BenchRunner &br, const BenchInput &in) {
+    volatile unsigned sink = 0;
+    br.run("adler32/" + in.name, in.len, [&]() { sink = sink + upx_adler32(in.data, in.len, 1); });
+}
+
+static const
+#include "../stub/amd64-linux.elf-entry.h"
+
+namespace {
+// expose the steps that a Packer drives through buildLoader()
+class BenchLinker final : public ElfLinkerAMD64 {
+public:
+    using ElfLinker::relocate;
+    // add every section to the output and resolve all undefined symbols
+    void addAllSections() {
+        for (unsigned i = 0; i < nsections; i++) {
+            Section *s = sections[i];
+            if (s->size != 0 && s->output == nullptr && s->name[0] != '*')
+                addLoader(s->name);
+        }
+        for (unsigned i = 0; i < nsymbols; i++)
+            if (strcmp(symbols[i]->section->name, "*UND*") == 0)
+                symbols[i]->offset = 0;
+    }
+};
+} // namespace
+
+static void bench_linker(BenchRunner &br) {
+    const unsigned size = sizeof(stub_amd64_linux_elf_entry);
+    br.run("linker/init/amd64-linux.elf-entry", size, [&]() {
+        BenchLinker linker;
+        linker.init(stub_amd64_linux_elf_entry, size, 0);
+    });
+    br.run("linker/init+relocate/amd64-linux.elf-entry", size, [&]() {
+        BenchLinker linker;
+        linker.init(stub_amd64_linux_elf_entry, size, 0);
+        linker.addAllSections();
+        linker.relocate();
+    });
+}
+
+/*************************************************************************
+// end-to-end: pack and unpack whole files
+**************************************************************************/
+
+namespace {
+struct BenchE2EOp {
+    PhaseStats stats; // summed over all rounds
+    std::vector<upx_uint64_t> ns;
+    upx_uint64_t peak_membuffer_bytes = 0; // maximum over all rounds
+    upx_off_t out_bytes = 0;
+
+    void appendJson(std::string &s, upx_uint64_t bytes) {
+        std::sort(ns.begin(), ns.end());
+        const upx_uint64_t median = ns[ns.size() / 2];
+        json_append(s,
+                    "{\"ns\":%llu,\"min_ns\":%llu,\"mib_per_s\":%.2f,"
+                    "\"peak_membuffer_bytes\":%llu,\"phases\":{",
+                    (unsigned long long) median, (unsigned long long) ns[0],
+                    median ? (double) bytes * 1e9 / (double) median / (1024.0 * 1024.0) : 0,
+                    (unsigned long long) peak_membuffer_bytes);
+        stats.appendJson(s);
+        s += "}}";
+    }
+};
+} // namespace
+
+// process high-water mark in KiB, or 0 if unknown; this never goes down,
+// so it is the peak of everything that ran before, too
+static upx_uint64_t bench_peak_rss_kib() {
+#if (HAVE_SYS_RESOURCE_H) && defined(RUSAGE_SELF)
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#if defined(__APPLE__)
+        return (upx_uint64_t) ru.ru_maxrss / 1024; // bytes
+#else
+        return (upx_uint64_t) ru.ru_maxrss; // KiB
+#endif
+    }
+#endif
+    return 0;
+}
+
+// pack or unpack iname to oname; returns the name of the packer
+static const char *bench_e2e_run(int cmd, const char *iname, const char *oname, BenchE2EOp &op) {
+    opt->cmd = cmd;
+    InputFile fi;
+    fi.sopen(iname, O_RDONLY | O_BINARY, SH_DENYWR);
+    OutputFile fo;
+    fo.sopen(oname, O_CREAT | O_WRONLY | O_TRUNC | O_BINARY, SH_DENYWR, 0600);
+    MemBuffer::resetPeakStats();
+    const upx_uint64_t peak_before = MemBuffer::getStats().peak_active_bytes;
+    const char *name = nullptr;
+    const upx_uint64_t start = PhaseStats::wallClockNs();
+    opt->phase_stats = &op.stats;
+    try {
+        PackMaster pm(&fi, opt);
+        if (cmd == CMD_COMPRESS)
+            pm.pack(&fo);
+        else
+            pm.unpack(&fo);
+        fo.closex();
+        name = pm.getPackerName();
+    } catch (...) {
+        opt->phase_stats = nullptr;
+        throw;
+    }
+    opt->phase_stats = nullptr;
+    op.ns.push_back(PhaseStats::wallClockNs() - start);
+    op.peak_membuffer_bytes = UPX_MAX(op.peak_membuffer_bytes,
+                                      MemBuffer::getStats().peak_active_bytes - peak_before);
+    op.out_bytes = fo.getBytesWritten();
+    return name;
+}
+
+static void bench_unlink(const char *name) {
+    int r = unlink(name);
+    UNUSED(r);
+}
+
+static bool bench_same_file_contents(const char *a, const char *b) {
+    InputFile fa, fb;
+    fa.sopen(a, O_RDONLY | O_BINARY, SH_DENYWR);
+    fb.sopen(b, O_RDONLY | O_BINARY, SH_DENYWR);
+    const upx_off_t size = fa.st_size();
+    if (size != fb.st_size() || !mem_size_valid_bytes(size))
+        return false;
+    MemBuffer ma(size), mb(size);
+    fa.readx(ma, (int) size);
+    fb.readx(mb, (int) size);
+    return memcmp(ma, mb, (size_t) size) == 0;
+}
+
+static void bench_e2e_file(std::string &results, const BenchConfig &cfg, const char *iname) {
+    const char *dir = cfg.tmpdir ? cfg.tmpdir : ".";
+    const std::string packed = std::string(dir) + "/upx_bench.packed.tmp";
+    const std::string unpacked = std::string(dir) + "/upx_bench.unpacked.tmp";
+    Options saved_options;
+    memcpy(&saved_options, opt, sizeof(saved_options)); // struct copy
+    BenchE2EOp pack, unpack;
+    const char *format = nullptr;
+    upx_off_t bytes = 0;
+    bool roundtrip = false;
+    try {
+        InputFile fi;
+        fi.sopen(iname, O_RDONLY | O_BINARY, SH_DENYWR);
+        bytes = fi.st_size();
+        fi.closex();
+        for (unsigned r = 0; r < cfg.rounds; r++) {
+            format = bench_e2e_run(CMD_COMPRESS, iname, packed.c_str(), pack);
+            memcpy(opt, &saved_options, sizeof(saved_options));
+            (void) bench_e2e_run(CMD_DECOMPRESS, packed.c_str(), unpacked.c_str(), unpack);
+            memcpy(opt, &saved_options, sizeof(saved_options));
+        }
+        roundtrip = bench_same_file_contents(iname, unpacked.c_str());
+    } catch (const Throwable &e) {
+        memcpy(opt, &saved_options, sizeof(saved_options));
+        results += results.empty() ? "\n    {\"file\":" : ",\n    {\"file\":";
+        json_append_string(results, fn_basename(iname));
+        results += ",\"error\":";
+        json_append_string(results, e.getMsg());
+        results += '}';
+        fprintf(stderr, "%-40s %s\n", fn_basename(iname), e.getMsg());
+        bench_unlink(packed.c_str());
+        bench_unlink(unpacked.c_str());
+        return;
+    }
+    bench_unlink(packed.c_str());
+    bench_unlink(unpacked.c_str());
+
+    results += results.empty() ? "\n    {\"file\":" : ",\n    {\"file\":";
+    json_append_string(results, fn_basename(iname));
+    results += ",\"format\":";
+    json_append_string(results, format ? format : "");
+    json_append(results, ",\"bytes\":%llu,\"packed_bytes\":%llu,\"ratio\":%.4f,\"roundtrip\":%s",
+                (unsigned long long) bytes, (unsigned long long) pack.out_bytes,
+                bytes ? (double) pack.out_bytes / (double) bytes : 0, roundtrip ? "true" : "false");
+    results += ",\"pack\":";
+    pack.appendJson(results, bytes);
+    results += ",\"unpack\":";
+    unpack.appendJson(results, bytes);
+    json_append(results, ",\"peak_rss_kib\":%llu}", (unsigned long long) bench_peak_rss_kib());
+    fprintf(stderr, "%-40s %-16s pack %8.1f ms, unpack %8.1f ms, ratio %.4f\n",
+            fn_basename(iname), format ? format : "?", pack.ns[pack.ns.size() / 2] / 1e6,
+            unpack.ns[unpack.ns.size() / 2] / 1e6,
+            bytes ? (double) pack.out_bytes / (double) bytes : 0);
+}
+
+// upx_args are the options after "--", parsed like on the upx command line
+static int bench_e2e(const BenchConfig &cfg, const std::vector<const char *> &files,
+                     std::vector<char *> &upx_args) {
+    upx_args.push_back(nullptr);
+    const int n = main_get_options((int) upx_args.size() - 1, upx_args.data());
+    if (n != (int) upx_args.size() - 1) {
+        fprintf(stderr, "%s: unexpected argument after '--': %s\n", progname, upx_args[n]);
+        return EXIT_USAGE;
+    }
+    opt->verbose = 0;
+    opt->debug.disable_random_id = true;
+    if (opt->overlay < 0)
+        opt->overlay = opt->COPY_OVERLAY;
+    opt->backup = 0;
+    ThreadPool::setGlobalNumThreads(opt->threads);
+
+    std::string results;
+    for (const char *fn : files)
+        bench_e2e_file(results, cfg, fn);
+
+    printf("{\n  \"upx_bench_e2e\":1,\n  \"version\":\"%s\",\n", UPX_VERSION_STRING);
+    printf("  \"config\":{\"rounds\":%u,\"method\":%d,\"level\":%d,\"threads\":%d},\n",
+           cfg.rounds, opt->method, opt->level, opt->threads);
+    printf("  \"results\":[%s\n  ]\n}\n", results.c_str());
+    return 0;
+}
+
+/*************************************************************************
+// main
+**************************************************************************/
+
+static bool bench_getopt(const char *arg, const char *name, unsigned *value, unsigned lo,
+                         unsigned hi) {
+    const size_t n = strlen(name);
+    if (strncmp(arg, name, n) != 0 || arg[n] != '=')
+        return false;
+    char *end = nullptr;
+    const unsigned long v = strtoul(arg + n + 1, &end, 10);
+    if (end == arg + n + 1 || *end || v < lo || v > hi)
+        throwInternalError("upx_bench: bad option value");
+    *value = (unsigned) v;
+    return true;
+}
+
+static int bench_main(int argc, char *argv[]) {
+    opt->reset();
+    opt->verbose = 0;
+    assert(upx_lzma_init() == 0);
+#if (WITH_NRV)
+    assert(upx_nrv_init() == 0);
+#endif
+    assert(upx_ucl_init() == 0);
+    assert(upx_zlib_init() == 0);
+#if (WITH_ZSTD)
+    assert(upx_zstd_init() == 0);
+#endif
+
+    BenchConfig cfg;
+    std::vector<const char *> files;
+    std::vector<char *> upx_args;
+    upx_args.push_back(argv[0]);
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        unsigned kib = 0;
+        if (strcmp(arg, "--") == 0) {
+            for (i++; i < argc; i++)
+                upx_args.push_back(argv[i]);
+        } else if (strcmp(arg, "--e2e") == 0) {
+            cfg.e2e = true;
+        } else if (strncmp(arg, "--tmpdir=", 9) == 0) {
+            cfg.tmpdir = arg + 9;
+        } else if (strcmp(arg, "--quick") == 0) {
+            cfg.rounds = 3;
+            cfg.min_time_ms = 5;
+            cfg.size = 256 * 1024;
+        } else if (bench_getopt(arg, "--rounds", &cfg.rounds, 1, 1000) ||
+                   bench_getopt(arg, "--time", &cfg.min_time_ms, 1, 60000)) {
+        } else if (bench_getopt(arg, "--size", &kib, 4, 1024 * 1024)) {
+            cfg.size = kib * 1024;
+        } else if (strncmp(arg, "--match=", 8) == 0) {
+            cfg.match = arg + 8;
+        } else if (arg[0] == '-') {
+            fprintf(stderr,
+                    "usage: %s [--quick] [--rounds=N] [--time=MS] [--size=KiB] "
+                    "[--match=SUBSTRING] [FILE...]\n"
+                    "       %s --e2e [--rounds=N] [--tmpdir=DIR] [FILE...] [-- UPX-OPTION...]\n",
+                    argv[0], argv[0]);
+            return EXIT_USAGE;
+        } else
+            files.push_back(arg);
+    }
+    if (files.empty() && argv[0] && argv[0][0])
+        files.push_back(argv[0]);
+    if (cfg.e2e)
+        return bench_e2e(cfg, files, upx_args);
+
+    std::vector<BenchInput *> corpus;
+    static const struct {
+        const char *name;
+        void (*make)(BenchInput &);
+        bool code;
+    } synthetic[] = {
+        {"zeros", bench_make_zeros, false},
+        {"text", bench_make_text, false},
+        {"random", bench_make_random, false},
+        {"x86code", bench_make_x86code, true},
+    };
+    for (const auto &s : synthetic) {
+        BenchInput *in = new BenchInput;
+        in->name = s.name;
+        in->len = cfg.size;
+        in->data.alloc(in->len);
+        in->code = s.code;
+        s.make(*in);
+        corpus.push_back(in);
+    }
+    for (const char *fn : files)
+        bench_add_file(corpus, fn, cfg.size);
+
+    BenchRunner br(cfg);
+    static const int levels[] = {1, 6, 9};
+    for (const BenchInput *in : corpus)
+        for (const BenchMethod &m : bench_methods)
+            for (int level : levels)
+                bench_compress(br, *in, m, level);
+    for (const BenchInput *in : corpus)
+        if (in->code)
+            bench_filters(br, *in);
+    for (const BenchInput *in : corpus)
+        bench_adler32(br, *in);
+    bench_linker(br);
+
+    printf("{\n  \"upx_bench\":1,\n  \"version\":\"%s\",\n", UPX_VERSION_STRING);
+    printf("  \"config\":{\"rounds\":%u,\"min_time_ms\":%u,\"size\":%u},\n", cfg.rounds,
+           cfg.min_time_ms, cfg.size);
+    std::string corpus_json;
+    for (size_t i = 0; i < corpus.size(); i++) {
+        corpus_json += i ? ",\n    {\"name\":" : "\n    {\"name\":";
+        json_append_string(corpus_json, corpus[i]->name.c_str());
+        json_append(corpus_json, ",\"bytes\":%u,\"adler32\":%u}", corpus[i]->len,
+                    upx_adler32(corpus[i]->data, corpus[i]->len, 1));
+    }
+    printf("  \"corpus\":[%s\n  ],\n", corpus_json.c_str());
+    printf("  \"results\":[%s\n  ]\n}\n", br.getResults().c_str());
+
+    for (BenchInput *in : corpus)
+        delete in;
+    return 0;
+}
+
+int upx_bench_main(int argc, char *argv[]) {
+    progname = "upx_bench";
+    upx_compiler_sanity_check();
+    try {
+        return bench_main(argc, argv);
+    } catch (const Throwable &e) {
+        fprintf(stderr, "%s: %s\n", progname, e.getMsg());
+    } catch (const std::bad_alloc &) {
+        fprintf(stderr, "%s: out of memory\n", progname);
+    }
+    return EXIT_ERROR;
+}
+
+/* vim:set ts=4 sw=4 et: */
@@ -0,0 +1,284 @@
+/* compress_cache.cpp --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#include "../conf.h"
+#include "compress_cache.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*************************************************************************
+// CacheKeyBuilder
+**************************************************************************/
+
+static const upx_uint64_t K0 = 0x9e3779b97f4a7c15ULL;
+static const upx_uint64_t K1 = 0xc2b2ae3d27d4eb4fULL;
+static const upx_uint64_t K2 = 0x165667b19e3779f9ULL;
+
+static forceinline upx_uint64_t rotl64(upx_uint64_t x, unsigned r) noexcept {
+    return (x << r) | (x >> (64 - r));
+}
+
+// final avalanche, see MurmurHash3
+static upx_uint64_t fmix64(upx_uint64_t k) noexcept {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+CacheKeyBuilder::CacheKeyBuilder() noexcept : h0(K0), h1(K1) {}
+
+void CacheKeyBuilder::add(const void *p, size_t len) noexcept {
+    const byte *b = (const byte *) p;
+    upx_uint64_t a0 = h0 ^ (len * K2);
+    upx_uint64_t a1 = h1 + len;
+    // two independent lanes, so that the multiplications can overlap
+    for (; len >= 8; b += 8, len -= 8) {
+        const upx_uint64_t w = get_le64(b);
+        a0 = rotl64(a0 ^ w, 29) * K0;
+        a1 = rotl64(a1 ^ (w * K2), 31) * K1;
+    }
+    if (len > 0) {
+        byte tail[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        memcpy(tail, b, len);
+        const upx_uint64_t w = get_le64(tail);
+        a0 = rotl64(a0 ^ w, 29) * K0;
+        a1 = rotl64(a1 ^ (w * K2), 31) * K1;
+    }
+    h0 = a0;
+    h1 = a1;
+}
+
+void CacheKeyBuilder::add(upx_uint64_t v) noexcept {
+    byte b[8];
+    set_le64(b, v);
+    add(b, sizeof(b));
+}
+
+CacheKey CacheKeyBuilder::get() const noexcept {
+    CacheKey key;
+    key.h[0] = fmix64(h0 ^ rotl64(h1, 17));
+    key.h[1] = fmix64(h1 + h0 * K2);
+    return key;
+}
+
+/*************************************************************************
+// entries
+**************************************************************************/
+
+namespace {
+struct CacheEntryHeader {
+    byte magic[4];
+    LE32 version;
+    LE32 len;
+    LE32 adler;
+};
+} // namespace
+
+static const byte cache_magic[4] = {'U', 'P', 'X', 'c'};
+static const unsigned cache_version = 1;
+
+// "<dir>/<32 hex digits>" plus room for a suffix
+static bool cache_filename(char *fn, size_t fn_size, const CacheKey &key) noexcept {
+    const char *dir = opt->cache_dir;
+    if (dir == nullptr || !dir[0])
+        return false;
+    size_t dlen = strlen(dir);
+    if (dlen + 1 + 32 + 32 >= fn_size)
+        return false;
+    memcpy(fn, dir, dlen);
+    if (fn[dlen - 1] != '/' && fn[dlen - 1] != '\\')
+        fn[dlen++] = '/';
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned i = 0; i < 32; i++) {
+        const upx_uint64_t h = key.h[i >> 4];
+        fn[dlen++] = hex[(h >> (60 - 4 * (i & 15))) & 15];
+    }
+    fn[dlen] = 0;
+    return true;
+}
+
+bool cache_load(const CacheKey &key, MemBuffer &data) {
+    char fn[ACC_FN_PATH_MAX + 1];
+    if (!cache_filename(fn, sizeof(fn), key))
+        return false;
+    FILE *f = fopen(fn, "rb");
+    if (f == nullptr)
+        return false; // miss
+    bool ok = false;
+    CacheEntryHeader h;
+    if (fread(&h, 1, sizeof(h), f) == sizeof(h) && memcmp(h.magic, cache_magic, 4) == 0 &&
+        h.version == cache_version && h.len > 0 && h.len <= UPX_RSIZE_MAX_MEM) {
+        data.alloc(h.len);
+        ok = fread(data.getVoidPtr(), 1, h.len, f) == h.len && fgetc(f) == EOF &&
+             upx_adler32(data, h.len) == h.adler;
+    }
+    fclose(f);
+    if (!ok) {
+        // damaged entry, perhaps from an older version
+        data.dealloc();
+        (void) ::unlink(fn);
+        return false;
+    }
+#if (HAVE_UTIME)
+    // mark as recently used for cache_evict()
+    int r = utime(fn, nullptr);
+    UNUSED(r);
+#endif
+    return true;
+}
+
+void cache_store(const CacheKey &key, const void *data, unsigned len) noexcept {
+    char fn[ACC_FN_PATH_MAX + 1];
+    if (!cache_filename(fn, sizeof(fn), key) || len == 0)
+        return;
+    // write to a unique temporary file, then atomically rename it
+    static upx_std_atomic(unsigned) tmp_counter;
+    unsigned tmp_id = tmp_counter++;
+#if (HAVE_GETPID)
+    tmp_id ^= (unsigned) getpid() << 12;
+#endif
+    char tmp[ACC_FN_PATH_MAX + 1];
+    const size_t fn_len = strlen(fn);
+    memcpy(tmp, fn, fn_len);
+    static const char hex[] = "0123456789abcdef";
+    char *t = tmp + fn_len;
+    *t++ = '.';
+    for (int shift = 28; shift >= 0; shift -= 4)
+        *t++ = hex[(tmp_id >> shift) & 15];
+    memcpy(t, ".tmp", 5);
+
+    FILE *f = fopen(tmp, "wb");
+    if (f == nullptr)
+        return; // note: the cache directory is not created
+    CacheEntryHeader h;
+    memcpy(h.magic, cache_magic, 4);
+    h.version = cache_version;
+    h.len = len;
+    h.adler = upx_adler32(data, len);
+    bool ok = fwrite(&h, 1, sizeof(h), f) == sizeof(h) && fwrite(data, 1, len, f) == len;
+    ok = (fclose(f) == 0) && ok;
+    // note: rename() fails on Windows if another run stored the same entry
+    if (!ok || ::rename(tmp, fn) != 0)
+        (void) ::unlink(tmp);
+}
+
+void cache_remove(const CacheKey &key) noexcept {
+    char fn[ACC_FN_PATH_MAX + 1];
+    if (cache_filename(fn, sizeof(fn), key))
+        (void) ::unlink(fn);
+}
+
+void cache_evict() noexcept {
+#if (HAVE_DIRENT_H)
+    const char *dir = opt->cache_dir;
+    if (dir == nullptr || !dir[0])
+        return;
+    struct Entry {
+        time_t mtime;
+        upx_uint64_t size;
+        std::string name;
+    };
+    DIR *d = opendir(dir);
+    if (d == nullptr)
+        return;
+    try {
+        std::vector<Entry> entries;
+        upx_uint64_t total = 0;
+        const time_t now = time(nullptr);
+        for (const struct dirent *de = readdir(d); de != nullptr; de = readdir(d)) {
+            // "<32 hex digits>" or "<32 hex digits>.<8 hex digits>.tmp"
+            const size_t nlen = strlen(de->d_name);
+            if (strspn(de->d_name, "0123456789abcdef") != 32 || (nlen != 32 && nlen != 45))
+                continue; // not ours
+            const bool is_tmp = nlen == 45;
+            std::string path(dir);
+            path += '/';
+            path += de->d_name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            if (is_tmp) {
+                // left behind by an interrupted run
+                if (st.st_mtime + 24 * 3600 < now)
+                    (void) ::unlink(path.c_str());
+                continue;
+            }
+            entries.push_back(Entry{st.st_mtime, (upx_uint64_t) st.st_size, path});
+            total += st.st_size;
+        }
+        closedir(d);
+        d = nullptr;
+        const upx_uint64_t limit = (upx_uint64_t) opt->cache_size << 20;
+        if (total <= limit)
+            return;
+        // remove the least recently used entries
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+        for (const Entry &e : entries) {
+            if (total <= limit)
+                break;
+            if (::unlink(e.name.c_str()) == 0)
+                total -= e.size;
+        }
+    } catch (...) {
+        // eviction is only housekeeping
+    }
+    if (d != nullptr)
+        closedir(d);
+#endif
+}
+
+/*************************************************************************
+// doctest checks
+**************************************************************************/
+
+TEST_CASE("CacheKeyBuilder") {
+    static const char data[] = "0123456789abcdefghij";
+    CacheKeyBuilder a, b, c;
+    a.add(data, 20);
+    b.add(data, 20);
+    c.add(data, 19);
+    CHECK(a.get().h[0] == b.get().h[0]);
+    CHECK(a.get().h[1] == b.get().h[1]);
+    CHECK(a.get().h[0] != c.get().h[0]);
+    a.add(upx_uint64_t(1));
+    b.add(upx_uint64_t(2));
+    CHECK(a.get().h[0] != b.get().h[0]);
+    CHECK(a.get().h[1] != b.get().h[1]);
+    // a split of the data is part of the key
+    CacheKeyBuilder d, e;
+    d.add(data, 8);
+    d.add(data + 8, 12);
+    e.add(data, 20);
+    CHECK(d.get().h[0] != e.get().h[0]);
+}
+
+/* vim:set ts=4 sw=4 et: */
@@ -0,0 +1,78 @@
+/* compress_cache.h --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#pragma once
+#ifndef UPX_COMPRESS_CACHE_H__
+#define UPX_COMPRESS_CACHE_H__ 1
+
+#include "membuffer.h"
+
+/*************************************************************************
+// On-disk cache of compression results, see option "--cache-dir".
+//
+// Each entry is one file in opt->cache_dir; its name is the hex string
+// of a 128-bit key that the caller computes from everything that
+// influences the result (input data, methods, filters, level, options
+// and the UPX version). Entries are written to a temporary file and
+// then renamed, so concurrent runs never see a partial entry. On a hit
+// the time stamp of the entry is updated, and cache_evict() removes
+// the least recently used entries once the directory grows beyond
+// opt->cache_size MiB.
+//
+// The key is a fast non-cryptographic hash, so callers must verify a hit
+// by decompressing it before using it; still, do not share a cache
+// directory with untrusted users.
+**************************************************************************/
+
+struct CacheKey final {
+    upx_uint64_t h[2];
+};
+
+class CacheKeyBuilder final {
+public:
+    CacheKeyBuilder() noexcept;
+    void add(const void *p, size_t len) noexcept;
+    void add(upx_uint64_t v) noexcept;
+    void add(const char *s) noexcept { add(s, s ? strlen(s) + 1 : 0); }
+    CacheKey get() const noexcept;
+
+private:
+    upx_uint64_t h0, h1;
+};
+
+// return false on a miss or on a damaged entry
+bool cache_load(const CacheKey &key, MemBuffer &data);
+// errors are silently ignored
+void cache_store(const CacheKey &key, const void *data, unsigned len) noexcept;
+// remove an entry that failed the verification by the caller
+void cache_remove(const CacheKey &key) noexcept;
+// trim the cache directory to opt->cache_size MiB
+void cache_evict() noexcept;
+
+#endif /* already included */
+
+/* vim:set ts=4 sw=4 et: */
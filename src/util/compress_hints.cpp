@@ -0,0 +1,182 @@
+/* compress_hints.cpp --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#include "../conf.h"
+#include "compress_hints.h"
+#include <map>
+#include <utility>
+
+/*************************************************************************
+// text format, one hint per line:
+//   <32 hex digits key> <method> <filter> <u_len> <c_len>
+**************************************************************************/
+
+static const char hints_header[] = "# UPX compression hints, see option \"--hints-file\"\n";
+
+static bool hints_parse_line(const char *line, CacheKey &key, CompressHint &hint) {
+    unsigned long long k0, k1;
+    unsigned method, filter, u_len, c_len;
+    char end;
+    if (sscanf(line, "%16llx%16llx %x %x %u %u%c", &k0, &k1, &method, &filter, &u_len, &c_len,
+               &end) != 7 ||
+        end != '\n')
+        return false;
+    if (u_len == 0 || c_len == 0 || filter > 0xff)
+        return false;
+    key.h[0] = k0;
+    key.h[1] = k1;
+    hint.method = (int) method;
+    hint.filter = (int) filter;
+    hint.u_len = u_len;
+    hint.c_len = c_len;
+    return true;
+}
+
+static void hints_format_line(char *buf, size_t size, const CacheKey &key,
+                              const CompressHint &hint) {
+    snprintf(buf, size, "%016llx%016llx %#x %#x %u %u\n", (unsigned long long) key.h[0],
+             (unsigned long long) key.h[1], (unsigned) hint.method, (unsigned) hint.filter,
+             hint.u_len, hint.c_len);
+}
+
+/*************************************************************************
+// the in-memory copy of the hints file
+**************************************************************************/
+
+namespace {
+struct HintsDb final {
+#if (WITH_THREADS)
+    std::mutex mutex;
+#endif
+    bool loaded = false;
+    bool dirty = false;
+    std::map<std::pair<upx_uint64_t, upx_uint64_t>, CompressHint> hints;
+};
+} // namespace
+
+static HintsDb hints_db;
+
+static void hints_load_locked() {
+    if (hints_db.loaded)
+        return;
+    hints_db.loaded = true;
+    FILE *f = fopen(opt->hints_file, "rt");
+    if (f == nullptr)
+        return; // not yet created
+    char line[256];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        CacheKey key;
+        CompressHint hint;
+        if (line[0] != '#' && hints_parse_line(line, key, hint))
+            hints_db.hints[std::make_pair(key.h[0], key.h[1])] = hint;
+    }
+    fclose(f);
+}
+
+bool hints_lookup(const CacheKey &key, CompressHint &hint) {
+#if (WITH_THREADS)
+    std::lock_guard<std::mutex> lock(hints_db.mutex);
+#endif
+    hints_load_locked();
+    auto it = hints_db.hints.find(std::make_pair(key.h[0], key.h[1]));
+    if (it == hints_db.hints.end())
+        return false;
+    hint = it->second;
+    return true;
+}
+
+void hints_update(const CacheKey &key, const CompressHint &hint) {
+#if (WITH_THREADS)
+    std::lock_guard<std::mutex> lock(hints_db.mutex);
+#endif
+    hints_load_locked();
+    CompressHint &h = hints_db.hints[std::make_pair(key.h[0], key.h[1])];
+    if (h.method != hint.method || h.filter != hint.filter || h.u_len != hint.u_len ||
+        h.c_len != hint.c_len) {
+        h = hint;
+        hints_db.dirty = true;
+    }
+}
+
+void hints_save() noexcept {
+#if (WITH_THREADS)
+    std::lock_guard<std::mutex> lock(hints_db.mutex);
+#endif
+    if (!hints_db.dirty || opt->hints_file == nullptr)
+        return;
+    hints_db.dirty = false;
+    // write to a temporary file, then atomically rename it
+    char tmp[ACC_FN_PATH_MAX + 1];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", opt->hints_file) >= (int) sizeof(tmp))
+        return;
+    FILE *f = fopen(tmp, "wt");
+    if (f == nullptr)
+        return;
+    bool ok = fputs(hints_header, f) >= 0;
+    for (const auto &e : hints_db.hints) {
+        CacheKey key;
+        key.h[0] = e.first.first;
+        key.h[1] = e.first.second;
+        char line[256];
+        hints_format_line(line, sizeof(line), key, e.second);
+        ok = ok && fputs(line, f) >= 0;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (ok && ::rename(tmp, opt->hints_file) != 0) {
+        // rename() does not replace an existing file on Windows
+        (void) ::unlink(opt->hints_file);
+        ok = ::rename(tmp, opt->hints_file) == 0;
+    }
+    if (!ok)
+        (void) ::unlink(tmp);
+}
+
+/*************************************************************************
+// doctest checks
+**************************************************************************/
+
+TEST_CASE("hints_parse_line") {
+    CacheKey key = {{0x0123456789abcdefULL, 0xfedcba9876543210ULL}};
+    CompressHint hint = {M_LZMA | 0x40700, 0x49, 100000, 41234};
+    char line[256];
+    hints_format_line(line, sizeof(line), key, hint);
+    CacheKey k = {};
+    CompressHint h = {};
+    CHECK(hints_parse_line(line, k, h));
+    CHECK(k.h[0] == key.h[0]);
+    CHECK(k.h[1] == key.h[1]);
+    CHECK(h.method == hint.method);
+    CHECK(h.filter == 0x49);
+    CHECK(h.u_len == 100000);
+    CHECK(h.c_len == 41234);
+    CHECK(!hints_parse_line(hints_header, k, h));
+    CHECK(!hints_parse_line("0123 0x2 0 1 1\n", k, h));
+    line[strlen(line) - 1] = 0; // truncated line
+    CHECK(!hints_parse_line(line, k, h));
+}
+
+/* vim:set ts=4 sw=4 et: */
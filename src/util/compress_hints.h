@@ -0,0 +1,59 @@
+/* compress_hints.h --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#pragma once
+#ifndef UPX_COMPRESS_HINTS_H__
+#define UPX_COMPRESS_HINTS_H__ 1
+
+#include "compress_cache.h"
+
+/*************************************************************************
+// Remembered winners of the method/filter search, see option "--hints-file".
+//
+// Unlike the cache the key does not include the input data, but only
+// where the data comes from (file name, format, the n-th call of
+// compressWithFilters() and the candidate methods and filters), so that
+// a hint still applies to the next version of a file. The hints file is
+// a small text file that is read on first use and rewritten by
+// hints_save() at the end of the run.
+**************************************************************************/
+
+struct CompressHint final {
+    int method; // includes the LZMA pb/lp/lc parameters, see M_LZMA_003
+    int filter;
+    unsigned u_len;
+    unsigned c_len;
+};
+
+bool hints_lookup(const CacheKey &key, CompressHint &hint);
+void hints_update(const CacheKey &key, const CompressHint &hint);
+// write the hints file if anything has changed; errors are silently ignored
+void hints_save() noexcept;
+
+#endif /* already included */
+
+/* vim:set ts=4 sw=4 et: */
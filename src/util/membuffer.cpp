@@ -40,6 +40,11 @@ unsigned membuffer_get_size(MemBuffer &mb) { return mb.getSize(); }
 #define debug_set(var, expr) /*empty*/
 #endif
 
+#if (HAVE_MMAP) && (HAVE_MUNMAP) && (HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define USE_MMAP 1
+#endif
+
 /*************************************************************************
 // bool use_simple_mcheck()
 **************************************************************************/
@@ -65,6 +70,169 @@ static bool use_simple_mcheck() {
 static forceinline constexpr bool use_simple_mcheck() { return true; }
 #endif
 
+/*************************************************************************
+// size-class pool
+//
+// While packing, scratch buffers of the same few sizes get allocated and
+// freed over and over again (per filter/method trial, per block, per
+// overlap probe). So freed blocks are kept in a small process-wide cache,
+// indexed by size class, and handed out again for the next request of
+// the same class. The cache is bounded by pool_max_cached (see
+// setPoolLimit() and option "--memory-budget") and is emptied by
+// releasePool() after each file, so the idle worker threads of the
+// ThreadPool do not keep any memory alive.
+//
+// There are four size classes per power of two, so the slack is at most
+// 25%. The simple_mcheck magic is still placed relative to the requested
+// size, so all bounds checks work exactly as before.
+//
+// The pool is only used together with use_simple_mcheck(), i.e. it is
+// disabled under valgrind and ASAN so that these still can detect
+// use-after-free errors.
+**************************************************************************/
+
+static unsigned width(unsigned x);
+
+namespace {
+
+enum {
+    POOL_MIN_BYTES = 4096,                      // smallest size class
+    POOL_MAX_BYTES = 2 * 1024 * 1024,           // larger blocks are not pooled
+    POOL_NCLASSES = 1 + 4 * (21 - 12),          // 21 == log2(POOL_MAX_BYTES)
+    POOL_SLOTS = 2,                             // cached blocks per size class
+    POOL_DEFAULT_MAX_CACHED = 16 * 1024 * 1024, // process-wide
+};
+
+// trivially destructible, so it can be used until the very end of the process
+struct MemPool {
+    void *blocks[POOL_NCLASSES][POOL_SLOTS];
+    unsigned nblocks[POOL_NCLASSES];
+    size_t cached_bytes;
+    size_t max_cached;
+    bool disabled; // set at process exit
+};
+MemPool mem_pool = {{}, {}, 0, POOL_DEFAULT_MAX_CACHED, false};
+#if (WITH_THREADS)
+std::mutex mem_pool_mutex;
+#define POOL_LOCK() std::lock_guard<std::mutex> pool_lock(mem_pool_mutex)
+#else
+#define POOL_LOCK() /*empty*/
+#endif
+
+// return the size class of a block of n bytes and the rounded-up size, or -1
+int pool_class(size_t n, size_t *class_bytes) {
+    if (n <= POOL_MIN_BYTES) {
+        *class_bytes = POOL_MIN_BYTES;
+        return 0;
+    }
+    if (n > POOL_MAX_BYTES)
+        return -1;
+    const unsigned k = width((unsigned) (n - 1)); // 2**(k-1) < n <= 2**k
+    const size_t base = size_t(1) << (k - 1);
+    const size_t step = base >> 2;
+    const size_t j = (n - base + step - 1) / step; // 1..4
+    *class_bytes = base + j * step;
+    return 1 + 4 * (k - 13) + (int) (j - 1);
+}
+
+struct MemPoolCleanup {
+    ~MemPoolCleanup() noexcept {
+        MemBuffer::releasePool();
+        POOL_LOCK();
+        mem_pool.disabled = true;
+    }
+};
+MemPoolCleanup mem_pool_cleanup;
+
+} // namespace
+
+// get a block of at least *bytes bytes; updates *bytes to the block size
+void *MemBuffer::poolAlloc(size_t *bytes) {
+    size_t class_bytes;
+    const int c = pool_class(*bytes, &class_bytes);
+    if (c < 0)
+        return ::malloc(*bytes);
+    *bytes = class_bytes;
+    {
+        POOL_LOCK();
+        MemPool &pool = mem_pool;
+        if (pool.nblocks[c] > 0) {
+            stats.global_pool_hit_counter += 1;
+            pool.cached_bytes -= class_bytes;
+            stats.global_pool_cached_bytes -= class_bytes;
+            return pool.blocks[c][--pool.nblocks[c]];
+        }
+    }
+    stats.global_pool_miss_counter += 1;
+    return ::malloc(class_bytes);
+}
+
+// return a block that was allocated by poolAlloc() with the same *bytes
+void MemBuffer::poolFree(void *p, size_t bytes) noexcept {
+    size_t class_bytes;
+    const int c = pool_class(bytes, &class_bytes);
+    if (c >= 0) {
+        POOL_LOCK();
+        MemPool &pool = mem_pool;
+        if (!pool.disabled && pool.nblocks[c] < POOL_SLOTS &&
+            pool.cached_bytes + class_bytes <= pool.max_cached) {
+            pool.blocks[c][pool.nblocks[c]++] = p;
+            pool.cached_bytes += class_bytes;
+            stats.global_pool_cached_bytes += class_bytes;
+            return;
+        }
+    }
+    ::free(p);
+}
+
+// free all cached blocks
+/*static*/ void MemBuffer::releasePool() noexcept {
+    POOL_LOCK();
+    MemPool &pool = mem_pool;
+    for (int c = 0; c < POOL_NCLASSES; c++) {
+        while (pool.nblocks[c] > 0)
+            ::free(pool.blocks[c][--pool.nblocks[c]]);
+    }
+    stats.global_pool_cached_bytes -= pool.cached_bytes;
+    pool.cached_bytes = 0;
+}
+
+// limit the bytes held by the pool; 0 restores the default
+/*static*/ void MemBuffer::setPoolLimit(size_t bytes) noexcept {
+    releasePool();
+    POOL_LOCK();
+    mem_pool.max_cached = bytes ? bytes : size_t(POOL_DEFAULT_MAX_CACHED);
+}
+
+/*static*/ MemBuffer::StatsInfo MemBuffer::getStats() noexcept {
+    StatsInfo info;
+    info.alloc_counter = stats.global_alloc_counter;
+    info.dealloc_counter = stats.global_dealloc_counter;
+    info.total_bytes = stats.global_total_bytes;
+    info.total_active_bytes = stats.global_total_active_bytes;
+    info.peak_active_bytes = stats.global_peak_active_bytes;
+    info.pool_hit_counter = stats.global_pool_hit_counter;
+    info.pool_miss_counter = stats.global_pool_miss_counter;
+    info.pool_cached_bytes = stats.global_pool_cached_bytes;
+    return info;
+}
+
+/*static*/ void MemBuffer::resetPeakStats() noexcept {
+    stats.global_peak_active_bytes = (upx_uint64_t) stats.global_total_active_bytes;
+}
+
+/*static*/ void MemBuffer::addActiveBytes(upx_uint64_t bytes) noexcept {
+    const upx_uint64_t now = (stats.global_total_active_bytes += bytes);
+#if (WITH_THREADS)
+    upx_uint64_t peak = stats.global_peak_active_bytes;
+    while (now > peak && !stats.global_peak_active_bytes.compare_exchange_weak(peak, now)) {
+    }
+#else
+    if (now > stats.global_peak_active_bytes)
+        stats.global_peak_active_bytes = now;
+#endif
+}
+
 /*************************************************************************
 //
 **************************************************************************/
@@ -180,7 +348,7 @@ void MemBuffer::checkState() const {
     if (!ptr)
         throwInternalError("block not allocated");
     assert(size_in_bytes > 0);
-    if (use_simple_mcheck()) {
+    if (use_simple_mcheck() && !is_mapped) {
         const byte *p = (const byte *) ptr;
         if (get_ne32(p - 4) != MAGIC1(p))
             throwInternalError("memory clobbered before allocated block 1");
@@ -199,9 +367,12 @@ void MemBuffer::alloc(upx_uint64_t bytes) {
     assert(bytes > 0);
     debug_set(debug.last_return_address_alloc, upx_return_address());
     size_t malloc_bytes = mem_size(1, bytes);
-    if (use_simple_mcheck())
+    byte *p;
+    if (use_simple_mcheck()) {
         malloc_bytes += 32;
-    byte *p = (byte *) ::malloc(malloc_bytes);
+        p = (byte *) poolAlloc(&malloc_bytes);
+    } else
+        p = (byte *) ::malloc(malloc_bytes);
     NO_printf("MemBuffer::alloc %llu: %p\n", bytes, p);
     if (!p)
         throwOutOfMemoryException();
@@ -221,19 +392,57 @@ void MemBuffer::alloc(upx_uint64_t bytes) {
 #endif
     stats.global_alloc_counter += 1;
     stats.global_total_bytes += size_in_bytes;
-    stats.global_total_active_bytes += size_in_bytes;
+    addActiveBytes(size_in_bytes);
 #if DEBUG || 1
     checkState();
 #endif
 }
 
+bool MemBuffer::allocMapped(int fd, upx_uint64_t offset, upx_uint64_t bytes) {
+    assert(ptr == nullptr);
+    assert(size_in_bytes == 0);
+    //
+    assert(bytes > 0);
+#if (USE_MMAP)
+    debug_set(debug.last_return_address_alloc, upx_return_address());
+    const size_t len = mem_size(1, bytes); // check size
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0)
+        return false;
+    const unsigned delta = (unsigned) (offset % (upx_uint64_t) page_size);
+    void *p = ::mmap(nullptr, delta + len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                     (off_t) (offset - delta));
+    NO_printf("MemBuffer::allocMapped %llu: %p\n", bytes, p);
+    if (p == MAP_FAILED)
+        return false;
+    size_in_bytes = ACC_ICONV(unsigned, bytes);
+    ptr = (pointer) p + delta;
+    is_mapped = true;
+    map_delta = delta;
+    stats.global_alloc_counter += 1;
+    stats.global_total_bytes += size_in_bytes;
+    addActiveBytes(size_in_bytes);
+    return true;
+#else
+    UNUSED(fd);
+    UNUSED(offset);
+    return false;
+#endif
+}
+
 void MemBuffer::dealloc() noexcept {
     if (ptr != nullptr) {
         debug_set(debug.last_return_address_dealloc, upx_return_address());
         checkState();
         stats.global_dealloc_counter += 1;
         stats.global_total_active_bytes -= size_in_bytes;
-        if (use_simple_mcheck()) {
+        if (is_mapped) {
+#if (USE_MMAP)
+            (void) ::munmap(ptr - map_delta, map_delta + size_in_bytes);
+#endif
+            is_mapped = false;
+            map_delta = 0;
+        } else if (use_simple_mcheck()) {
             byte *p = (byte *) ptr;
             // clear magic constants
             set_ne32(p - 8, 0);
@@ -241,7 +450,7 @@ void MemBuffer::dealloc() noexcept {
             set_ne32(p + size_in_bytes, 0);
             set_ne32(p + size_in_bytes + 4, 0);
             //
-            ::free(p - 16);
+            poolFree(p - 16, size_in_bytes + 32);
         } else {
             ::free(ptr);
         }
@@ -293,6 +502,88 @@ TEST_CASE("MemBuffer unused") {
     CHECK(mb.raw_size_in_bytes() == 0);
 }
 
+TEST_CASE("MemBuffer::allocMapped") {
+    FILE *f = tmpfile();
+    if (f == nullptr)
+        return;
+    byte data[256];
+    for (unsigned i = 0; i < 256; i++)
+        data[i] = (byte) i;
+    CHECK(fwrite(data, 1, sizeof(data), f) == sizeof(data));
+    fflush(f);
+    MemBuffer mb;
+    if (mb.allocMapped(fileno(f), 16, 128)) {
+        CHECK(mb.isMapped());
+        CHECK(mb.getSize() == 128);
+        mb.checkState();
+        CHECK(memcmp(mb, data + 16, 128) == 0);
+        CHECK_THROWS(mb + 129);
+        // copy-on-write: the file must not change
+        mb.clear();
+        mb.dealloc();
+        CHECK(!mb.isMapped());
+        byte buf[256];
+        rewind(f);
+        CHECK(fread(buf, 1, sizeof(buf), f) == sizeof(buf));
+        CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    }
+    fclose(f);
+}
+
+TEST_CASE("MemBuffer pool") {
+    size_t bytes = 0;
+    CHECK(pool_class(1, &bytes) == 0);
+    CHECK(bytes == 4096);
+    CHECK(pool_class(4097, &bytes) == 1);
+    CHECK(bytes == 5120);
+    CHECK(pool_class(8192, &bytes) == 4);
+    CHECK(bytes == 8192);
+    CHECK(pool_class(8193, &bytes) == 5);
+    CHECK(bytes == 10240);
+    CHECK(pool_class(POOL_MAX_BYTES, &bytes) == POOL_NCLASSES - 1);
+    CHECK(bytes == POOL_MAX_BYTES);
+    CHECK(pool_class(POOL_MAX_BYTES + 1, &bytes) < 0);
+    if (!use_simple_mcheck())
+        return;
+    MemBuffer::releasePool();
+    MemBuffer mb(10000);
+    const byte *p = mb;
+    mb.dealloc();
+    const MemBuffer::StatsInfo s1 = MemBuffer::getStats();
+    CHECK(s1.pool_cached_bytes >= 10240);
+    // same size class: must reuse the block, with exact bounds checks
+    mb.alloc(9000);
+    const MemBuffer::StatsInfo s2 = MemBuffer::getStats();
+    CHECK(s2.pool_hit_counter == s1.pool_hit_counter + 1);
+    CHECK(raw_bytes(mb, 0) == p);
+    CHECK(mb.getSize() == 9000);
+    CHECK_NOTHROW(mb + 9000);
+    CHECK_THROWS(mb + 9001);
+    mb.checkState();
+    mb.dealloc();
+    MemBuffer::releasePool();
+    CHECK(MemBuffer::getStats().pool_cached_bytes == 0);
+    // the limit is process-wide
+    MemBuffer::setPoolLimit(8192);
+    mb.alloc(10000);
+    mb.dealloc();
+    CHECK(MemBuffer::getStats().pool_cached_bytes == 0);
+    MemBuffer::setPoolLimit(0);
+}
+
+TEST_CASE("MemBuffer::resetPeakStats") {
+    MemBuffer::resetPeakStats();
+    const upx_uint64_t base = MemBuffer::getStats().total_active_bytes;
+    {
+        MemBuffer a(4096);
+        MemBuffer b(8192);
+    }
+    MemBuffer c(1024);
+    const MemBuffer::StatsInfo s = MemBuffer::getStats();
+    CHECK(s.total_active_bytes == base + 1024);
+    CHECK(s.peak_active_bytes == base + 4096 + 8192);
+}
+
 TEST_CASE("MemBuffer::getSizeForCompression") {
     CHECK_THROWS(MemBuffer::getSizeForCompression(0));
     CHECK_THROWS(MemBuffer::getSizeForDecompression(0));
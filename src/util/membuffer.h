@@ -94,9 +94,18 @@ public:
     void allocForCompression(unsigned uncompressed_size, unsigned extra = 0);
     void allocForDecompression(unsigned uncompressed_size, unsigned extra = 0);
 
+    // Map [offset, offset + bytes) of the file fd privately (copy-on-write):
+    // reading is zero-copy, and pages only get copied when modified; the
+    // file itself is never changed. Returns false if mapping is not possible.
+    // NOTE: if another process truncates the file while it is mapped, then
+    // touching an unmodified page past the new end raises SIGBUS; so only
+    // use this for input files, which are not expected to change.
+    bool allocMapped(int fd, upx_uint64_t offset, upx_uint64_t bytes);
+
     void dealloc() noexcept;
     void checkState() const;
     unsigned getSize() const { return size_in_bytes; }
+    bool isMapped() const { return is_mapped; }
 
     // explicit conversion
     void *getVoidPtr() { return (void *) ptr; }
@@ -115,8 +124,26 @@ public:
         return (pointer) subref_impl(errfmt, skip, take);
     }
 
+    // snapshot of the global stats
+    struct StatsInfo {
+        upx_uint32_t alloc_counter;
+        upx_uint32_t dealloc_counter;
+        upx_uint64_t total_bytes;
+        upx_uint64_t total_active_bytes;
+        upx_uint64_t peak_active_bytes; // high-water mark since resetPeakStats()
+        upx_uint32_t pool_hit_counter;  // allocations served from the pool
+        upx_uint32_t pool_miss_counter; // poolable allocations that went to malloc
+        upx_uint64_t pool_cached_bytes; // currently held by the pool
+    };
+    static StatsInfo getStats() noexcept;
+    static void resetPeakStats() noexcept;
+    static void releasePool() noexcept;               // free all blocks cached by the pool
+    static void setPoolLimit(size_t bytes) noexcept; // 0 means the default
+
 private:
     void *subref_impl(const char *errfmt, size_t skip, size_t take);
+    static void *poolAlloc(size_t *bytes);
+    static void poolFree(void *p, size_t bytes) noexcept;
 
     // static debug stats
     struct Stats {
@@ -124,8 +151,16 @@ private:
         upx_std_atomic(upx_uint32_t) global_dealloc_counter;
         upx_std_atomic(upx_uint64_t) global_total_bytes;
         upx_std_atomic(upx_uint64_t) global_total_active_bytes;
+        upx_std_atomic(upx_uint64_t) global_peak_active_bytes;
+        upx_std_atomic(upx_uint32_t) global_pool_hit_counter;
+        upx_std_atomic(upx_uint32_t) global_pool_miss_counter;
+        upx_std_atomic(upx_uint64_t) global_pool_cached_bytes;
     };
     static Stats stats;
+    static void addActiveBytes(upx_uint64_t bytes) noexcept;
+    // set by allocMapped()
+    bool is_mapped = false;
+    unsigned map_delta = 0; // ptr - start of mapping
 #if DEBUG
     // debugging aid
     struct Debug {
@@ -0,0 +1,252 @@
+/* stats.cpp -- per-phase timing and counters (see option "--stats")
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#include "../conf.h"
+#include "stats.h"
+#include <chrono>
+#include <time.h>
+
+/*************************************************************************
+// PhaseStats
+**************************************************************************/
+
+void PhaseStats::reset() noexcept {
+    for (auto &c : counters) {
+        c.wall_ns = 0;
+        c.cpu_ns = 0;
+        c.count = 0;
+        c.bytes = 0;
+    }
+}
+
+void PhaseStats::add(unsigned phase, upx_uint64_t wall_ns, upx_uint64_t cpu_ns,
+                     upx_uint64_t bytes) noexcept {
+    if very_unlikely (phase >= STATS_NUM_PHASES)
+        return;
+    Counter &c = counters[phase];
+    c.wall_ns += wall_ns;
+    c.cpu_ns += cpu_ns;
+    c.count += 1;
+    c.bytes += bytes;
+}
+
+void PhaseStats::merge(const PhaseStats &other) noexcept {
+    for (unsigned i = 0; i < STATS_NUM_PHASES; i++) {
+        const Counter &o = other.counters[i];
+        Counter &c = counters[i];
+        c.wall_ns += o.wall_ns;
+        c.cpu_ns += o.cpu_ns;
+        c.count += o.count;
+        c.bytes += o.bytes;
+    }
+}
+
+/*static*/ const char *PhaseStats::getPhaseName(unsigned phase) noexcept {
+    static const char *const names[STATS_NUM_PHASES] = {
+        "detect", "read", "filter", "compress", "overlap", "loader", "verify", "write",
+    };
+    return phase < STATS_NUM_PHASES ? names[phase] : "?";
+}
+
+/*static*/ upx_uint64_t PhaseStats::wallClockNs() noexcept {
+    const auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return (upx_uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+}
+
+// 0 where the platform has no per-thread CPU clock
+/*static*/ upx_uint64_t PhaseStats::threadCpuNs() noexcept {
+#if defined(CLOCK_THREAD_CPUTIME_ID) && !(ACC_OS_WIN32 || ACC_OS_WIN64)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (upx_uint64_t) ts.tv_sec * 1000000000u + (upx_uint64_t) ts.tv_nsec;
+#endif
+    return 0;
+}
+
+/*************************************************************************
+// JSON helpers
+**************************************************************************/
+
+void json_append(std::string &s, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    upx_safe_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    s += buf;
+}
+
+void json_append_string(std::string &s, const char *str) {
+    s += '"';
+    for (const char *p = str; *p; p++) {
+        const unsigned char c = (unsigned char) *p;
+        if (c == '"' || c == '\\') {
+            s += '\\';
+            s += (char) c;
+        } else if (c < 0x20)
+            json_append(s, "\\u%04x", c);
+        else
+            s += (char) c;
+    }
+    s += '"';
+}
+
+void PhaseStats::appendJson(std::string &s) const {
+    for (unsigned i = 0; i < STATS_NUM_PHASES; i++) {
+        const Counter &c = counters[i];
+        json_append(s,
+                    "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"wall_ns\":%llu,\"cpu_ns\":%llu}",
+                    i ? "," : "", getPhaseName(i), (unsigned long long) c.count,
+                    (unsigned long long) c.bytes, (unsigned long long) c.wall_ns,
+                    (unsigned long long) c.cpu_ns);
+    }
+}
+
+/*************************************************************************
+// PhaseTimer
+**************************************************************************/
+
+PhaseTimer::PhaseTimer(unsigned phase_, upx_uint64_t bytes_) noexcept
+    : stats(opt->phase_stats), phase(phase_), bytes(bytes_) {
+    if (stats != nullptr) {
+        wall_start = PhaseStats::wallClockNs();
+        cpu_start = PhaseStats::threadCpuNs();
+    }
+}
+
+PhaseTimer::~PhaseTimer() noexcept {
+    if (stats != nullptr)
+        stats->add(phase, PhaseStats::wallClockNs() - wall_start,
+                   PhaseStats::threadCpuNs() - cpu_start, bytes);
+}
+
+/*************************************************************************
+// JSON output; one line per file, and one line for the totals
+**************************************************************************/
+
+static PhaseStats total_stats;
+static upx_std_atomic(upx_uint64_t) total_wall_ns;
+static upx_std_atomic(unsigned) total_files;
+static upx_std_atomic(unsigned) total_failed;
+
+static void append_membuffer_stats(std::string &s, const MemBuffer::StatsInfo &now,
+                                   const MemBuffer::StatsInfo &before) {
+    // the counters are process-wide, so with concurrent files the
+    // per-file deltas also include the allocations of the other files
+    json_append(s,
+                "\"membuffer\":{\"allocs\":%u,\"deallocs\":%u,\"bytes\":%llu,"
+                "\"active_bytes\":%llu,\"pool_hits\":%u,\"pool_misses\":%u,"
+                "\"pool_cached_bytes\":%llu}",
+                now.alloc_counter - before.alloc_counter,
+                now.dealloc_counter - before.dealloc_counter,
+                (unsigned long long) (now.total_bytes - before.total_bytes),
+                (unsigned long long) now.total_active_bytes,
+                now.pool_hit_counter - before.pool_hit_counter,
+                now.pool_miss_counter - before.pool_miss_counter,
+                (unsigned long long) now.pool_cached_bytes);
+}
+
+static void print_line(const std::string &s) {
+#if (WITH_THREADS)
+    static std::mutex print_mutex;
+    std::lock_guard<std::mutex> lock(print_mutex);
+#endif
+    fflush(stdout);
+    fprintf(stderr, "%s\n", s.c_str());
+    fflush(stderr);
+}
+
+void stats_print_file(const char *iname, const PhaseStats &s, upx_uint64_t wall_ns,
+                      const MemBuffer::StatsInfo &mb_before, bool ok) {
+    total_stats.merge(s);
+    total_wall_ns += wall_ns;
+    total_files += 1;
+    if (!ok)
+        total_failed += 1;
+
+    std::string line;
+    line += "{\"file\":";
+    json_append_string(line, iname);
+    json_append(line, ",\"ok\":%s,\"wall_ns\":%llu,\"phases\":{", ok ? "true" : "false",
+                (unsigned long long) wall_ns);
+    s.appendJson(line);
+    line += "},";
+    append_membuffer_stats(line, MemBuffer::getStats(), mb_before);
+    line += "}";
+    print_line(line);
+}
+
+void stats_print_total() {
+    static const MemBuffer::StatsInfo zero = {};
+    std::string line;
+    json_append(line, "{\"total\":{\"files\":%u,\"failed\":%u,\"wall_ns\":%llu,\"phases\":{",
+                (unsigned) total_files, (unsigned) total_failed,
+                (unsigned long long) total_wall_ns);
+    total_stats.appendJson(line);
+    line += "},";
+    append_membuffer_stats(line, MemBuffer::getStats(), zero);
+    line += "}}";
+    print_line(line);
+}
+
+/*************************************************************************
+//
+**************************************************************************/
+
+TEST_CASE("PhaseStats") {
+    PhaseStats a, b;
+    a.add(STATS_COMPRESS, 10, 7, 100);
+    a.add(STATS_COMPRESS, 5, 3, 50);
+    b.add(STATS_COMPRESS, 1, 1, 1);
+    b.add(STATS_WRITE, 2, 0, 42);
+    a.merge(b);
+    CHECK(a.get(STATS_COMPRESS).count == 3);
+    CHECK(a.get(STATS_COMPRESS).bytes == 151);
+    CHECK(a.get(STATS_COMPRESS).wall_ns == 16);
+    CHECK(a.get(STATS_WRITE).bytes == 42);
+    CHECK(a.get(STATS_READ).count == 0);
+    std::string s;
+    b.appendJson(s);
+    CHECK(s.find("\"write\":{\"count\":1,\"bytes\":42,\"wall_ns\":2,\"cpu_ns\":0}") !=
+          std::string::npos);
+    s.clear();
+    json_append_string(s, "a\"b\\c\n");
+    CHECK(s == "\"a\\\"b\\\\c\\u000a\"");
+
+    // a PhaseTimer records into the collector of the current options
+    PhaseStats *const saved = opt->phase_stats;
+    opt->phase_stats = &a;
+    {
+        PhaseTimer t(STATS_READ, 3);
+        t.addBytes(4);
+    }
+    opt->phase_stats = saved;
+    CHECK(a.get(STATS_READ).count == 1);
+    CHECK(a.get(STATS_READ).bytes == 7);
+}
+
+/* vim:set ts=4 sw=4 et: */
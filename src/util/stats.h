@@ -0,0 +1,126 @@
+/* stats.h -- per-phase timing and counters (see option "--stats")
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#pragma once
+#ifndef UPX_STATS_H__
+#define UPX_STATS_H__ 1
+
+#include <string>
+#include "membuffer.h"
+
+/*************************************************************************
+// PhaseStats collects wall time, CPU time, call counts and byte counts
+// for the main phases of processing one file.
+//
+// The collector of the current file is "opt->phase_stats", so it follows
+// the options into ThreadPool work items; when "--stats" is not given
+// it is nullptr and a PhaseTimer does nothing. Phases may nest (for
+// example format detection reads the file), so the times are inclusive
+// and do not add up to the total.
+**************************************************************************/
+
+enum StatsPhase : unsigned {
+    STATS_DETECT,   // PackMaster::visitAllPackers()
+    STATS_READ,     // InputFile::read()
+    STATS_FILTER,   // Filter::filter()
+    STATS_COMPRESS, // upx_compress(), one call per trial
+    STATS_OVERLAP,  // Packer::findOverlapOverhead()
+    STATS_LOADER,   // Packer::buildLoader() and relocateLoader()
+    STATS_VERIFY,   // Packer::verifyOverlappingDecompression()
+    STATS_WRITE,    // OutputFile::write()
+    STATS_NUM_PHASES
+};
+
+class PhaseStats final {
+public:
+    struct Counter {
+        upx_std_atomic(upx_uint64_t) wall_ns;
+        upx_std_atomic(upx_uint64_t) cpu_ns;
+        upx_std_atomic(upx_uint64_t) count;
+        upx_std_atomic(upx_uint64_t) bytes;
+    };
+
+    PhaseStats() noexcept { reset(); }
+    void reset() noexcept;
+
+    void add(unsigned phase, upx_uint64_t wall_ns, upx_uint64_t cpu_ns,
+             upx_uint64_t bytes) noexcept;
+    void merge(const PhaseStats &other) noexcept;
+    const Counter &get(unsigned phase) const noexcept { return counters[phase]; }
+
+    // JSON object members for all phases, without the enclosing braces
+    void appendJson(std::string &s) const;
+
+    static const char *getPhaseName(unsigned phase) noexcept;
+    static upx_uint64_t wallClockNs() noexcept;
+    static upx_uint64_t threadCpuNs() noexcept;
+
+private:
+    Counter counters[STATS_NUM_PHASES];
+
+    // disable copy and move
+    PhaseStats(const PhaseStats &) = delete;
+    PhaseStats &operator=(const PhaseStats &) = delete;
+    PhaseStats(PhaseStats &&) noexcept = delete;
+    PhaseStats &operator=(PhaseStats &&) noexcept = delete;
+};
+
+// measures the lifetime of a scope
+class PhaseTimer final {
+public:
+    explicit PhaseTimer(unsigned phase_, upx_uint64_t bytes_ = 0) noexcept;
+    ~PhaseTimer() noexcept;
+    void addBytes(upx_uint64_t n) noexcept { bytes += n; }
+
+private:
+    PhaseStats *stats;
+    unsigned phase;
+    upx_uint64_t bytes;
+    upx_uint64_t wall_start = 0;
+    upx_uint64_t cpu_start = 0;
+
+    // disable copy and move
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+    PhaseTimer(PhaseTimer &&) noexcept = delete;
+    PhaseTimer &operator=(PhaseTimer &&) noexcept = delete;
+};
+
+// append a formatted number or other short unquoted JSON fragment
+void json_append(std::string &s, const char *fmt, ...) attribute_format(2, 3);
+// append "str" as a quoted JSON string with all special characters escaped
+void json_append_string(std::string &s, const char *str);
+
+// print one JSON line for a file to stderr and add it to the totals
+void stats_print_file(const char *iname, const PhaseStats &s, upx_uint64_t wall_ns,
+                      const MemBuffer::StatsInfo &mb_before, bool ok);
+// print one JSON line for the totals of all files to stderr
+void stats_print_total();
+
+#endif /* already included */
+
+/* vim:set ts=4 sw=4 et: */
@@ -0,0 +1,253 @@
+/* thread_pool.cpp --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#include "../conf.h"
+#include "thread_pool.h"
+#if (WITH_THREADS)
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#endif
+
+/*************************************************************************
+//
+**************************************************************************/
+
+#if (WITH_THREADS)
+
+struct ThreadPool::Job final {
+    const Func *func = nullptr;
+    Options *opt = nullptr; // options of the submitting thread
+    unsigned next = 0;    // next item to hand out
+    unsigned limit = 0;   // no items >= limit will get started
+    unsigned running = 0; // items currently being executed
+    unsigned error_index = UINT_MAX;
+    std::exception_ptr error;
+};
+
+struct ThreadPool::Impl final {
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<Job *> pending; // jobs with items left to hand out
+    std::vector<std::thread> workers;
+    bool stop = false;
+
+    void removePending(Job *job) {
+        for (size_t i = 0; i < pending.size(); i++)
+            if (pending[i] == job) {
+                pending.erase(pending.begin() + i);
+                return;
+            }
+    }
+
+    // claim and run the next item of job; called and returns with lock held
+    bool runOneItem(Job *job, std::unique_lock<std::mutex> &lock) {
+        if (job->next >= job->limit)
+            return false;
+        const unsigned i = job->next++;
+        job->running++;
+        if (job->next >= job->limit)
+            removePending(job);
+        lock.unlock();
+        Options *const saved_opt = opt;
+        opt = job->opt;
+        std::exception_ptr e;
+        try {
+            (*job->func)(i);
+        } catch (...) {
+            e = std::current_exception();
+        }
+        opt = saved_opt;
+        lock.lock();
+        if (e) {
+            // all lower items have already been claimed, so error_index
+            // will end up being the lowest failing index
+            if (i < job->error_index) {
+                job->error_index = i;
+                job->error = e;
+            }
+            if (job->limit > job->next) {
+                job->limit = job->next;
+                removePending(job);
+            }
+        }
+        job->running--;
+        if (job->running == 0 && job->next >= job->limit)
+            done_cv.notify_all();
+        return true;
+    }
+
+    void workerMain() noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            work_cv.wait(lock, [this] { return stop || !pending.empty(); });
+            if (stop)
+                return;
+            (void) runOneItem(pending.front(), lock);
+        }
+    }
+};
+
+ThreadPool::ThreadPool(unsigned n) {
+    if (n < 1)
+        n = 1;
+    impl = new Impl;
+    // the calling thread also works on its own items, so start n-1 workers
+    for (unsigned i = 1; i < n; i++) {
+        try {
+            impl->workers.emplace_back([this] { impl->workerMain(); });
+        } catch (const std::system_error &) {
+            break; // cannot create more threads; use what we have
+        }
+    }
+    num_threads = 1 + (unsigned) impl->workers.size();
+}
+
+ThreadPool::~ThreadPool() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        impl->stop = true;
+    }
+    impl->work_cv.notify_all();
+    for (auto &t : impl->workers)
+        t.join();
+    delete impl;
+    impl = nullptr;
+}
+
+void ThreadPool::parallelFor(unsigned n, const Func &func) {
+    if (n == 0)
+        return;
+    if (num_threads <= 1 || n == 1) {
+        for (unsigned i = 0; i < n; i++)
+            func(i);
+        return;
+    }
+    Job job;
+    job.func = &func;
+    job.opt = opt;
+    job.limit = n;
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    impl->pending.push_back(&job);
+    impl->work_cv.notify_all();
+    while (impl->runOneItem(&job, lock)) {
+    }
+    impl->done_cv.wait(lock, [&job] { return job.running == 0; });
+    lock.unlock();
+    if (job.error)
+        std::rethrow_exception(job.error);
+}
+
+unsigned ThreadPool::getDefaultNumThreads() noexcept {
+    unsigned n = std::thread::hardware_concurrency();
+    return UPX_MAX(1u, UPX_MIN(n, 64u));
+}
+
+#else // WITH_THREADS
+
+ThreadPool::ThreadPool(unsigned) {}
+
+ThreadPool::~ThreadPool() noexcept {}
+
+void ThreadPool::parallelFor(unsigned n, const Func &func) {
+    for (unsigned i = 0; i < n; i++)
+        func(i);
+}
+
+unsigned ThreadPool::getDefaultNumThreads() noexcept { return 1; }
+
+#endif // WITH_THREADS
+
+static ThreadPool *global_pool = nullptr;
+static unsigned global_num_threads = 1;
+#if (WITH_THREADS)
+static std::mutex global_pool_mutex;
+#endif
+
+ThreadPool *ThreadPool::getGlobalPool() {
+#if (WITH_THREADS)
+    std::lock_guard<std::mutex> lock(global_pool_mutex);
+#endif
+    if (global_pool == nullptr)
+        global_pool = new ThreadPool(global_num_threads);
+    return global_pool;
+}
+
+void ThreadPool::setGlobalNumThreads(unsigned n) {
+    if (n == 0)
+        n = getDefaultNumThreads();
+#if (WITH_THREADS)
+    std::lock_guard<std::mutex> lock(global_pool_mutex);
+#endif
+    if (n == global_num_threads)
+        return;
+    global_num_threads = n;
+    delete global_pool; // will get re-created on next use
+    global_pool = nullptr;
+}
+
+/*************************************************************************
+//
+**************************************************************************/
+
+TEST_CASE("ThreadPool") {
+    ThreadPool pool(4);
+    CHECK(pool.getNumThreads() >= 1);
+    upx_std_atomic(unsigned) sum;
+    sum = 0;
+    pool.parallelFor(100, [&sum](unsigned i) { sum += i + 1; });
+    CHECK(sum == 5050);
+    // nested calls must not deadlock
+    sum = 0;
+    pool.parallelFor(8, [&](unsigned) { pool.parallelFor(8, [&sum](unsigned) { sum += 1; }); });
+    CHECK(sum == 64);
+    // the lowest failing index wins
+    unsigned failed = 0;
+    try {
+        pool.parallelFor(100, [](unsigned i) {
+            if (i >= 3 && (i & 1))
+                throwInternalError(i == 3 ? "3" : "other");
+        });
+    } catch (const Throwable &e) {
+        failed = strcmp(e.getMsg(), "3") == 0 ? 3 : 1;
+    }
+    CHECK(failed == 3);
+    // work items see the options of the submitting thread
+    Options *const saved_opt = opt;
+    Options local_options;
+    opt = &local_options;
+    sum = 0;
+    pool.parallelFor(16, [&](unsigned) {
+        if (opt == &local_options)
+            sum += 1;
+    });
+    opt = saved_opt;
+    CHECK(sum == 16);
+}
+
+/* vim:set ts=4 sw=4 et: */
@@ -0,0 +1,85 @@
+/* thread_pool.h --
+
+   This file is part of the UPX executable compressor.
+
+   Copyright (C) 1996-2023 Markus Franz Xaver Johannes Oberhumer
+   Copyright (C) 1996-2023 Laszlo Molnar
+   All Rights Reserved.
+
+   UPX and the UCL library are free software; you can redistribute them
+   and/or modify them under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of
+   the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.
+   If not, write to the Free Software Foundation, Inc.,
+   59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+   Markus F.X.J. Oberhumer              Laszlo Molnar
+   <markus@oberhumer.com>               <ezerotven+github@gmail.com>
+ */
+
+#pragma once
+#ifndef UPX_THREAD_POOL_H__
+#define UPX_THREAD_POOL_H__ 1
+
+#include <functional>
+
+/*************************************************************************
+// A ThreadPool runs independent work items on a fixed set of worker
+// threads. The submitting thread always helps with its own items, so
+// nested calls from inside a work item cannot deadlock.
+//
+// Work items run with the current options (global "opt") of the
+// submitting thread.
+//
+// Without WITH_THREADS everything simply runs serially in the caller.
+**************************************************************************/
+
+class ThreadPool final {
+public:
+    typedef std::function<void(unsigned)> Func;
+
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool() noexcept;
+
+    // number of threads working on a parallelFor(), including the caller
+    unsigned getNumThreads() const noexcept { return num_threads; }
+
+    // Call func(i) for all i in [0, n) and wait until all calls are done.
+    // Items are started in increasing order. If an item throws, no further
+    // items are started and the exception of the lowest failing index is
+    // rethrown in the caller - just like a plain serial loop would do.
+    void parallelFor(unsigned n, const Func &func);
+
+    // the process-wide pool for packers and the batch driver, created on first use
+    static ThreadPool *getGlobalPool();
+    // set the size of the global pool (see option "--threads"); 0 means all CPUs
+    // NOTE: must not be called while the global pool is in use
+    static void setGlobalNumThreads(unsigned n);
+    static unsigned getDefaultNumThreads() noexcept;
+
+private:
+    unsigned num_threads = 1;
+#if (WITH_THREADS)
+    struct Job;
+    struct Impl;
+    Impl *impl = nullptr;
+#endif
+
+    // disable copy and move
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ThreadPool(ThreadPool &&) noexcept = delete;
+    ThreadPool &operator=(ThreadPool &&) noexcept = delete;
+};
+
+#endif /* already included */
+
+/* vim:set ts=4 sw=4 et: */
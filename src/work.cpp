@@ -35,6 +35,11 @@
 #include "packmast.h"
 #include "packer.h"
 #include "ui.h"
+#include "compress/compress.h"
+#include "util/compress_cache.h"
+#include "util/compress_hints.h"
+#include "util/stats.h"
+#include "util/thread_pool.h"
 
 #if (ACC_OS_DOS32) && defined(__DJGPP__)
 #define USE_FTIME 1
@@ -173,6 +178,7 @@ void do_one_file(const char *iname, char *oname) {
 
     // copy time stamp
     if (oname[0] && opt->preserve_timestamp && fo.isOpen()) {
+        fo.flush(); // a later write would update the time stamp again
 #if (USE_FTIME)
         r = setftime(fo.getFd(), &fi_ftime);
         IGNORE_ERROR(r);
@@ -263,63 +269,203 @@ static void unlink_ofile(char *oname) {
     }
 }
 
+// process a single file; returns -1 on fatal errors
+static int do_one_file_catch_impl(const char *iname, bool *ok) {
+    char oname[ACC_FN_PATH_MAX + 1];
+    oname[0] = 0;
+
+    try {
+        do_one_file(iname, oname);
+        *ok = true;
+    } catch (const Exception &e) {
+        unlink_ofile(oname);
+        if (opt->verbose >= 1 || (opt->verbose >= 0 && !e.isWarning()))
+            printErr(iname, &e);
+        main_set_exit_code(e.isWarning() ? EXIT_WARN : EXIT_ERROR);
+        // this is not fatal, continue processing more files
+    } catch (const Error &e) {
+        unlink_ofile(oname);
+        printErr(iname, &e);
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    } catch (std::bad_alloc *e) {
+        unlink_ofile(oname);
+        printErr(iname, "out of memory");
+        UNUSED(e);
+        // delete e;
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    } catch (const std::bad_alloc &) {
+        unlink_ofile(oname);
+        printErr(iname, "out of memory");
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    } catch (std::exception *e) {
+        unlink_ofile(oname);
+        printUnhandledException(iname, e);
+        // delete e;
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    } catch (const std::exception &e) {
+        unlink_ofile(oname);
+        printUnhandledException(iname, &e);
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    } catch (...) {
+        unlink_ofile(oname);
+        printUnhandledException(iname, nullptr);
+        main_set_exit_code(EXIT_ERROR);
+        return -1; // fatal error
+    }
+    return 0;
+}
+
+// see option "--stats"
+static int do_one_file_catch(const char *iname) {
+    bool ok = false;
+    int r;
+    if (!opt->stats)
+        r = do_one_file_catch_impl(iname, &ok);
+    else {
+        PhaseStats stats;
+        const MemBuffer::StatsInfo mb_before = MemBuffer::getStats();
+        const upx_uint64_t start = PhaseStats::wallClockNs();
+        opt->phase_stats = &stats;
+        r = do_one_file_catch_impl(iname, &ok);
+        opt->phase_stats = nullptr;
+        stats_print_file(iname, stats, PhaseStats::wallClockNs() - start, mb_before, ok);
+    }
+    // do not keep the scratch buffers and encoders of this file around
+    MemBuffer::releasePool();
+    CompressContextCacheBase::releaseAll();
+    return r;
+}
+
+#if (WITH_THREADS)
+
+/*************************************************************************
+// batch mode: process multiple files concurrently (see option "--threads")
+//
+// The largest files get started first so that the pool does not end up
+// waiting for a single big file. The console output of each file is
+// captured and printed in commandline order as soon as all preceding
+// files are done, so the output looks just like in serial mode.
+**************************************************************************/
+
+namespace {
+struct BatchFile final {
+    const char *iname = nullptr;
+    upx_off_t size = 0;
+    ConsoleCapture *cc = nullptr;
+    bool done = false;
+};
+} // namespace
+
+static const BatchFile *batch_sort_files = nullptr;
+
+static int __acc_cdecl_qsort batch_compare(const void *aa, const void *bb) {
+    const unsigned a = *(const unsigned *) aa;
+    const unsigned b = *(const unsigned *) bb;
+    const upx_off_t sa = batch_sort_files[a].size;
+    const upx_off_t sb = batch_sort_files[b].size;
+    if (sa != sb)
+        return sa > sb ? -1 : 1; // largest first
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static bool use_batch_mode(int nfiles) {
+    if (nfiles < 2 || opt->to_stdout || opt->output_name)
+        return false;
+    return ThreadPool::getGlobalPool()->getNumThreads() > 1;
+}
+
+static int do_files_batch(int i, int argc, char *argv[]) {
+    const unsigned n = (unsigned) (argc - i);
+    BatchFile *files = new BatchFile[n];
+    unsigned *order = New(unsigned, n);
+    for (unsigned k = 0; k < n; k++) {
+        files[k].iname = argv[i + k];
+        struct stat st;
+        if (stat(files[k].iname, &st) == 0)
+            files[k].size = st.st_size;
+        order[k] = k;
+    }
+    batch_sort_files = files;
+    qsort(order, n, sizeof(*order), batch_compare);
+    batch_sort_files = nullptr;
+
+    std::mutex print_mutex;
+    unsigned next_print = 0; // protected by print_mutex
+    bool fatal = false;      // protected by print_mutex
+
+    ThreadPool::getGlobalPool()->parallelFor(n, [&](unsigned item) {
+        BatchFile &bf = files[order[item]];
+        bool skip;
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            skip = fatal; // like the serial loop, do not start more files after a fatal error
+        }
+        if (!skip) {
+            // each file gets its own options; progress indicators make no sense here
+            Options file_options;
+            memcpy(&file_options, opt, sizeof(*opt)); // struct copy
+            file_options.no_progress = true;
+            file_options.concurrent_files =
+                UPX_MIN(n, ThreadPool::getGlobalPool()->getNumThreads());
+            Options *const saved_opt = opt;
+            opt = &file_options;
+            bf.cc = con_capture_new();
+            ConsoleCapture *const saved_cc = con_capture_set(bf.cc);
+            infoHeader();
+            const int r = do_one_file_catch(bf.iname);
+            con_capture_set(saved_cc);
+            opt = saved_opt;
+            if (r < 0) {
+                std::lock_guard<std::mutex> lock(print_mutex);
+                fatal = true;
+            }
+        }
+        // print the output of all files that are done, in commandline order
+        std::lock_guard<std::mutex> lock(print_mutex);
+        bf.done = true;
+        while (next_print < n && files[next_print].done) {
+            BatchFile &p = files[next_print++];
+            con_capture_flush(p.cc);
+            con_capture_delete(p.cc);
+            p.cc = nullptr;
+        }
+    });
+
+    delete[] files;
+    delete[] order;
+    return fatal ? -1 : 0;
+}
+
+#endif // WITH_THREADS
+
 int do_files(int i, int argc, char *argv[]) {
     upx_compiler_sanity_check();
+    // the MemBuffer pool and the cached encoders count against "--memory-budget", too
+    if (opt->o_unix.memory_budget) {
+        MemBuffer::setPoolLimit(((size_t) opt->o_unix.memory_budget << 20) / 16);
+        CompressContextCacheBase::setLimit(((size_t) opt->o_unix.memory_budget << 20) / 8);
+    }
     if (opt->verbose >= 1) {
         show_header();
         UiPacker::uiHeader();
     }
 
-    for (; i < argc; i++) {
-        infoHeader();
-
-        const char *iname = argv[i];
-        char oname[ACC_FN_PATH_MAX + 1];
-        oname[0] = 0;
-
-        try {
-            do_one_file(iname, oname);
-        } catch (const Exception &e) {
-            unlink_ofile(oname);
-            if (opt->verbose >= 1 || (opt->verbose >= 0 && !e.isWarning()))
-                printErr(iname, &e);
-            main_set_exit_code(e.isWarning() ? EXIT_WARN : EXIT_ERROR);
-            // this is not fatal, continue processing more files
-        } catch (const Error &e) {
-            unlink_ofile(oname);
-            printErr(iname, &e);
-            main_set_exit_code(EXIT_ERROR);
-            return -1; // fatal error
-        } catch (std::bad_alloc *e) {
-            unlink_ofile(oname);
-            printErr(iname, "out of memory");
-            UNUSED(e);
-            // delete e;
-            main_set_exit_code(EXIT_ERROR);
-            return -1; // fatal error
-        } catch (const std::bad_alloc &) {
-            unlink_ofile(oname);
-            printErr(iname, "out of memory");
-            main_set_exit_code(EXIT_ERROR);
-            return -1; // fatal error
-        } catch (std::exception *e) {
-            unlink_ofile(oname);
-            printUnhandledException(iname, e);
-            // delete e;
-            main_set_exit_code(EXIT_ERROR);
-            return -1; // fatal error
-        } catch (const std::exception &e) {
-            unlink_ofile(oname);
-            printUnhandledException(iname, &e);
-            main_set_exit_code(EXIT_ERROR);
-            return -1; // fatal error
-        } catch (...) {
-            unlink_ofile(oname);
-            printUnhandledException(iname, nullptr);
-            main_set_exit_code(EXIT_ERROR);
+#if (WITH_THREADS)
+    if (use_batch_mode(argc - i)) {
+        if (do_files_batch(i, argc, argv) < 0)
             return -1; // fatal error
+    } else
+#endif
+        for (; i < argc; i++) {
+            infoHeader();
+            if (do_one_file_catch(argv[i]) < 0)
+                return -1; // fatal error
         }
-    }
 
     if (opt->cmd == CMD_COMPRESS)
         UiPacker::uiPackTotal();
@@ -331,6 +477,12 @@ int do_files(int i, int argc, char *argv[]) {
         UiPacker::uiTestTotal();
     else if (opt->cmd == CMD_FILEINFO)
         UiPacker::uiFileInfoTotal();
+    if (opt->stats)
+        stats_print_total();
+    if (opt->cache_dir && opt->cmd == CMD_COMPRESS)
+        cache_evict();
+    if (opt->hints_file && opt->cmd == CMD_COMPRESS)
+        hints_save();
     return 0;
 }
 